@@ -0,0 +1,56 @@
+; Hardware IRQ entry stubs (32-bit)
+
+bits 32
+
+section .text
+
+extern irq_dispatch
+global irq_stub_table
+
+%macro IRQ_STUB 1
+irq_stub_%1:
+    pushad
+    cld
+    push dword %1
+    call irq_dispatch
+    add esp, 4
+    popad
+    iretd
+%endmacro
+
+IRQ_STUB 0
+IRQ_STUB 1
+IRQ_STUB 2
+IRQ_STUB 3
+IRQ_STUB 4
+IRQ_STUB 5
+IRQ_STUB 6
+IRQ_STUB 7
+IRQ_STUB 8
+IRQ_STUB 9
+IRQ_STUB 10
+IRQ_STUB 11
+IRQ_STUB 12
+IRQ_STUB 13
+IRQ_STUB 14
+IRQ_STUB 15
+
+section .rodata
+align 4
+irq_stub_table:
+    dd irq_stub_0
+    dd irq_stub_1
+    dd irq_stub_2
+    dd irq_stub_3
+    dd irq_stub_4
+    dd irq_stub_5
+    dd irq_stub_6
+    dd irq_stub_7
+    dd irq_stub_8
+    dd irq_stub_9
+    dd irq_stub_10
+    dd irq_stub_11
+    dd irq_stub_12
+    dd irq_stub_13
+    dd irq_stub_14
+    dd irq_stub_15
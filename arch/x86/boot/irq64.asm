@@ -0,0 +1,74 @@
+; Hardware IRQ entry stubs (64-bit)
+
+bits 64
+
+section .text
+
+extern irq_dispatch
+global irq_stub_table
+
+; The CPU aligns RSP to 16 bytes before pushing its 40-byte frame, so after
+; saving the nine caller-saved registers the stack is aligned for the call.
+%macro IRQ_STUB 1
+irq_stub_%1:
+    push rax
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
+    cld
+    mov edi, %1
+    mov rax, irq_dispatch
+    call rax
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rax
+    iretq
+%endmacro
+
+IRQ_STUB 0
+IRQ_STUB 1
+IRQ_STUB 2
+IRQ_STUB 3
+IRQ_STUB 4
+IRQ_STUB 5
+IRQ_STUB 6
+IRQ_STUB 7
+IRQ_STUB 8
+IRQ_STUB 9
+IRQ_STUB 10
+IRQ_STUB 11
+IRQ_STUB 12
+IRQ_STUB 13
+IRQ_STUB 14
+IRQ_STUB 15
+
+section .rodata
+align 8
+irq_stub_table:
+    dq irq_stub_0
+    dq irq_stub_1
+    dq irq_stub_2
+    dq irq_stub_3
+    dq irq_stub_4
+    dq irq_stub_5
+    dq irq_stub_6
+    dq irq_stub_7
+    dq irq_stub_8
+    dq irq_stub_9
+    dq irq_stub_10
+    dq irq_stub_11
+    dq irq_stub_12
+    dq irq_stub_13
+    dq irq_stub_14
+    dq irq_stub_15
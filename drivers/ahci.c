@@ -0,0 +1,472 @@
+#include <stddef.h>
+
+#include "ahci.h"
+#include "block.h"
+#include "io.h"
+#include "pci.h"
+
+#define AHCI_MAX_DISKS 4
+#define AHCI_SLOTS 32
+#define AHCI_PRDT_ENTRIES 8
+#define AHCI_MAX_SECTORS 128
+#define AHCI_TIMEOUT 1000000
+
+#define HBA_CAP 0x00
+#define HBA_GHC 0x04
+#define HBA_IS  0x08
+#define HBA_PI  0x0C
+
+#define HBA_CAP_SNCQ (1u << 30)
+#define HBA_GHC_AE   (1u << 31)
+
+#define PORT_BASE  0x100
+#define PORT_SIZE  0x80
+#define PORT_CLB   0x00
+#define PORT_CLBU  0x04
+#define PORT_FB    0x08
+#define PORT_FBU   0x0C
+#define PORT_IS    0x10
+#define PORT_IE    0x14
+#define PORT_CMD   0x18
+#define PORT_TFD   0x20
+#define PORT_SIG   0x24
+#define PORT_SSTS  0x28
+#define PORT_SERR  0x30
+#define PORT_SACT  0x34
+#define PORT_CI    0x38
+
+#define PORT_CMD_ST  (1u << 0)
+#define PORT_CMD_FRE (1u << 4)
+#define PORT_CMD_FR  (1u << 14)
+#define PORT_CMD_CR  (1u << 15)
+
+#define PORT_IS_TFES (1u << 30)
+
+#define TFD_BSY 0x80
+#define TFD_DRQ 0x08
+#define TFD_ERR 0x01
+
+#define SATA_SIG_ATA 0x00000101
+
+#define FIS_TYPE_REG_H2D 0x27
+
+#define ATA_CMD_READ_DMA_EXT  0x25
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_FPDMA    0x60
+#define ATA_CMD_WRITE_FPDMA   0x61
+#define ATA_CMD_IDENTIFY      0xEC
+
+struct ahci_cmd_header
+{
+    uint16_t flags;
+    uint16_t prdtl;
+    volatile uint32_t prdbc;
+    uint32_t ctba;
+    uint32_t ctbau;
+    uint32_t reserved[4];
+};
+
+struct ahci_prd
+{
+    uint32_t dba;
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;
+};
+
+struct ahci_cmd_table
+{
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    struct ahci_prd prdt[AHCI_PRDT_ENTRIES];
+};
+
+// Command list (1 KB aligned), received FIS area (256 byte aligned) and one
+// command table per slot (128 byte aligned), laid out to satisfy all three.
+struct ahci_port_mem
+{
+    struct ahci_cmd_header cmd_list[AHCI_SLOTS];
+    uint8_t fis[256];
+    struct ahci_cmd_table tables[AHCI_SLOTS];
+} __attribute__((aligned(1024)));
+
+struct ahci_disk
+{
+    uintptr_t port;
+    struct ahci_port_mem* mem;
+    uint32_t sectors;
+    uint32_t slots;
+    uint8_t ncq;
+    struct block_device block;
+};
+
+static struct ahci_port_mem g_ahci_mem[AHCI_MAX_DISKS];
+static struct ahci_disk g_ahci_disks[AHCI_MAX_DISKS];
+static int g_ahci_count = 0;
+static uintptr_t g_ahci_abar = 0;
+
+static const char* const g_ahci_names[AHCI_MAX_DISKS] = { "ahci0", "ahci1", "ahci2", "ahci3" };
+
+static uint32_t mmio_read32(uintptr_t addr)
+{
+    return *(volatile uint32_t*)addr;
+}
+
+static void mmio_write32(uintptr_t addr, uint32_t value)
+{
+    *(volatile uint32_t*)addr = value;
+}
+
+static void mem_zero(void* dst, size_t len)
+{
+    uint8_t* p = (uint8_t*)dst;
+    for (size_t i = 0; i < len; ++i)
+    {
+        p[i] = 0;
+    }
+}
+
+static int ahci_port_stop(uintptr_t port)
+{
+    uint32_t cmd = mmio_read32(port + PORT_CMD);
+    mmio_write32(port + PORT_CMD, cmd & ~(PORT_CMD_ST | PORT_CMD_FRE));
+    for (uint32_t i = 0; i < AHCI_TIMEOUT; ++i)
+    {
+        if ((mmio_read32(port + PORT_CMD) & (PORT_CMD_CR | PORT_CMD_FR)) == 0)
+        {
+            return 0;
+        }
+        io_wait();
+    }
+    return -1;
+}
+
+static void ahci_port_start(uintptr_t port)
+{
+    for (uint32_t i = 0; i < AHCI_TIMEOUT; ++i)
+    {
+        if ((mmio_read32(port + PORT_CMD) & PORT_CMD_CR) == 0)
+        {
+            break;
+        }
+        io_wait();
+    }
+    uint32_t cmd = mmio_read32(port + PORT_CMD);
+    mmio_write32(port + PORT_CMD, cmd | PORT_CMD_FRE);
+    mmio_write32(port + PORT_CMD, cmd | PORT_CMD_FRE | PORT_CMD_ST);
+}
+
+static void ahci_port_recover(uintptr_t port)
+{
+    ahci_port_stop(port);
+    mmio_write32(port + PORT_SERR, 0xFFFFFFFF);
+    mmio_write32(port + PORT_IS, 0xFFFFFFFF);
+    ahci_port_start(port);
+}
+
+static int ahci_wait_idle(uintptr_t port)
+{
+    for (uint32_t i = 0; i < AHCI_TIMEOUT; ++i)
+    {
+        if ((mmio_read32(port + PORT_TFD) & (TFD_BSY | TFD_DRQ)) == 0)
+        {
+            return 0;
+        }
+        io_wait();
+    }
+    return -1;
+}
+
+// Fills the command header and table for `slot`. NCQ commands carry the
+// sector count in the feature field and the tag in the count field.
+static int ahci_prepare(struct ahci_disk* disk, uint32_t slot, uint8_t command, uint64_t lba, uint32_t count, uintptr_t buffer, uint32_t bytes, int write)
+{
+    if ((buffer & 1) != 0)
+    {
+        return -1;
+    }
+
+    struct ahci_cmd_header* hdr = &disk->mem->cmd_list[slot];
+    struct ahci_cmd_table* table = &disk->mem->tables[slot];
+    mem_zero(table->cfis, sizeof(table->cfis));
+
+    uint8_t* fis = table->cfis;
+    fis[0] = FIS_TYPE_REG_H2D;
+    fis[1] = 0x80;
+    fis[2] = command;
+    fis[4] = (uint8_t)(lba & 0xFF);
+    fis[5] = (uint8_t)((lba >> 8) & 0xFF);
+    fis[6] = (uint8_t)((lba >> 16) & 0xFF);
+    fis[7] = command == ATA_CMD_IDENTIFY ? 0 : 0x40;
+    fis[8] = (uint8_t)((lba >> 24) & 0xFF);
+    fis[9] = (uint8_t)((lba >> 32) & 0xFF);
+    fis[10] = (uint8_t)((lba >> 40) & 0xFF);
+    if (command == ATA_CMD_READ_FPDMA || command == ATA_CMD_WRITE_FPDMA)
+    {
+        fis[3] = (uint8_t)(count & 0xFF);
+        fis[11] = (uint8_t)((count >> 8) & 0xFF);
+        fis[12] = (uint8_t)(slot << 3);
+    }
+    else
+    {
+        fis[12] = (uint8_t)(count & 0xFF);
+        fis[13] = (uint8_t)((count >> 8) & 0xFF);
+    }
+
+    uint16_t entries = 0;
+    while (bytes > 0)
+    {
+        if (entries == AHCI_PRDT_ENTRIES)
+        {
+            return -1;
+        }
+        uint32_t chunk = bytes > 0x400000 ? 0x400000 : bytes;
+        table->prdt[entries].dba = (uint32_t)buffer;
+        table->prdt[entries].dbau = (uint32_t)((uint64_t)buffer >> 32);
+        table->prdt[entries].reserved = 0;
+        table->prdt[entries].dbc = chunk - 1;
+        buffer += chunk;
+        bytes -= chunk;
+        entries++;
+    }
+
+    // CFL is the H2D FIS length in dwords; bit 6 marks host-to-device data
+    hdr->flags = (uint16_t)(5 | (write ? (1 << 6) : 0));
+    hdr->prdtl = entries;
+    hdr->prdbc = 0;
+    return 0;
+}
+
+static void ahci_issue(struct ahci_disk* disk, uint32_t mask)
+{
+    if (disk->ncq)
+    {
+        mmio_write32(disk->port + PORT_SACT, mask);
+    }
+    mmio_write32(disk->port + PORT_CI, mask);
+}
+
+static int ahci_wait(struct ahci_disk* disk, uint32_t mask)
+{
+    for (uint32_t i = 0; i < AHCI_TIMEOUT; ++i)
+    {
+        if (mmio_read32(disk->port + PORT_IS) & PORT_IS_TFES)
+        {
+            ahci_port_recover(disk->port);
+            return -1;
+        }
+        uint32_t pending = mmio_read32(disk->port + PORT_CI) | mmio_read32(disk->port + PORT_SACT);
+        if ((pending & mask) == 0)
+        {
+            mmio_write32(disk->port + PORT_IS, mmio_read32(disk->port + PORT_IS));
+            return 0;
+        }
+        io_wait();
+    }
+    ahci_port_recover(disk->port);
+    return -1;
+}
+
+// Splits the transfer into per-slot commands of up to AHCI_MAX_SECTORS and
+// puts them all in flight before waiting, so a queued drive can reorder them.
+static int ahci_transfer(struct ahci_disk* disk, uint32_t lba, uint32_t count, uintptr_t buffer, int write)
+{
+    if (ahci_wait_idle(disk->port) != 0)
+    {
+        return -1;
+    }
+
+    uint8_t command;
+    if (disk->ncq)
+    {
+        command = write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+    }
+    else
+    {
+        command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+    }
+
+    while (count > 0)
+    {
+        uint32_t mask = 0;
+        for (uint32_t slot = 0; slot < disk->slots && count > 0; ++slot)
+        {
+            uint32_t n = count > AHCI_MAX_SECTORS ? AHCI_MAX_SECTORS : count;
+            if (ahci_prepare(disk, slot, command, lba, n, buffer, n * BLOCK_SECTOR_SIZE, write) != 0)
+            {
+                return -1;
+            }
+            mask |= 1u << slot;
+            lba += n;
+            count -= n;
+            buffer += n * BLOCK_SECTOR_SIZE;
+        }
+
+        ahci_issue(disk, mask);
+        if (ahci_wait(disk, mask) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int ahci_block_read(struct block_device* dev, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+    return ahci_transfer((struct ahci_disk*)dev->driver_data, lba, count, (uintptr_t)buffer, 0);
+}
+
+static int ahci_block_write(struct block_device* dev, uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+    return ahci_transfer((struct ahci_disk*)dev->driver_data, lba, count, (uintptr_t)buffer, 1);
+}
+
+static const struct block_ops g_ahci_block_ops = {
+    ahci_block_read,
+    ahci_block_write,
+};
+
+static int ahci_identify(struct ahci_disk* disk, uint32_t hba_cap)
+{
+    static uint16_t identify[256];
+
+    if (ahci_wait_idle(disk->port) != 0)
+    {
+        return -1;
+    }
+    if (ahci_prepare(disk, 0, ATA_CMD_IDENTIFY, 0, 0, (uintptr_t)identify, sizeof(identify), 0) != 0)
+    {
+        return -1;
+    }
+    ahci_issue(disk, 1);
+    if (ahci_wait(disk, 1) != 0)
+    {
+        return -1;
+    }
+
+    uint64_t sectors;
+    if (identify[83] & (1 << 10))
+    {
+        sectors = (uint64_t)identify[100] | ((uint64_t)identify[101] << 16) | ((uint64_t)identify[102] << 32) | ((uint64_t)identify[103] << 48);
+    }
+    else
+    {
+        sectors = (uint32_t)identify[60] | ((uint32_t)identify[61] << 16);
+    }
+    disk->sectors = sectors > 0xFFFFFFFFull ? 0xFFFFFFFF : (uint32_t)sectors;
+
+    uint32_t hba_slots = ((hba_cap >> 8) & 0x1F) + 1;
+    disk->slots = hba_slots;
+    if ((hba_cap & HBA_CAP_SNCQ) && (identify[76] & (1 << 8)))
+    {
+        uint32_t depth = (uint32_t)(identify[75] & 0x1F) + 1;
+        disk->ncq = 1;
+        disk->slots = depth < hba_slots ? depth : hba_slots;
+    }
+    return 0;
+}
+
+static int ahci_port_init(struct ahci_disk* disk, uintptr_t port, struct ahci_port_mem* mem, uint32_t hba_cap)
+{
+    disk->port = port;
+    disk->mem = mem;
+    disk->ncq = 0;
+
+    if (ahci_port_stop(port) != 0)
+    {
+        return -1;
+    }
+
+    mem_zero(mem, sizeof(*mem));
+    for (uint32_t slot = 0; slot < AHCI_SLOTS; ++slot)
+    {
+        uintptr_t table = (uintptr_t)&mem->tables[slot];
+        mem->cmd_list[slot].ctba = (uint32_t)table;
+        mem->cmd_list[slot].ctbau = (uint32_t)((uint64_t)table >> 32);
+    }
+
+    mmio_write32(port + PORT_CLB, (uint32_t)(uintptr_t)mem->cmd_list);
+    mmio_write32(port + PORT_CLBU, (uint32_t)((uint64_t)(uintptr_t)mem->cmd_list >> 32));
+    mmio_write32(port + PORT_FB, (uint32_t)(uintptr_t)mem->fis);
+    mmio_write32(port + PORT_FBU, (uint32_t)((uint64_t)(uintptr_t)mem->fis >> 32));
+    mmio_write32(port + PORT_SERR, 0xFFFFFFFF);
+    mmio_write32(port + PORT_IS, 0xFFFFFFFF);
+    mmio_write32(port + PORT_IE, 0);
+
+    ahci_port_start(port);
+    return ahci_identify(disk, hba_cap);
+}
+
+void ahci_init(void)
+{
+    g_ahci_count = 0;
+
+    struct pci_device dev;
+    if (pci_find_class(0x01, 0x06, 0, &dev) != 0)
+    {
+        return;
+    }
+
+    g_ahci_abar = (uintptr_t)pci_bar(&dev, 5);
+    if (g_ahci_abar == 0)
+    {
+        return;
+    }
+    pci_enable(&dev, PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+
+    mmio_write32(g_ahci_abar + HBA_GHC, mmio_read32(g_ahci_abar + HBA_GHC) | HBA_GHC_AE);
+    uint32_t cap = mmio_read32(g_ahci_abar + HBA_CAP);
+    uint32_t implemented = mmio_read32(g_ahci_abar + HBA_PI);
+
+    for (uint32_t p = 0; p < 32 && g_ahci_count < AHCI_MAX_DISKS; ++p)
+    {
+        if ((implemented & (1u << p)) == 0)
+        {
+            continue;
+        }
+
+        uintptr_t port = g_ahci_abar + PORT_BASE + p * PORT_SIZE;
+        uint32_t ssts = mmio_read32(port + PORT_SSTS);
+        if ((ssts & 0x0F) != 3 || ((ssts >> 8) & 0x0F) != 1)
+        {
+            continue;
+        }
+        if (mmio_read32(port + PORT_SIG) != SATA_SIG_ATA)
+        {
+            continue;
+        }
+
+        struct ahci_disk* disk = &g_ahci_disks[g_ahci_count];
+        if (ahci_port_init(disk, port, &g_ahci_mem[g_ahci_count], cap) != 0)
+        {
+            continue;
+        }
+
+        disk->block.name = g_ahci_names[g_ahci_count];
+        disk->block.ops = &g_ahci_block_ops;
+        disk->block.sector_count = disk->sectors;
+        disk->block.sector_size = BLOCK_SECTOR_SIZE;
+        disk->block.max_sectors = disk->slots * AHCI_MAX_SECTORS;
+        disk->block.priority = 10;
+        disk->block.driver_data = disk;
+        block_register(&disk->block);
+        g_ahci_count++;
+    }
+
+    mmio_write32(g_ahci_abar + HBA_IS, 0xFFFFFFFF);
+}
+
+int ahci_disk_count(void)
+{
+    return g_ahci_count;
+}
+
+int ahci_ncq_depth(int disk)
+{
+    if (disk < 0 || disk >= g_ahci_count || !g_ahci_disks[disk].ncq)
+    {
+        return 0;
+    }
+    return (int)g_ahci_disks[disk].slots;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdint.h>
+
+void ahci_init(void);
+int ahci_disk_count(void);
+int ahci_ncq_depth(int disk);
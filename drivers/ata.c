@@ -1,29 +1,125 @@
 #include "ata.h"
+#include "block.h"
 #include "io.h"
+#include "irq.h"
+#include "pci.h"
+#include "timer.h"
 
-#define ATA_DATA       0x1F0
-#define ATA_ERROR      0x1F1
-#define ATA_SECCOUNT0  0x1F2
-#define ATA_LBA0       0x1F3
-#define ATA_LBA1       0x1F4
-#define ATA_LBA2       0x1F5
-#define ATA_HDDEVSEL   0x1F6
-#define ATA_COMMAND    0x1F7
-#define ATA_STATUS     0x1F7
+#define ATA_PRIMARY_IO     0x1F0
+#define ATA_PRIMARY_CTRL   0x3F6
+#define ATA_SECONDARY_IO   0x170
+#define ATA_SECONDARY_CTRL 0x376
 
-#define ATA_CMD_READ   0x20
-#define ATA_CMD_WRITE  0x30
-#define ATA_CMD_FLUSH  0xE7
+#define ATA_REG_DATA     0
+#define ATA_REG_ERROR    1
+#define ATA_REG_SECCOUNT 2
+#define ATA_REG_LBA0     3
+#define ATA_REG_LBA1     4
+#define ATA_REG_LBA2     5
+#define ATA_REG_HDDEVSEL 6
+#define ATA_REG_COMMAND  7
+#define ATA_REG_STATUS   7
+
+#define ATA_CMD_READ           0x20
+#define ATA_CMD_WRITE          0x30
+#define ATA_CMD_READ_DMA       0xC8
+#define ATA_CMD_WRITE_DMA      0xCA
+#define ATA_CMD_READ_MULTIPLE  0xC4
+#define ATA_CMD_WRITE_MULTIPLE 0xC5
+#define ATA_CMD_SET_MULTIPLE   0xC6
+#define ATA_CMD_FLUSH          0xE7
+#define ATA_CMD_IDENTIFY       0xEC
 
 #define ATA_SR_BSY 0x80
+#define ATA_SR_DF  0x20
 #define ATA_SR_DRQ 0x08
 #define ATA_SR_ERR 0x01
 
-static int ata_wait_busy(void)
+#define ATA_CTRL_NIEN 0x02
+
+#define ATA_BM_COMMAND 0
+#define ATA_BM_STATUS  2
+#define ATA_BM_PRDT    4
+
+#define ATA_BM_CMD_START 0x01
+#define ATA_BM_CMD_READ  0x08
+
+#define ATA_BM_SR_ACTIVE 0x01
+#define ATA_BM_SR_ERR    0x02
+#define ATA_BM_SR_IRQ    0x04
+
+#define ATA_PRD_EOT     0x8000
+#define ATA_PRD_ENTRIES 8
+
+#define ATA_IRQ_TIMEOUT_SECONDS 5
+
+struct ata_prd
+{
+    uint32_t address;
+    uint16_t byte_count;
+    uint16_t flags;
+} __attribute__((packed));
+
+struct ata_request
+{
+    uint32_t count;
+    uint32_t done;
+    uint8_t* read_buffer;
+    const uint8_t* write_buffer;
+    uint8_t dma;
+    volatile uint8_t complete;
+    volatile int status;
+};
+
+struct ata_channel
+{
+    uint16_t io;
+    uint16_t ctrl;
+    uint16_t bm;
+    uint8_t irq;
+    uint8_t irq_mode;
+    uint8_t block;
+    struct ata_prd* prdt;
+    struct ata_request* volatile active;
+};
+
+struct ata_drive
+{
+    struct ata_channel* channel;
+    uint8_t slave;
+    uint8_t present;
+    uint8_t multiple;
+    uint8_t dma;
+    uint32_t sectors;
+};
+
+// 64 bytes each and 64-byte aligned, so a table never crosses a 64 KB boundary
+static struct ata_prd g_ata_prdt[2][ATA_PRD_ENTRIES] __attribute__((aligned(64)));
+
+static struct ata_channel g_ata_channels[2] = {
+    { ATA_PRIMARY_IO, ATA_PRIMARY_CTRL, 0, 14, 0, 1, g_ata_prdt[0], 0 },
+    { ATA_SECONDARY_IO, ATA_SECONDARY_CTRL, 0, 15, 0, 1, g_ata_prdt[1], 0 },
+};
+
+static struct ata_drive g_ata_drives[4] = {
+    { &g_ata_channels[0], 0, 0, 0, 0, 0 },
+    { &g_ata_channels[0], 1, 0, 0, 0, 0 },
+    { &g_ata_channels[1], 0, 0, 0, 0, 0 },
+    { &g_ata_channels[1], 1, 0, 0, 0, 0 },
+};
+
+static struct block_device g_ata_block[4];
+static const char* const g_ata_block_names[4] = { "ata0", "ata1", "ata2", "ata3" };
+
+static struct ata_drive* g_ata_disk = &g_ata_drives[0];
+static int g_ata_pio_path = ATA_PIO_STRING;
+static int g_ata_dma_enabled = 1;
+
+static int ata_wait_busy(struct ata_channel* ch)
 {
     for (uint32_t i = 0; i < 1000000; ++i)
     {
-        uint8_t st = inb(ATA_STATUS);
+        uint8_t st = inb(ch->io + ATA_REG_STATUS);
         if ((st & ATA_SR_BSY) == 0)
         {
             return 0;
@@ -33,11 +129,11 @@ static int ata_wait_busy(void)
     return -1;
 }
 
-static int ata_wait_drq(void)
+static int ata_wait_drq(struct ata_channel* ch)
 {
     for (uint32_t i = 0; i < 100000; ++i)
     {
-        uint8_t status = inb(ATA_STATUS);
+        uint8_t status = inb(ch->io + ATA_REG_STATUS);
         if (status & ATA_SR_ERR)
         {
             return -1;
@@ -51,92 +147,636 @@ static int ata_wait_drq(void)
     return -1;
 }
 
-static void ata_select_drive(uint32_t lba)
+static void ata_select_drive(struct ata_drive* drive, uint32_t lba)
 {
-    outb(ATA_HDDEVSEL, 0xE0 | ((lba >> 24) & 0x0F));
+    outb(drive->channel->io + ATA_REG_HDDEVSEL, 0xE0 | (drive->slave << 4) | ((lba >> 24) & 0x0F));
     io_wait();
 }
 
-int ata_read_sector(uint32_t lba, uint8_t* buffer)
+static int ata_check_present(struct ata_channel* ch)
 {
-    uint8_t status = inb(ATA_STATUS);
+    uint8_t status = inb(ch->io + ATA_REG_STATUS);
     if (status == 0xFF)
     {
         io_wait();
-        status = inb(ATA_STATUS);
+        status = inb(ch->io + ATA_REG_STATUS);
         if (status == 0xFF)
         {
             return -2;
         }
     }
+    return 0;
+}
+
+static void ata_setup_lba(struct ata_channel* ch, uint32_t lba, uint32_t count)
+{
+    // A sector count register value of 0 means 256 sectors
+    outb(ch->io + ATA_REG_SECCOUNT, (uint8_t)(count & 0xFF));
+    outb(ch->io + ATA_REG_LBA0, (uint8_t)(lba & 0xFF));
+    outb(ch->io + ATA_REG_LBA1, (uint8_t)((lba >> 8) & 0xFF));
+    outb(ch->io + ATA_REG_LBA2, (uint8_t)((lba >> 16) & 0xFF));
+}
 
-    if (ata_wait_busy() != 0)
+static void ata_read_data(struct ata_channel* ch, uint8_t* buffer)
+{
+    if (g_ata_pio_path == ATA_PIO_STRING)
     {
-        return -1;
+        insw(ch->io + ATA_REG_DATA, buffer, 256);
+        return;
+    }
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint16_t data = inw(ch->io + ATA_REG_DATA);
+        buffer[i * 2] = (uint8_t)(data & 0xFF);
+        buffer[i * 2 + 1] = (uint8_t)(data >> 8);
+    }
+}
+
+static void ata_write_data(struct ata_channel* ch, const uint8_t* buffer)
+{
+    if (g_ata_pio_path == ATA_PIO_STRING)
+    {
+        outsw(ch->io + ATA_REG_DATA, buffer, 256);
+        return;
     }
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint16_t data = (uint16_t)buffer[i * 2] | ((uint16_t)buffer[i * 2 + 1] << 8);
+        outw(ch->io + ATA_REG_DATA, data);
+    }
+}
 
-    ata_select_drive(lba);
-    outb(ATA_SECCOUNT0, 1);
-    outb(ATA_LBA0, (uint8_t)(lba & 0xFF));
-    outb(ATA_LBA1, (uint8_t)((lba >> 8) & 0xFF));
-    outb(ATA_LBA2, (uint8_t)((lba >> 16) & 0xFF));
-    outb(ATA_COMMAND, ATA_CMD_READ);
+// Moves one DRQ block (a single sector, or up to `block` sectors with
+// READ/WRITE MULTIPLE) between the data port and the request buffer.
+static void ata_pio_block(struct ata_channel* ch, struct ata_request* req)
+{
+    uint32_t n = req->count - req->done;
+    if (n > ch->block)
+    {
+        n = ch->block;
+    }
+    for (uint32_t s = 0; s < n; ++s)
+    {
+        uint32_t offset = (req->done + s) * ATA_SECTOR_SIZE;
+        if (req->write_buffer != 0)
+        {
+            ata_write_data(ch, req->write_buffer + offset);
+        }
+        else
+        {
+            ata_read_data(ch, req->read_buffer + offset);
+        }
+    }
+    req->done += n;
+}
 
-    if (ata_wait_busy() != 0 || ata_wait_drq() != 0)
+// Describes the buffer as physical regions for the bus-master engine. Buffers
+// are identity mapped, so the only constraints are the PRD format itself:
+// 32-bit even addresses and regions that do not cross a 64 KB boundary.
+static int ata_build_prdt(struct ata_channel* ch, uintptr_t address, uint32_t bytes)
+{
+    if ((address & 1) != 0 || (uint64_t)address + bytes > 0x100000000ull)
     {
         return -1;
     }
 
-    for (uint32_t i = 0; i < 256; ++i)
+    uint32_t entry = 0;
+    while (bytes > 0)
     {
-        uint16_t data = inw(ATA_DATA);
-        buffer[i * 2] = (uint8_t)(data & 0xFF);
-        buffer[i * 2 + 1] = (uint8_t)(data >> 8);
+        if (entry == ATA_PRD_ENTRIES)
+        {
+            return -1;
+        }
+        uint32_t chunk = 0x10000 - (uint32_t)(address & 0xFFFF);
+        if (chunk > bytes)
+        {
+            chunk = bytes;
+        }
+        ch->prdt[entry].address = (uint32_t)address;
+        ch->prdt[entry].byte_count = (uint16_t)(chunk & 0xFFFF);
+        ch->prdt[entry].flags = 0;
+        address += chunk;
+        bytes -= chunk;
+        entry++;
     }
+    ch->prdt[entry - 1].flags = ATA_PRD_EOT;
+    return 0;
+}
 
+static int ata_dma_stop(struct ata_channel* ch, uint8_t ata_status)
+{
+    outb(ch->bm + ATA_BM_COMMAND, 0);
+    uint8_t bm_status = inb(ch->bm + ATA_BM_STATUS);
+    outb(ch->bm + ATA_BM_STATUS, bm_status | ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+    if ((bm_status & ATA_BM_SR_ERR) || (ata_status & (ATA_SR_ERR | ATA_SR_DF)))
+    {
+        return -1;
+    }
     return 0;
 }
 
-int ata_write_sector(uint32_t lba, const uint8_t* buffer)
+static int ata_dma_poll(struct ata_channel* ch)
 {
-    uint8_t status = inb(ATA_STATUS);
-    if (status == 0xFF)
+    for (uint32_t i = 0; i < 1000000; ++i)
     {
+        if (inb(ch->bm + ATA_BM_STATUS) & ATA_BM_SR_IRQ)
+        {
+            if (ata_wait_busy(ch) != 0)
+            {
+                break;
+            }
+            return ata_dma_stop(ch, inb(ch->io + ATA_REG_STATUS));
+        }
         io_wait();
-        status = inb(ATA_STATUS);
-        if (status == 0xFF)
+    }
+    ata_dma_stop(ch, ATA_SR_ERR);
+    return -1;
+}
+
+static void ata_complete(struct ata_channel* ch, struct ata_request* req, int status)
+{
+    ch->active = 0;
+    req->status = status;
+    req->complete = 1;
+}
+
+static void ata_channel_irq(struct ata_channel* ch)
+{
+    // Reading the status register also acknowledges INTRQ
+    uint8_t status = inb(ch->io + ATA_REG_STATUS);
+    struct ata_request* req = ch->active;
+    if (req == 0)
+    {
+        return;
+    }
+
+    if (req->dma)
+    {
+        if ((inb(ch->bm + ATA_BM_STATUS) & ATA_BM_SR_IRQ) == 0)
         {
-            return -2;
+            return;
+        }
+        ata_complete(ch, req, ata_dma_stop(ch, status));
+        return;
+    }
+
+    if (status & (ATA_SR_ERR | ATA_SR_DF))
+    {
+        ata_complete(ch, req, -1);
+        return;
+    }
+
+    if (req->write_buffer != 0 && req->done == req->count)
+    {
+        ata_complete(ch, req, 0);
+        return;
+    }
+
+    if ((status & ATA_SR_DRQ) == 0)
+    {
+        ata_complete(ch, req, -1);
+        return;
+    }
+
+    ata_pio_block(ch, req);
+    if (req->write_buffer == 0 && req->done == req->count)
+    {
+        ata_complete(ch, req, 0);
+    }
+}
+
+static void ata_primary_irq(void)
+{
+    ata_channel_irq(&g_ata_channels[0]);
+}
+
+static void ata_secondary_irq(void)
+{
+    ata_channel_irq(&g_ata_channels[1]);
+}
+
+static int ata_wait_request(struct ata_channel* ch, struct ata_request* req)
+{
+    uint32_t start = timer_ticks();
+    uint32_t limit = timer_tick_hz() * ATA_IRQ_TIMEOUT_SECONDS;
+
+    for (;;)
+    {
+        irq_disable();
+        if (req->complete)
+        {
+            break;
+        }
+        if (timer_ticks() - start >= limit)
+        {
+            ch->active = 0;
+            if (req->dma)
+            {
+                ata_dma_stop(ch, ATA_SR_ERR);
+            }
+            irq_enable();
+            return -1;
+        }
+        irq_wait();
+    }
+    irq_enable();
+    return req->status;
+}
+
+static int ata_run_polled(struct ata_channel* ch, struct ata_request* req)
+{
+    while (req->done < req->count)
+    {
+        if (ata_wait_busy(ch) != 0 || ata_wait_drq(ch) != 0)
+        {
+            return -1;
+        }
+        ata_pio_block(ch, req);
+    }
+
+    if (req->write_buffer != 0)
+    {
+        if (ata_wait_busy(ch) != 0)
+        {
+            return -1;
+        }
+        if (inb(ch->io + ATA_REG_STATUS) & ATA_SR_ERR)
+        {
+            return -1;
         }
     }
 
-    if (ata_wait_busy() != 0)
+    return 0;
+}
+
+static int ata_issue(struct ata_drive* drive, uint32_t lba, uint32_t count, uint8_t* read_buffer, const uint8_t* write_buffer, int dma)
+{
+    struct ata_channel* ch = drive->channel;
+    int rc = ata_check_present(ch);
+    if (rc != 0)
+    {
+        return rc;
+    }
+
+    if (ata_wait_busy(ch) != 0)
     {
         return -1;
     }
 
-    ata_select_drive(lba);
-    io_wait();
+    struct ata_request req;
+    req.count = count;
+    req.done = 0;
+    req.read_buffer = read_buffer;
+    req.write_buffer = write_buffer;
+    req.dma = (uint8_t)dma;
+    req.complete = 0;
+    req.status = 0;
+
+    uint8_t command;
+    if (dma)
+    {
+        command = write_buffer != 0 ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+    }
+    else if (write_buffer != 0)
+    {
+        command = drive->multiple != 0 ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_WRITE;
+    }
+    else
+    {
+        command = drive->multiple != 0 ? ATA_CMD_READ_MULTIPLE : ATA_CMD_READ;
+    }
+    ch->block = drive->multiple != 0 ? drive->multiple : 1;
+
+    uint8_t bm_direction = write_buffer != 0 ? 0 : ATA_BM_CMD_READ;
+    if (dma)
+    {
+        outb(ch->bm + ATA_BM_COMMAND, 0);
+        outl(ch->bm + ATA_BM_PRDT, (uint32_t)(uintptr_t)ch->prdt);
+        outb(ch->bm + ATA_BM_STATUS, inb(ch->bm + ATA_BM_STATUS) | ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+        outb(ch->bm + ATA_BM_COMMAND, bm_direction);
+    }
+
+    if (ch->irq_mode)
+    {
+        // Interrupts stay off until ata_wait_request halts, so the handler
+        // never races with the submission path over the request state
+        irq_disable();
+        ch->active = &req;
+    }
+
+    ata_select_drive(drive, lba);
+    if (write_buffer != 0)
+    {
+        io_wait();
+        io_wait();
+        io_wait();
+    }
+    ata_setup_lba(ch, lba, count);
     io_wait();
+    outb(ch->io + ATA_REG_COMMAND, command);
     io_wait();
-    outb(ATA_SECCOUNT0, 1);
-    outb(ATA_LBA0, (uint8_t)(lba & 0xFF));
-    outb(ATA_LBA1, (uint8_t)((lba >> 8) & 0xFF));
-    outb(ATA_LBA2, (uint8_t)((lba >> 16) & 0xFF));
+
+    if (dma)
+    {
+        outb(ch->bm + ATA_BM_COMMAND, bm_direction | ATA_BM_CMD_START);
+        if (!ch->irq_mode)
+        {
+            return ata_dma_poll(ch);
+        }
+        return ata_wait_request(ch, &req);
+    }
+
+    if (!ch->irq_mode)
+    {
+        return ata_run_polled(ch, &req);
+    }
+
+    if (write_buffer != 0)
+    {
+        // The first block of a write is requested without an interrupt
+        if (ata_wait_busy(ch) != 0 || ata_wait_drq(ch) != 0)
+        {
+            ch->active = 0;
+            irq_enable();
+            return -1;
+        }
+        ata_pio_block(ch, &req);
+    }
+
+    return ata_wait_request(ch, &req);
+}
+
+static int ata_transfer(struct ata_drive* drive, uint32_t lba, uint32_t count, uint8_t* read_buffer, const uint8_t* write_buffer)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    if (count > ATA_MAX_SECTORS)
+    {
+        return -1;
+    }
+
+    if (drive->dma && g_ata_dma_enabled)
+    {
+        uintptr_t address = write_buffer != 0 ? (uintptr_t)write_buffer : (uintptr_t)read_buffer;
+        if (ata_build_prdt(drive->channel, address, count * ATA_SECTOR_SIZE) == 0)
+        {
+            int rc = ata_issue(drive, lba, count, read_buffer, write_buffer, 1);
+            if (rc == 0 || rc == -2)
+            {
+                return rc;
+            }
+            // Fall through and retry the request with PIO
+        }
+    }
+
+    return ata_issue(drive, lba, count, read_buffer, write_buffer, 0);
+}
+
+static int ata_block_read(struct block_device* dev, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+    return ata_transfer((struct ata_drive*)dev->driver_data, lba, count, buffer, 0);
+}
+
+static int ata_block_write(struct block_device* dev, uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+    return ata_transfer((struct ata_drive*)dev->driver_data, lba, count, 0, buffer);
+}
+
+static const struct block_ops g_ata_block_ops = {
+    ata_block_read,
+    ata_block_write,
+};
+
+static int ata_identify(struct ata_drive* drive)
+{
+    struct ata_channel* ch = drive->channel;
+
+    outb(ch->io + ATA_REG_HDDEVSEL, 0xA0 | (drive->slave << 4));
     io_wait();
-    outb(ATA_COMMAND, ATA_CMD_WRITE);
+    ata_setup_lba(ch, 0, 0);
+    outb(ch->io + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
     io_wait();
 
-    for (uint32_t i = 0; i < 256; ++i)
+    if (inb(ch->io + ATA_REG_STATUS) == 0)
     {
-        uint16_t data = (uint16_t)buffer[i * 2] | ((uint16_t)buffer[i * 2 + 1] << 8);
-        outw(ATA_DATA, data);
+        return -1;
     }
-
-    if (ata_wait_busy() != 0)
+    if (ata_wait_busy(ch) != 0)
+    {
+        return -1;
+    }
+    // ATAPI and SATA devices abort IDENTIFY and leave a signature in LBA1/LBA2
+    if (inb(ch->io + ATA_REG_LBA1) != 0 || inb(ch->io + ATA_REG_LBA2) != 0)
+    {
+        return -1;
+    }
+    if (ata_wait_drq(ch) != 0)
     {
         return -1;
     }
 
+    uint16_t identify[256];
+    insw(ch->io + ATA_REG_DATA, identify, 256);
+
+    drive->present = 1;
+    drive->sectors = (uint32_t)identify[60] | ((uint32_t)identify[61] << 16);
+    drive->multiple = 0;
+    drive->dma = (identify[49] & 0x0100) != 0 && ch->bm != 0;
+
+    uint8_t max_multiple = (uint8_t)(identify[47] & 0xFF);
+    if (max_multiple < 2)
+    {
+        return 0;
+    }
+
+    if (ata_wait_busy(ch) != 0)
+    {
+        return 0;
+    }
+    ata_select_drive(drive, 0);
+    outb(ch->io + ATA_REG_SECCOUNT, max_multiple);
+    outb(ch->io + ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+    io_wait();
+
+    if (ata_wait_busy(ch) != 0)
+    {
+        return 0;
+    }
+    if (inb(ch->io + ATA_REG_STATUS) & ATA_SR_ERR)
+    {
+        return 0;
+    }
+
+    drive->multiple = max_multiple;
     return 0;
 }
+
+// Finds the PCI IDE controller and hands each channel that is still in
+// legacy compatibility mode its bus-master register block from BAR4.
+static void ata_probe_bus_master(void)
+{
+    g_ata_channels[0].bm = 0;
+    g_ata_channels[1].bm = 0;
+
+    struct pci_device dev;
+    if (pci_find_class(0x01, 0x01, 0, &dev) != 0)
+    {
+        return;
+    }
+    if ((dev.prog_if & 0x80) == 0)
+    {
+        return;
+    }
+
+    uint32_t bar4 = pci_read32(&dev, 0x20);
+    if ((bar4 & 0x01) == 0)
+    {
+        return;
+    }
+    uint16_t bm = (uint16_t)(bar4 & 0xFFFC);
+    if (bm == 0)
+    {
+        return;
+    }
+
+    pci_enable(&dev, PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+    if ((dev.prog_if & 0x01) == 0)
+    {
+        g_ata_channels[0].bm = bm;
+    }
+    if ((dev.prog_if & 0x04) == 0)
+    {
+        g_ata_channels[1].bm = (uint16_t)(bm + 8);
+    }
+}
+
+void ata_init(void)
+{
+    g_ata_disk = 0;
+    ata_probe_bus_master();
+
+    for (int c = 0; c < 2; ++c)
+    {
+        struct ata_channel* ch = &g_ata_channels[c];
+        ch->irq_mode = 0;
+        ch->active = 0;
+
+        if (ata_check_present(ch) != 0)
+        {
+            continue;
+        }
+
+        // Probe with interrupts masked at the device
+        outb(ch->ctrl, ATA_CTRL_NIEN);
+
+        int found = 0;
+        for (int d = 0; d < 2; ++d)
+        {
+            struct ata_drive* drive = &g_ata_drives[c * 2 + d];
+            drive->present = 0;
+            drive->multiple = 0;
+            drive->dma = 0;
+            drive->sectors = 0;
+            if (ata_identify(drive) == 0)
+            {
+                found = 1;
+                if (g_ata_disk == 0)
+                {
+                    g_ata_disk = drive;
+                }
+            }
+        }
+
+        // IRQ completion needs the timer tick to bound each wait
+        if (found && timer_tick_hz() != 0)
+        {
+            irq_register(ch->irq, c == 0 ? ata_primary_irq : ata_secondary_irq);
+            ch->irq_mode = 1;
+            outb(ch->ctrl, 0);
+        }
+    }
+
+    if (g_ata_disk == 0)
+    {
+        g_ata_disk = &g_ata_drives[0];
+    }
+
+    for (int i = 0; i < 4; ++i)
+    {
+        if (!g_ata_drives[i].present)
+        {
+            continue;
+        }
+        struct block_device* dev = &g_ata_block[i];
+        dev->name = g_ata_block_names[i];
+        dev->ops = &g_ata_block_ops;
+        dev->sector_count = g_ata_drives[i].sectors;
+        dev->sector_size = ATA_SECTOR_SIZE;
+        dev->max_sectors = ATA_MAX_SECTORS;
+        dev->priority = 0;
+        dev->driver_data = &g_ata_drives[i];
+        block_register(dev);
+    }
+}
+
+uint32_t ata_sector_count(void)
+{
+    return g_ata_disk->sectors;
+}
+
+uint8_t ata_multiple_sectors(void)
+{
+    return g_ata_disk->multiple;
+}
+
+int ata_irq_mode(void)
+{
+    return g_ata_disk->channel->irq_mode;
+}
+
+int ata_dma_available(void)
+{
+    return g_ata_disk->dma;
+}
+
+void ata_set_dma(int enabled)
+{
+    g_ata_dma_enabled = enabled;
+}
+
+int ata_dma_enabled(void)
+{
+    return g_ata_dma_enabled;
+}
+
+void ata_set_pio_path(int path)
+{
+    g_ata_pio_path = path;
+}
+
+int ata_pio_path(void)
+{
+    return g_ata_pio_path;
+}
+
+int ata_read_sectors(uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+    return ata_transfer(g_ata_disk, lba, count, buffer, 0);
+}
+
+int ata_write_sectors(uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+    return ata_transfer(g_ata_disk, lba, count, 0, buffer);
+}
+
+int ata_read_sector(uint32_t lba, uint8_t* buffer)
+{
+    return ata_read_sectors(lba, 1, buffer);
+}
+
+int ata_write_sector(uint32_t lba, const uint8_t* buffer)
+{
+    return ata_write_sectors(lba, 1, buffer);
+}
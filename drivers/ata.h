@@ -2,5 +2,25 @@
 
 #include <stdint.h>
 
+#define ATA_SECTOR_SIZE 512
+#define ATA_MAX_SECTORS 256
+
+enum
+{
+    ATA_PIO_WORDS = 0,
+    ATA_PIO_STRING = 1
+};
+
+void ata_init(void);
 int ata_read_sector(uint32_t lba, uint8_t* buffer);
 int ata_write_sector(uint32_t lba, const uint8_t* buffer);
+int ata_read_sectors(uint32_t lba, uint32_t count, uint8_t* buffer);
+int ata_write_sectors(uint32_t lba, uint32_t count, const uint8_t* buffer);
+uint32_t ata_sector_count(void);
+uint8_t ata_multiple_sectors(void);
+int ata_irq_mode(void);
+int ata_dma_available(void);
+void ata_set_dma(int enabled);
+int ata_dma_enabled(void);
+void ata_set_pio_path(int path);
+int ata_pio_path(void);
@@ -0,0 +1,279 @@
+#include "block.h"
+
+static struct block_device* g_block_devices[BLOCK_MAX_DEVICES];
+static int g_block_count = 0;
+
+// Staging area for merged requests whose buffers are not adjacent in memory
+static uint8_t g_block_bounce[BLOCK_MERGE_SECTORS * BLOCK_SECTOR_SIZE];
+
+static void block_copy(uint8_t* dst, const uint8_t* src, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; ++i)
+    {
+        dst[i] = src[i];
+    }
+}
+
+// Devices are kept ordered by priority so faster backends are tried first
+// when the filesystem looks for a volume to mount.
+void block_register(struct block_device* dev)
+{
+    if (g_block_count >= BLOCK_MAX_DEVICES)
+    {
+        return;
+    }
+
+    if (dev->sector_size == 0)
+    {
+        dev->sector_size = BLOCK_SECTOR_SIZE;
+    }
+    dev->queue.count = 0;
+    dev->queue.plugged = 0;
+    dev->queue.error = 0;
+    dev->stats.submitted = 0;
+    dev->stats.dispatched = 0;
+    dev->stats.merged = 0;
+    dev->stats.max_depth = 0;
+
+    int i = g_block_count;
+    while (i > 0 && g_block_devices[i - 1]->priority < dev->priority)
+    {
+        g_block_devices[i] = g_block_devices[i - 1];
+        i--;
+    }
+    g_block_devices[i] = dev;
+    g_block_count++;
+}
+
+int block_device_count(void)
+{
+    return g_block_count;
+}
+
+struct block_device* block_device_at(int index)
+{
+    if (index < 0 || index >= g_block_count)
+    {
+        return 0;
+    }
+    return g_block_devices[index];
+}
+
+static int block_dispatch(struct block_device* dev, int write, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+    while (count > 0)
+    {
+        uint32_t n = count > dev->max_sectors ? dev->max_sectors : count;
+        int rc = write ? dev->ops->write(dev, lba, n, buffer) : dev->ops->read(dev, lba, n, buffer);
+        dev->stats.dispatched++;
+        if (rc != 0)
+        {
+            return rc;
+        }
+        lba += n;
+        count -= n;
+        buffer += n * BLOCK_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+// Sends requests [first, last] as one transfer. They are LBA-contiguous; if
+// their buffers are too, the transfer goes straight to the first buffer,
+// otherwise it is staged through the bounce buffer.
+static int block_dispatch_group(struct block_device* dev, int first, int last)
+{
+    struct block_request* reqs = dev->queue.requests;
+    if (first == last)
+    {
+        return block_dispatch(dev, reqs[first].write, reqs[first].lba, reqs[first].count, reqs[first].buffer);
+    }
+
+    uint32_t total = 0;
+    int direct = 1;
+    for (int i = first; i <= last; ++i)
+    {
+        if (i > first && reqs[i].buffer != reqs[i - 1].buffer + reqs[i - 1].count * BLOCK_SECTOR_SIZE)
+        {
+            direct = 0;
+        }
+        total += reqs[i].count;
+    }
+    dev->stats.merged += (uint32_t)(last - first);
+
+    int write = reqs[first].write;
+    if (direct)
+    {
+        return block_dispatch(dev, write, reqs[first].lba, total, reqs[first].buffer);
+    }
+
+    uint8_t* p = g_block_bounce;
+    if (write)
+    {
+        for (int i = first; i <= last; ++i)
+        {
+            block_copy(p, reqs[i].buffer, reqs[i].count * BLOCK_SECTOR_SIZE);
+            p += reqs[i].count * BLOCK_SECTOR_SIZE;
+        }
+        return block_dispatch(dev, 1, reqs[first].lba, total, g_block_bounce);
+    }
+
+    int rc = block_dispatch(dev, 0, reqs[first].lba, total, g_block_bounce);
+    if (rc != 0)
+    {
+        return rc;
+    }
+    for (int i = first; i <= last; ++i)
+    {
+        block_copy(reqs[i].buffer, p, reqs[i].count * BLOCK_SECTOR_SIZE);
+        p += reqs[i].count * BLOCK_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+// Elevator: sort the pending requests by LBA (insertion sort keeps equal
+// LBAs in submission order) and merge runs of same-direction requests that
+// continue each other, up to the merge limit.
+static int block_run_queue(struct block_device* dev)
+{
+    struct block_queue* q = &dev->queue;
+    struct block_request* reqs = q->requests;
+    for (int i = 1; i < q->count; ++i)
+    {
+        struct block_request r = reqs[i];
+        int j = i;
+        while (j > 0 && reqs[j - 1].lba > r.lba)
+        {
+            reqs[j] = reqs[j - 1];
+            j--;
+        }
+        reqs[j] = r;
+    }
+
+    uint32_t limit = dev->max_sectors < BLOCK_MERGE_SECTORS ? dev->max_sectors : BLOCK_MERGE_SECTORS;
+    int rc = 0;
+    int first = 0;
+    while (first < q->count)
+    {
+        int last = first;
+        uint32_t total = reqs[first].count;
+        while (last + 1 < q->count &&
+               reqs[last + 1].write == reqs[first].write &&
+               reqs[last + 1].lba == reqs[last].lba + reqs[last].count &&
+               total + reqs[last + 1].count <= limit)
+        {
+            last++;
+            total += reqs[last].count;
+        }
+
+        int err = block_dispatch_group(dev, first, last);
+        if (err != 0 && rc == 0)
+        {
+            rc = err;
+        }
+        first = last + 1;
+    }
+
+    q->count = 0;
+    return rc;
+}
+
+// A new request may not pass a queued one it overlaps unless both are reads.
+static int block_conflicts(struct block_device* dev, int write, uint32_t lba, uint32_t count)
+{
+    for (int i = 0; i < dev->queue.count; ++i)
+    {
+        struct block_request* r = &dev->queue.requests[i];
+        if ((write || r->write) && lba < r->lba + r->count && r->lba < lba + count)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void block_note_error(struct block_device* dev, int rc)
+{
+    if (rc != 0 && dev->queue.error == 0)
+    {
+        dev->queue.error = rc;
+    }
+}
+
+// Queues a request. Unplugged devices dispatch at once; plugged devices hold
+// the request (the buffer must stay valid until block_unplug) and report
+// errors from block_unplug.
+int block_submit(struct block_device* dev, int write, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+    struct block_queue* q = &dev->queue;
+    dev->stats.submitted++;
+
+    if (!q->plugged)
+    {
+        if (dev->stats.max_depth == 0)
+        {
+            dev->stats.max_depth = 1;
+        }
+        return block_dispatch(dev, write, lba, count, buffer);
+    }
+
+    if (q->count == BLOCK_QUEUE_DEPTH || block_conflicts(dev, write, lba, count))
+    {
+        block_note_error(dev, block_run_queue(dev));
+    }
+
+    struct block_request* r = &q->requests[q->count++];
+    r->lba = lba;
+    r->count = count;
+    r->buffer = buffer;
+    r->write = (uint8_t)(write != 0);
+    if ((uint32_t)q->count > dev->stats.max_depth)
+    {
+        dev->stats.max_depth = (uint32_t)q->count;
+    }
+    return 0;
+}
+
+void block_plug(struct block_device* dev)
+{
+    dev->queue.plugged++;
+}
+
+int block_unplug(struct block_device* dev)
+{
+    struct block_queue* q = &dev->queue;
+    if (q->plugged > 0)
+    {
+        q->plugged--;
+    }
+    if (q->plugged > 0)
+    {
+        return 0;
+    }
+
+    block_note_error(dev, block_run_queue(dev));
+    int rc = q->error;
+    q->error = 0;
+    return rc;
+}
+
+// Synchronous transfers bypass the plug unless they would overtake a queued
+// request touching the same sectors.
+int block_read(struct block_device* dev, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+    dev->stats.submitted++;
+    if (block_conflicts(dev, 0, lba, count))
+    {
+        block_note_error(dev, block_run_queue(dev));
+    }
+    return block_dispatch(dev, 0, lba, count, buffer);
+}
+
+int block_write(struct block_device* dev, uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+    dev->stats.submitted++;
+    if (block_conflicts(dev, 1, lba, count))
+    {
+        block_note_error(dev, block_run_queue(dev));
+    }
+    return block_dispatch(dev, 1, lba, count, (uint8_t*)buffer);
+}
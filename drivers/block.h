@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+
+#define BLOCK_SECTOR_SIZE 512
+#define BLOCK_MAX_DEVICES 8
+#define BLOCK_QUEUE_DEPTH 32
+#define BLOCK_MERGE_SECTORS 128
+
+struct block_device;
+
+struct block_ops
+{
+    int (*read)(struct block_device* dev, uint32_t lba, uint32_t count, uint8_t* buffer);
+    int (*write)(struct block_device* dev, uint32_t lba, uint32_t count, const uint8_t* buffer);
+};
+
+struct block_request
+{
+    uint32_t lba;
+    uint32_t count;
+    uint8_t* buffer;
+    uint8_t write;
+};
+
+// Requests submitted while the queue is plugged are held back, then sorted
+// by LBA and merged when the queue is unplugged.
+struct block_queue
+{
+    struct block_request requests[BLOCK_QUEUE_DEPTH];
+    int count;
+    int plugged;
+    int error;
+};
+
+struct block_stats
+{
+    uint32_t submitted;
+    uint32_t dispatched;
+    uint32_t merged;
+    uint32_t max_depth;
+};
+
+struct block_device
+{
+    const char* name;
+    const struct block_ops* ops;
+    uint32_t sector_count;
+    uint32_t sector_size;
+    uint32_t max_sectors;
+    int priority;
+    void* driver_data;
+    struct block_queue queue;
+    struct block_stats stats;
+};
+
+void block_register(struct block_device* dev);
+int block_device_count(void);
+struct block_device* block_device_at(int index);
+int block_read(struct block_device* dev, uint32_t lba, uint32_t count, uint8_t* buffer);
+int block_write(struct block_device* dev, uint32_t lba, uint32_t count, const uint8_t* buffer);
+int block_submit(struct block_device* dev, int write, uint32_t lba, uint32_t count, uint8_t* buffer);
+void block_plug(struct block_device* dev);
+int block_unplug(struct block_device* dev);
@@ -0,0 +1,437 @@
+#include <stddef.h>
+
+#include "nvme.h"
+#include "block.h"
+#include "io.h"
+#include "pci.h"
+
+#define NVME_PAGE_SIZE 4096
+#define NVME_ADMIN_DEPTH 8
+#define NVME_IO_DEPTH 32
+#define NVME_MAX_SECTORS 128
+#define NVME_PRP_ENTRIES 32
+#define NVME_TIMEOUT 2000000
+
+#define NVME_REG_CAP   0x00
+#define NVME_REG_INTMS 0x0C
+#define NVME_REG_CC    0x14
+#define NVME_REG_CSTS  0x1C
+#define NVME_REG_AQA   0x24
+#define NVME_REG_ASQ   0x28
+#define NVME_REG_ACQ   0x30
+#define NVME_REG_DB    0x1000
+
+#define NVME_CC_EN      (1u << 0)
+#define NVME_CC_IOSQES  (6u << 16)
+#define NVME_CC_IOCQES  (4u << 20)
+#define NVME_CSTS_RDY   (1u << 0)
+#define NVME_CSTS_CFS   (1u << 1)
+
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY  0x06
+
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ  0x02
+
+struct nvme_sqe
+{
+    uint32_t cdw0;
+    uint32_t nsid;
+    uint32_t reserved[2];
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+};
+
+struct nvme_cqe
+{
+    uint32_t result;
+    uint32_t reserved;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;
+};
+
+struct nvme_queue
+{
+    struct nvme_sqe* sq;
+    volatile struct nvme_cqe* cq;
+    uintptr_t sq_doorbell;
+    uintptr_t cq_doorbell;
+    uint16_t depth;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint16_t phase;
+    uint16_t next_cid;
+};
+
+struct nvme_disk
+{
+    uintptr_t regs;
+    uint32_t nsid;
+    uint32_t max_sectors;
+    struct nvme_queue admin;
+    struct nvme_queue io;
+    struct block_device block;
+};
+
+static struct nvme_sqe g_nvme_admin_sq[NVME_ADMIN_DEPTH] __attribute__((aligned(NVME_PAGE_SIZE)));
+static struct nvme_cqe g_nvme_admin_cq[NVME_ADMIN_DEPTH] __attribute__((aligned(NVME_PAGE_SIZE)));
+static struct nvme_sqe g_nvme_io_sq[NVME_IO_DEPTH] __attribute__((aligned(NVME_PAGE_SIZE)));
+static struct nvme_cqe g_nvme_io_cq[NVME_IO_DEPTH] __attribute__((aligned(NVME_PAGE_SIZE)));
+// One PRP list per I/O slot; 256 bytes each so no list crosses a page
+static uint64_t g_nvme_prp[NVME_IO_DEPTH][NVME_PRP_ENTRIES] __attribute__((aligned(NVME_PAGE_SIZE)));
+static uint8_t g_nvme_identify[NVME_PAGE_SIZE] __attribute__((aligned(NVME_PAGE_SIZE)));
+
+static struct nvme_disk g_nvme_disk;
+static int g_nvme_count = 0;
+
+static uint32_t mmio_read32(uintptr_t addr)
+{
+    return *(volatile uint32_t*)addr;
+}
+
+static void mmio_write32(uintptr_t addr, uint32_t value)
+{
+    *(volatile uint32_t*)addr = value;
+}
+
+static void mmio_write64(uintptr_t addr, uint64_t value)
+{
+    mmio_write32(addr, (uint32_t)value);
+    mmio_write32(addr + 4, (uint32_t)(value >> 32));
+}
+
+static void mem_zero(void* dst, size_t len)
+{
+    uint8_t* p = (uint8_t*)dst;
+    for (size_t i = 0; i < len; ++i)
+    {
+        p[i] = 0;
+    }
+}
+
+static void nvme_queue_setup(struct nvme_queue* q, struct nvme_sqe* sq, struct nvme_cqe* cq, uint16_t depth, uintptr_t regs, uint32_t stride, uint16_t qid)
+{
+    mem_zero(sq, sizeof(struct nvme_sqe) * depth);
+    mem_zero(cq, sizeof(struct nvme_cqe) * depth);
+    q->sq = sq;
+    q->cq = cq;
+    q->depth = depth;
+    q->sq_tail = 0;
+    q->cq_head = 0;
+    q->phase = 1;
+    q->next_cid = 0;
+    q->sq_doorbell = regs + NVME_REG_DB + (2u * qid) * stride;
+    q->cq_doorbell = regs + NVME_REG_DB + (2u * qid + 1) * stride;
+}
+
+// Copies `cmd` into the next submission slot and returns its command id.
+// The doorbell is rung separately so several commands go out in one write.
+static uint16_t nvme_queue_push(struct nvme_queue* q, const struct nvme_sqe* cmd)
+{
+    uint16_t cid = q->next_cid++;
+    q->sq[q->sq_tail] = *cmd;
+    q->sq[q->sq_tail].cdw0 = (cmd->cdw0 & 0xFFFF) | ((uint32_t)cid << 16);
+    q->sq_tail = (uint16_t)((q->sq_tail + 1) % q->depth);
+    return cid;
+}
+
+static void nvme_queue_ring(struct nvme_queue* q)
+{
+    __asm__ volatile("" ::: "memory");
+    mmio_write32(q->sq_doorbell, q->sq_tail);
+}
+
+// Reaps `count` completions and acknowledges them with one head doorbell.
+static int nvme_queue_reap(struct nvme_queue* q, uint32_t count)
+{
+    int rc = 0;
+    for (uint32_t done = 0; done < count; ++done)
+    {
+        uint32_t spins = 0;
+        while ((q->cq[q->cq_head].status & 1) != q->phase)
+        {
+            if (++spins > NVME_TIMEOUT)
+            {
+                return -1;
+            }
+            io_wait();
+        }
+        if ((q->cq[q->cq_head].status >> 1) != 0)
+        {
+            rc = -1;
+        }
+        q->cq_head++;
+        if (q->cq_head == q->depth)
+        {
+            q->cq_head = 0;
+            q->phase ^= 1;
+        }
+    }
+    mmio_write32(q->cq_doorbell, q->cq_head);
+    return rc;
+}
+
+static int nvme_admin(struct nvme_disk* disk, struct nvme_sqe* cmd)
+{
+    nvme_queue_push(&disk->admin, cmd);
+    nvme_queue_ring(&disk->admin);
+    return nvme_queue_reap(&disk->admin, 1);
+}
+
+// PRP1 covers the first page; a second page goes in PRP2 directly and
+// anything longer points PRP2 at the slot's PRP list.
+static int nvme_build_prp(struct nvme_sqe* cmd, uint32_t slot, uintptr_t buffer, uint32_t bytes)
+{
+    if ((buffer & 3) != 0)
+    {
+        return -1;
+    }
+
+    cmd->prp1 = (uint64_t)buffer;
+    cmd->prp2 = 0;
+
+    uintptr_t first_end = (buffer & ~(uintptr_t)(NVME_PAGE_SIZE - 1)) + NVME_PAGE_SIZE;
+    if (buffer + bytes <= first_end)
+    {
+        return 0;
+    }
+    if (buffer + bytes <= first_end + NVME_PAGE_SIZE)
+    {
+        cmd->prp2 = (uint64_t)first_end;
+        return 0;
+    }
+
+    uint32_t entries = 0;
+    for (uintptr_t page = first_end; page < buffer + bytes; page += NVME_PAGE_SIZE)
+    {
+        if (entries == NVME_PRP_ENTRIES)
+        {
+            return -1;
+        }
+        g_nvme_prp[slot][entries++] = (uint64_t)page;
+    }
+    cmd->prp2 = (uint64_t)(uintptr_t)g_nvme_prp[slot];
+    return 0;
+}
+
+static int nvme_transfer(struct nvme_disk* disk, uint32_t lba, uint32_t count, uintptr_t buffer, uint8_t opcode)
+{
+    while (count > 0)
+    {
+        uint32_t batch = 0;
+        while (count > 0 && batch < (uint32_t)(disk->io.depth - 1))
+        {
+            uint32_t n = count > disk->max_sectors ? disk->max_sectors : count;
+            struct nvme_sqe cmd;
+            mem_zero(&cmd, sizeof(cmd));
+            cmd.cdw0 = opcode;
+            cmd.nsid = disk->nsid;
+            cmd.cdw10 = lba;
+            cmd.cdw11 = 0;
+            cmd.cdw12 = n - 1;
+            if (nvme_build_prp(&cmd, disk->io.sq_tail, buffer, n * BLOCK_SECTOR_SIZE) != 0)
+            {
+                if (batch != 0)
+                {
+                    nvme_queue_ring(&disk->io);
+                    nvme_queue_reap(&disk->io, batch);
+                }
+                return -1;
+            }
+            nvme_queue_push(&disk->io, &cmd);
+            lba += n;
+            count -= n;
+            buffer += n * BLOCK_SECTOR_SIZE;
+            batch++;
+        }
+
+        nvme_queue_ring(&disk->io);
+        if (nvme_queue_reap(&disk->io, batch) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int nvme_block_read(struct block_device* dev, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+    return nvme_transfer((struct nvme_disk*)dev->driver_data, lba, count, (uintptr_t)buffer, NVME_CMD_READ);
+}
+
+static int nvme_block_write(struct block_device* dev, uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+    return nvme_transfer((struct nvme_disk*)dev->driver_data, lba, count, (uintptr_t)buffer, NVME_CMD_WRITE);
+}
+
+static const struct block_ops g_nvme_block_ops = {
+    nvme_block_read,
+    nvme_block_write,
+};
+
+static int nvme_wait_ready(uintptr_t regs, uint32_t ready)
+{
+    for (uint32_t i = 0; i < NVME_TIMEOUT; ++i)
+    {
+        uint32_t csts = mmio_read32(regs + NVME_REG_CSTS);
+        if (csts & NVME_CSTS_CFS)
+        {
+            return -1;
+        }
+        if ((csts & NVME_CSTS_RDY) == ready)
+        {
+            return 0;
+        }
+        io_wait();
+    }
+    return -1;
+}
+
+static int nvme_identify(struct nvme_disk* disk, uint32_t nsid, uint32_t cns)
+{
+    struct nvme_sqe cmd;
+    mem_zero(&cmd, sizeof(cmd));
+    cmd.cdw0 = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = nsid;
+    cmd.prp1 = (uint64_t)(uintptr_t)g_nvme_identify;
+    cmd.cdw10 = cns;
+    return nvme_admin(disk, &cmd);
+}
+
+static int nvme_create_io_queues(struct nvme_disk* disk)
+{
+    struct nvme_sqe cmd;
+    mem_zero(&cmd, sizeof(cmd));
+    cmd.cdw0 = NVME_ADMIN_CREATE_CQ;
+    cmd.prp1 = (uint64_t)(uintptr_t)g_nvme_io_cq;
+    cmd.cdw10 = ((uint32_t)(NVME_IO_DEPTH - 1) << 16) | 1;
+    cmd.cdw11 = 1;
+    if (nvme_admin(disk, &cmd) != 0)
+    {
+        return -1;
+    }
+
+    mem_zero(&cmd, sizeof(cmd));
+    cmd.cdw0 = NVME_ADMIN_CREATE_SQ;
+    cmd.prp1 = (uint64_t)(uintptr_t)g_nvme_io_sq;
+    cmd.cdw10 = ((uint32_t)(NVME_IO_DEPTH - 1) << 16) | 1;
+    cmd.cdw11 = (1u << 16) | 1;
+    return nvme_admin(disk, &cmd);
+}
+
+static int nvme_controller_init(struct nvme_disk* disk, uintptr_t regs)
+{
+    disk->regs = regs;
+
+    uint32_t cap_lo = mmio_read32(regs + NVME_REG_CAP);
+    uint32_t cap_hi = mmio_read32(regs + NVME_REG_CAP + 4);
+    uint32_t max_entries = (cap_lo & 0xFFFF) + 1;
+    uint32_t stride = 4u << (cap_hi & 0x0F);
+    if (((cap_hi >> 16) & 0x0F) != 0 || max_entries < NVME_IO_DEPTH)
+    {
+        return -1;
+    }
+
+    mmio_write32(regs + NVME_REG_CC, mmio_read32(regs + NVME_REG_CC) & ~NVME_CC_EN);
+    if (nvme_wait_ready(regs, 0) != 0)
+    {
+        return -1;
+    }
+
+    nvme_queue_setup(&disk->admin, g_nvme_admin_sq, g_nvme_admin_cq, NVME_ADMIN_DEPTH, regs, stride, 0);
+    mmio_write32(regs + NVME_REG_AQA, ((uint32_t)(NVME_ADMIN_DEPTH - 1) << 16) | (NVME_ADMIN_DEPTH - 1));
+    mmio_write64(regs + NVME_REG_ASQ, (uint64_t)(uintptr_t)g_nvme_admin_sq);
+    mmio_write64(regs + NVME_REG_ACQ, (uint64_t)(uintptr_t)g_nvme_admin_cq);
+    mmio_write32(regs + NVME_REG_INTMS, 0xFFFFFFFF);
+    mmio_write32(regs + NVME_REG_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+    if (nvme_wait_ready(regs, NVME_CSTS_RDY) != 0)
+    {
+        return -1;
+    }
+
+    // Controller identify: MDTS caps a single command at 2^MDTS pages
+    if (nvme_identify(disk, 0, 1) != 0)
+    {
+        return -1;
+    }
+    disk->max_sectors = NVME_MAX_SECTORS;
+    uint8_t mdts = g_nvme_identify[77];
+    if (mdts != 0 && mdts < 8)
+    {
+        uint32_t limit = (NVME_PAGE_SIZE << mdts) / BLOCK_SECTOR_SIZE;
+        if (limit < disk->max_sectors)
+        {
+            disk->max_sectors = limit;
+        }
+    }
+
+    // Namespace 1 must use 512-byte LBAs to line up with the block layer
+    disk->nsid = 1;
+    if (nvme_identify(disk, disk->nsid, 0) != 0)
+    {
+        return -1;
+    }
+    uint32_t nsze_lo = *(uint32_t*)&g_nvme_identify[0];
+    uint32_t nsze_hi = *(uint32_t*)&g_nvme_identify[4];
+    uint8_t format = g_nvme_identify[26] & 0x0F;
+    uint8_t lbads = g_nvme_identify[128 + format * 4 + 2];
+    if (lbads != 9)
+    {
+        return -1;
+    }
+
+    nvme_queue_setup(&disk->io, g_nvme_io_sq, g_nvme_io_cq, NVME_IO_DEPTH, regs, stride, 1);
+    if (nvme_create_io_queues(disk) != 0)
+    {
+        return -1;
+    }
+
+    disk->block.name = "nvme0";
+    disk->block.ops = &g_nvme_block_ops;
+    disk->block.sector_count = nsze_hi != 0 ? 0xFFFFFFFF : nsze_lo;
+    disk->block.sector_size = BLOCK_SECTOR_SIZE;
+    disk->block.max_sectors = disk->max_sectors * (NVME_IO_DEPTH - 1);
+    disk->block.priority = 30;
+    disk->block.driver_data = disk;
+    return 0;
+}
+
+void nvme_init(void)
+{
+    g_nvme_count = 0;
+
+    struct pci_device dev;
+    if (pci_find_class(0x01, 0x08, 0, &dev) != 0)
+    {
+        return;
+    }
+
+    uint64_t bar = pci_bar64(&dev, 0);
+    if (bar == 0 || bar >= 0x100000000ull)
+    {
+        return;
+    }
+    pci_enable(&dev, PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+
+    if (nvme_controller_init(&g_nvme_disk, (uintptr_t)bar) != 0)
+    {
+        return;
+    }
+    block_register(&g_nvme_disk.block);
+    g_nvme_count = 1;
+}
+
+int nvme_disk_count(void)
+{
+    return g_nvme_count;
+}
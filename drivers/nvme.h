@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+void nvme_init(void);
+int nvme_disk_count(void);
@@ -0,0 +1,153 @@
+#include "pci.h"
+#include "io.h"
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+#define PCI_VENDOR_ID   0x00
+#define PCI_COMMAND     0x04
+#define PCI_CLASS       0x08
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_BAR0        0x10
+#define PCI_IRQ_LINE    0x3C
+
+static uint32_t pci_address(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset)
+{
+    return 0x80000000u | ((uint32_t)bus << 16) | ((uint32_t)slot << 11) | ((uint32_t)func << 8) | (offset & 0xFC);
+}
+
+static uint32_t pci_config_read(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset)
+{
+    outl(PCI_CONFIG_ADDRESS, pci_address(bus, slot, func, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+uint32_t pci_read32(const struct pci_device* dev, uint8_t offset)
+{
+    return pci_config_read(dev->bus, dev->slot, dev->func, offset);
+}
+
+uint16_t pci_read16(const struct pci_device* dev, uint8_t offset)
+{
+    return (uint16_t)(pci_read32(dev, offset) >> ((offset & 2) * 8));
+}
+
+uint8_t pci_read8(const struct pci_device* dev, uint8_t offset)
+{
+    return (uint8_t)(pci_read32(dev, offset) >> ((offset & 3) * 8));
+}
+
+void pci_write32(const struct pci_device* dev, uint8_t offset, uint32_t value)
+{
+    outl(PCI_CONFIG_ADDRESS, pci_address(dev->bus, dev->slot, dev->func, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+void pci_write16(const struct pci_device* dev, uint8_t offset, uint16_t value)
+{
+    uint32_t shift = (offset & 2) * 8;
+    uint32_t dword = pci_read32(dev, offset);
+    dword = (dword & ~(0xFFFFu << shift)) | ((uint32_t)value << shift);
+    pci_write32(dev, offset, dword);
+}
+
+static void pci_fill(struct pci_device* dev, uint8_t bus, uint8_t slot, uint8_t func, uint32_t id)
+{
+    dev->bus = bus;
+    dev->slot = slot;
+    dev->func = func;
+    dev->vendor_id = (uint16_t)(id & 0xFFFF);
+    dev->device_id = (uint16_t)(id >> 16);
+
+    uint32_t class_reg = pci_read32(dev, PCI_CLASS);
+    dev->class_code = (uint8_t)(class_reg >> 24);
+    dev->subclass = (uint8_t)(class_reg >> 16);
+    dev->prog_if = (uint8_t)(class_reg >> 8);
+    dev->irq_line = pci_read8(dev, PCI_IRQ_LINE);
+}
+
+// Brute-force walk of every bus/slot/function. `match` decides whether a
+// present function counts, and the `index`-th match is returned.
+static int pci_scan(int (*match)(const struct pci_device*, uint32_t, uint32_t), uint32_t a, uint32_t b, int index, struct pci_device* out)
+{
+    for (uint32_t bus = 0; bus < 256; ++bus)
+    {
+        for (uint8_t slot = 0; slot < 32; ++slot)
+        {
+            uint8_t funcs = 1;
+            for (uint8_t func = 0; func < funcs; ++func)
+            {
+                uint32_t id = pci_config_read((uint8_t)bus, slot, func, PCI_VENDOR_ID);
+                if ((id & 0xFFFF) == 0xFFFF)
+                {
+                    continue;
+                }
+
+                struct pci_device dev;
+                pci_fill(&dev, (uint8_t)bus, slot, func, id);
+                if (func == 0 && (pci_read8(&dev, PCI_HEADER_TYPE) & 0x80))
+                {
+                    funcs = 8;
+                }
+
+                if (match(&dev, a, b))
+                {
+                    if (index == 0)
+                    {
+                        *out = dev;
+                        return 0;
+                    }
+                    index--;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+static int pci_match_class(const struct pci_device* dev, uint32_t class_code, uint32_t subclass)
+{
+    return dev->class_code == class_code && dev->subclass == subclass;
+}
+
+static int pci_match_id(const struct pci_device* dev, uint32_t vendor_id, uint32_t device_id)
+{
+    return dev->vendor_id == vendor_id && dev->device_id == device_id;
+}
+
+int pci_find_class(uint8_t class_code, uint8_t subclass, int index, struct pci_device* out)
+{
+    return pci_scan(pci_match_class, class_code, subclass, index, out);
+}
+
+int pci_find_device(uint16_t vendor_id, uint16_t device_id, int index, struct pci_device* out)
+{
+    return pci_scan(pci_match_id, vendor_id, device_id, index, out);
+}
+
+uint32_t pci_bar(const struct pci_device* dev, int bar)
+{
+    uint32_t value = pci_read32(dev, (uint8_t)(PCI_BAR0 + bar * 4));
+    if (value & 0x01)
+    {
+        return value & ~0x03u;
+    }
+    return value & ~0x0Fu;
+}
+
+uint64_t pci_bar64(const struct pci_device* dev, int bar)
+{
+    uint32_t low = pci_read32(dev, (uint8_t)(PCI_BAR0 + bar * 4));
+    uint64_t value = low & ~0x0Fu;
+    if ((low & 0x07) == 0x04)
+    {
+        value |= (uint64_t)pci_read32(dev, (uint8_t)(PCI_BAR0 + (bar + 1) * 4)) << 32;
+    }
+    return value;
+}
+
+void pci_enable(const struct pci_device* dev, uint16_t flags)
+{
+    uint16_t command = pci_read16(dev, PCI_COMMAND);
+    pci_write16(dev, PCI_COMMAND, (uint16_t)(command | flags));
+}
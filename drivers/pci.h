@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+#define PCI_COMMAND_IO           0x0001
+#define PCI_COMMAND_MEMORY       0x0002
+#define PCI_COMMAND_BUS_MASTER   0x0004
+#define PCI_COMMAND_INTX_DISABLE 0x0400
+
+struct pci_device
+{
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t irq_line;
+};
+
+uint32_t pci_read32(const struct pci_device* dev, uint8_t offset);
+uint16_t pci_read16(const struct pci_device* dev, uint8_t offset);
+uint8_t pci_read8(const struct pci_device* dev, uint8_t offset);
+void pci_write32(const struct pci_device* dev, uint8_t offset, uint32_t value);
+void pci_write16(const struct pci_device* dev, uint8_t offset, uint16_t value);
+
+int pci_find_class(uint8_t class_code, uint8_t subclass, int index, struct pci_device* out);
+int pci_find_device(uint16_t vendor_id, uint16_t device_id, int index, struct pci_device* out);
+uint32_t pci_bar(const struct pci_device* dev, int bar);
+uint64_t pci_bar64(const struct pci_device* dev, int bar);
+void pci_enable(const struct pci_device* dev, uint16_t flags);
@@ -0,0 +1,349 @@
+#include <stddef.h>
+
+#include "virtio_blk.h"
+#include "block.h"
+#include "io.h"
+#include "pci.h"
+
+#define VIRTIO_VENDOR_ID        0x1AF4
+#define VIRTIO_BLK_LEGACY_ID    0x1001
+
+#define VIRTIO_MAX_DISKS 2
+#define VIRTIO_QUEUE_MAX 256
+#define VIRTIO_BLK_MAX_REQS 64
+#define VIRTIO_BLK_REQ_SECTORS 128
+#define VIRTIO_TIMEOUT 1000000
+
+// Legacy (transitional) register layout in the I/O BAR
+#define VIRTIO_REG_DEVICE_FEATURES 0x00
+#define VIRTIO_REG_GUEST_FEATURES  0x04
+#define VIRTIO_REG_QUEUE_PFN       0x08
+#define VIRTIO_REG_QUEUE_SIZE      0x0C
+#define VIRTIO_REG_QUEUE_SELECT    0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY    0x10
+#define VIRTIO_REG_STATUS          0x12
+#define VIRTIO_REG_ISR             0x13
+#define VIRTIO_REG_CONFIG          0x14
+
+#define VIRTIO_STATUS_ACK       0x01
+#define VIRTIO_STATUS_DRIVER    0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FAILED    0x80
+
+#define VIRTIO_BLK_F_SIZE_MAX (1u << 1)
+#define VIRTIO_BLK_F_RO       (1u << 5)
+
+#define VIRTIO_BLK_T_IN  0
+#define VIRTIO_BLK_T_OUT 1
+
+#define VRING_DESC_F_NEXT  1
+#define VRING_DESC_F_WRITE 2
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+
+#define VIRTIO_PAGE_SIZE 4096
+
+struct vring_desc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct vring_avail
+{
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[VIRTIO_QUEUE_MAX];
+};
+
+struct vring_used_elem
+{
+    uint32_t id;
+    uint32_t len;
+};
+
+struct vring_used
+{
+    uint16_t flags;
+    volatile uint16_t idx;
+    struct vring_used_elem ring[VIRTIO_QUEUE_MAX];
+};
+
+struct virtio_blk_req
+{
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+// Legacy virtqueue memory: descriptors, then the available ring, then the
+// used ring on the next page boundary. Offsets depend on the queue size the
+// device reports, so the area is sized for the largest queue we accept.
+#define VIRTIO_QUEUE_BYTES (VIRTIO_PAGE_SIZE * 3)
+
+struct virtio_queue_mem
+{
+    uint8_t bytes[VIRTIO_QUEUE_BYTES];
+} __attribute__((aligned(VIRTIO_PAGE_SIZE)));
+
+struct virtio_disk
+{
+    uint16_t io;
+    uint16_t queue_size;
+    uint16_t avail_idx;
+    uint16_t used_idx;
+    uint32_t max_reqs;
+    uint32_t req_sectors;
+    uint8_t read_only;
+    struct virtio_queue_mem* queue;
+    struct vring_desc* desc;
+    struct vring_avail* avail;
+    struct vring_used* used;
+    struct virtio_blk_req* headers;
+    volatile uint8_t* status;
+    struct block_device block;
+};
+
+static struct virtio_queue_mem g_virtio_queues[VIRTIO_MAX_DISKS];
+static struct virtio_blk_req g_virtio_headers[VIRTIO_MAX_DISKS][VIRTIO_BLK_MAX_REQS];
+static uint8_t g_virtio_status[VIRTIO_MAX_DISKS][VIRTIO_BLK_MAX_REQS];
+static struct virtio_disk g_virtio_disks[VIRTIO_MAX_DISKS];
+static int g_virtio_count = 0;
+static uint32_t g_virtio_requests = 0;
+static uint32_t g_virtio_kicks = 0;
+
+static const char* const g_virtio_names[VIRTIO_MAX_DISKS] = { "vda", "vdb" };
+
+static void mem_zero(void* dst, size_t len)
+{
+    uint8_t* p = (uint8_t*)dst;
+    for (size_t i = 0; i < len; ++i)
+    {
+        p[i] = 0;
+    }
+}
+
+static void virtio_barrier(void)
+{
+    __asm__ volatile("" ::: "memory");
+}
+
+// Queues one request as a header / data / status descriptor chain. The
+// caller publishes a whole batch with a single avail->idx update.
+static void virtio_queue_request(struct virtio_disk* disk, uint32_t slot, uint32_t type, uint32_t lba, uint32_t count, uintptr_t buffer)
+{
+    struct vring_desc* desc = disk->desc;
+    uint16_t head = (uint16_t)(slot * 3);
+
+    disk->headers[slot].type = type;
+    disk->headers[slot].reserved = 0;
+    disk->headers[slot].sector = lba;
+    disk->status[slot] = 0xFF;
+
+    desc[head].addr = (uint64_t)(uintptr_t)&disk->headers[slot];
+    desc[head].len = sizeof(struct virtio_blk_req);
+    desc[head].flags = VRING_DESC_F_NEXT;
+    desc[head].next = (uint16_t)(head + 1);
+
+    desc[head + 1].addr = (uint64_t)buffer;
+    desc[head + 1].len = count * BLOCK_SECTOR_SIZE;
+    desc[head + 1].flags = (uint16_t)(VRING_DESC_F_NEXT | (type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0));
+    desc[head + 1].next = (uint16_t)(head + 2);
+
+    desc[head + 2].addr = (uint64_t)(uintptr_t)&disk->status[slot];
+    desc[head + 2].len = 1;
+    desc[head + 2].flags = VRING_DESC_F_WRITE;
+    desc[head + 2].next = 0;
+
+    disk->avail->ring[(uint16_t)(disk->avail_idx + slot) % disk->queue_size] = head;
+}
+
+// Reaps every completion of the current batch and checks each status byte.
+static int virtio_reap(struct virtio_disk* disk, uint32_t batch)
+{
+    uint16_t target = (uint16_t)(disk->used_idx + batch);
+    uint32_t spins = 0;
+    while (disk->used->idx != target)
+    {
+        if (++spins > VIRTIO_TIMEOUT)
+        {
+            return -1;
+        }
+        io_wait();
+    }
+    virtio_barrier();
+    inb((uint16_t)(disk->io + VIRTIO_REG_ISR));
+
+    int rc = 0;
+    while (disk->used_idx != target)
+    {
+        uint32_t head = disk->used->ring[disk->used_idx % disk->queue_size].id;
+        if (disk->status[head / 3] != 0)
+        {
+            rc = -1;
+        }
+        disk->used_idx++;
+    }
+    return rc;
+}
+
+static int virtio_transfer(struct virtio_disk* disk, uint32_t lba, uint32_t count, uintptr_t buffer, uint32_t type)
+{
+    if (type == VIRTIO_BLK_T_OUT && disk->read_only)
+    {
+        return -1;
+    }
+
+    while (count > 0)
+    {
+        uint32_t batch = 0;
+        while (count > 0 && batch < disk->max_reqs)
+        {
+            uint32_t n = count > disk->req_sectors ? disk->req_sectors : count;
+            virtio_queue_request(disk, batch, type, lba, n, buffer);
+            lba += n;
+            count -= n;
+            buffer += n * BLOCK_SECTOR_SIZE;
+            batch++;
+        }
+
+        virtio_barrier();
+        disk->avail_idx = (uint16_t)(disk->avail_idx + batch);
+        disk->avail->idx = disk->avail_idx;
+        virtio_barrier();
+        outw((uint16_t)(disk->io + VIRTIO_REG_QUEUE_NOTIFY), 0);
+        g_virtio_requests += batch;
+        g_virtio_kicks++;
+
+        if (virtio_reap(disk, batch) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int virtio_block_read(struct block_device* dev, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+    return virtio_transfer((struct virtio_disk*)dev->driver_data, lba, count, (uintptr_t)buffer, VIRTIO_BLK_T_IN);
+}
+
+static int virtio_block_write(struct block_device* dev, uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+    return virtio_transfer((struct virtio_disk*)dev->driver_data, lba, count, (uintptr_t)buffer, VIRTIO_BLK_T_OUT);
+}
+
+static const struct block_ops g_virtio_block_ops = {
+    virtio_block_read,
+    virtio_block_write,
+};
+
+static int virtio_disk_init(struct virtio_disk* disk, uint16_t io, int index)
+{
+    disk->io = io;
+    disk->queue = &g_virtio_queues[index];
+    disk->headers = g_virtio_headers[index];
+    disk->status = g_virtio_status[index];
+    disk->avail_idx = 0;
+    disk->used_idx = 0;
+
+    outb((uint16_t)(io + VIRTIO_REG_STATUS), 0);
+    outb((uint16_t)(io + VIRTIO_REG_STATUS), VIRTIO_STATUS_ACK);
+    outb((uint16_t)(io + VIRTIO_REG_STATUS), VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+    uint32_t features = inl((uint16_t)(io + VIRTIO_REG_DEVICE_FEATURES));
+    outl((uint16_t)(io + VIRTIO_REG_GUEST_FEATURES), features & (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_RO));
+
+    outw((uint16_t)(io + VIRTIO_REG_QUEUE_SELECT), 0);
+    uint16_t size = inw((uint16_t)(io + VIRTIO_REG_QUEUE_SIZE));
+    if (size == 0 || size > VIRTIO_QUEUE_MAX)
+    {
+        outb((uint16_t)(io + VIRTIO_REG_STATUS), VIRTIO_STATUS_FAILED);
+        return -1;
+    }
+    disk->queue_size = size;
+
+    // Three descriptors per request; the whole batch must fit the ring
+    disk->max_reqs = size / 3;
+    if (disk->max_reqs > VIRTIO_BLK_MAX_REQS)
+    {
+        disk->max_reqs = VIRTIO_BLK_MAX_REQS;
+    }
+
+    disk->req_sectors = VIRTIO_BLK_REQ_SECTORS;
+    if (features & VIRTIO_BLK_F_SIZE_MAX)
+    {
+        uint32_t size_max = inl((uint16_t)(io + VIRTIO_REG_CONFIG + 8));
+        if (size_max >= BLOCK_SECTOR_SIZE && size_max / BLOCK_SECTOR_SIZE < disk->req_sectors)
+        {
+            disk->req_sectors = size_max / BLOCK_SECTOR_SIZE;
+        }
+    }
+    disk->read_only = (features & VIRTIO_BLK_F_RO) ? 1 : 0;
+
+    uint64_t capacity = (uint64_t)inl((uint16_t)(io + VIRTIO_REG_CONFIG)) |
+                        ((uint64_t)inl((uint16_t)(io + VIRTIO_REG_CONFIG + 4)) << 32);
+
+    uintptr_t base = (uintptr_t)disk->queue;
+    uintptr_t used = base + sizeof(struct vring_desc) * size + sizeof(uint16_t) * (3 + size);
+    used = (used + VIRTIO_PAGE_SIZE - 1) & ~(uintptr_t)(VIRTIO_PAGE_SIZE - 1);
+    disk->desc = (struct vring_desc*)base;
+    disk->avail = (struct vring_avail*)(base + sizeof(struct vring_desc) * size);
+    disk->used = (struct vring_used*)used;
+
+    mem_zero(disk->queue, sizeof(*disk->queue));
+    disk->avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+    outl((uint16_t)(io + VIRTIO_REG_QUEUE_PFN), (uint32_t)((uintptr_t)disk->queue / VIRTIO_PAGE_SIZE));
+
+    outb((uint16_t)(io + VIRTIO_REG_STATUS), VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+    disk->block.name = g_virtio_names[index];
+    disk->block.ops = &g_virtio_block_ops;
+    disk->block.sector_count = capacity > 0xFFFFFFFFull ? 0xFFFFFFFF : (uint32_t)capacity;
+    disk->block.sector_size = BLOCK_SECTOR_SIZE;
+    disk->block.max_sectors = disk->max_reqs * disk->req_sectors;
+    disk->block.priority = 20;
+    disk->block.driver_data = disk;
+    return 0;
+}
+
+void virtio_blk_init(void)
+{
+    g_virtio_count = 0;
+
+    struct pci_device dev;
+    for (int i = 0; g_virtio_count < VIRTIO_MAX_DISKS; ++i)
+    {
+        if (pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_BLK_LEGACY_ID, i, &dev) != 0)
+        {
+            break;
+        }
+
+        uint32_t io = pci_bar(&dev, 0);
+        if (io == 0 || (pci_read32(&dev, 0x10) & 1) == 0)
+        {
+            continue;
+        }
+        pci_enable(&dev, PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+
+        struct virtio_disk* disk = &g_virtio_disks[g_virtio_count];
+        if (virtio_disk_init(disk, (uint16_t)io, g_virtio_count) != 0)
+        {
+            continue;
+        }
+        block_register(&disk->block);
+        g_virtio_count++;
+    }
+}
+
+int virtio_blk_disk_count(void)
+{
+    return g_virtio_count;
+}
+
+void virtio_blk_stats(uint32_t* requests, uint32_t* kicks)
+{
+    *requests = g_virtio_requests;
+    *kicks = g_virtio_kicks;
+}
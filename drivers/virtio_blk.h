@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdint.h>
+
+void virtio_blk_init(void);
+int virtio_blk_disk_count(void);
+void virtio_blk_stats(uint32_t* requests, uint32_t* kicks);
@@ -0,0 +1,531 @@
+#include "bcache.h"
+#include "console.h"
+
+#define BCACHE_NONE 0xFFFF
+
+struct bcache_block
+{
+    struct block_device* dev;
+    uint32_t lba;
+    uint8_t valid;
+    uint8_t dirty;
+    uint8_t prefetched;
+    uint16_t hash_next;
+    uint16_t lru_prev;
+    uint16_t lru_next;
+    uint8_t data[BLOCK_SECTOR_SIZE];
+};
+
+static struct bcache_block g_bcache[BCACHE_BLOCKS];
+static uint16_t g_bcache_buckets[BCACHE_BUCKETS];
+static uint16_t g_bcache_lru_head = BCACHE_NONE;
+static uint16_t g_bcache_lru_tail = BCACHE_NONE;
+static int g_bcache_ready = 0;
+static struct bcache_stats g_bcache_stats;
+static uint8_t g_bcache_staging[BCACHE_PREFETCH_MAX * BLOCK_SECTOR_SIZE];
+static bcache_barrier_fn g_bcache_barrier = 0;
+
+static void bcache_copy(uint8_t* dst, const uint8_t* src, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; ++i)
+    {
+        dst[i] = src[i];
+    }
+}
+
+static uint32_t bcache_hash(uint32_t lba)
+{
+    return ((lba * 2654435761u) >> 16) % BCACHE_BUCKETS;
+}
+
+static void bcache_lru_unlink(uint16_t idx)
+{
+    struct bcache_block* b = &g_bcache[idx];
+    if (b->lru_prev != BCACHE_NONE)
+    {
+        g_bcache[b->lru_prev].lru_next = b->lru_next;
+    }
+    else
+    {
+        g_bcache_lru_head = b->lru_next;
+    }
+    if (b->lru_next != BCACHE_NONE)
+    {
+        g_bcache[b->lru_next].lru_prev = b->lru_prev;
+    }
+    else
+    {
+        g_bcache_lru_tail = b->lru_prev;
+    }
+    b->lru_prev = BCACHE_NONE;
+    b->lru_next = BCACHE_NONE;
+}
+
+// Head of the list is the most recently used block, the tail is evicted.
+static void bcache_lru_push_front(uint16_t idx)
+{
+    struct bcache_block* b = &g_bcache[idx];
+    b->lru_prev = BCACHE_NONE;
+    b->lru_next = g_bcache_lru_head;
+    if (g_bcache_lru_head != BCACHE_NONE)
+    {
+        g_bcache[g_bcache_lru_head].lru_prev = idx;
+    }
+    g_bcache_lru_head = idx;
+    if (g_bcache_lru_tail == BCACHE_NONE)
+    {
+        g_bcache_lru_tail = idx;
+    }
+}
+
+static void bcache_setup(void)
+{
+    for (uint16_t i = 0; i < BCACHE_BUCKETS; ++i)
+    {
+        g_bcache_buckets[i] = BCACHE_NONE;
+    }
+    g_bcache_lru_head = BCACHE_NONE;
+    g_bcache_lru_tail = BCACHE_NONE;
+    for (uint16_t i = 0; i < BCACHE_BLOCKS; ++i)
+    {
+        g_bcache[i].dev = 0;
+        g_bcache[i].valid = 0;
+        g_bcache[i].dirty = 0;
+        g_bcache[i].hash_next = BCACHE_NONE;
+        bcache_lru_push_front(i);
+    }
+    g_bcache_ready = 1;
+}
+
+static uint16_t bcache_lookup(struct block_device* dev, uint32_t lba)
+{
+    if (!g_bcache_ready)
+    {
+        bcache_setup();
+    }
+    uint16_t idx = g_bcache_buckets[bcache_hash(lba)];
+    while (idx != BCACHE_NONE)
+    {
+        struct bcache_block* b = &g_bcache[idx];
+        if (b->valid && b->dev == dev && b->lba == lba)
+        {
+            return idx;
+        }
+        idx = b->hash_next;
+    }
+    return BCACHE_NONE;
+}
+
+static void bcache_unhash(uint16_t idx)
+{
+    uint16_t* link = &g_bcache_buckets[bcache_hash(g_bcache[idx].lba)];
+    while (*link != BCACHE_NONE)
+    {
+        if (*link == idx)
+        {
+            *link = g_bcache[idx].hash_next;
+            break;
+        }
+        link = &g_bcache[*link].hash_next;
+    }
+    g_bcache[idx].hash_next = BCACHE_NONE;
+    g_bcache[idx].valid = 0;
+}
+
+void bcache_set_barrier(bcache_barrier_fn barrier)
+{
+    g_bcache_barrier = barrier;
+}
+
+static int bcache_barrier(struct block_device* dev)
+{
+    return g_bcache_barrier != 0 ? g_bcache_barrier(dev) : 0;
+}
+
+static int bcache_writeback(uint16_t idx)
+{
+    struct bcache_block* b = &g_bcache[idx];
+    if (!b->dirty)
+    {
+        return 0;
+    }
+    int rc = bcache_barrier(b->dev);
+    if (rc != 0)
+    {
+        return rc;
+    }
+    rc = block_write(b->dev, b->lba, 1, b->data);
+    if (rc != 0)
+    {
+        return rc;
+    }
+    b->dirty = 0;
+    g_bcache_stats.writebacks++;
+    return 0;
+}
+
+// Takes the least recently used block, writing it back first if dirty, and
+// rehashes it under (dev, lba). The caller fills in the data.
+static int bcache_claim(struct block_device* dev, uint32_t lba, uint16_t* out)
+{
+    uint16_t idx = g_bcache_lru_tail;
+    struct bcache_block* b = &g_bcache[idx];
+    if (b->valid)
+    {
+        int rc = bcache_writeback(idx);
+        if (rc != 0)
+        {
+            return rc;
+        }
+        bcache_unhash(idx);
+        g_bcache_stats.evictions++;
+    }
+
+    uint32_t bucket = bcache_hash(lba);
+    b->dev = dev;
+    b->lba = lba;
+    b->valid = 1;
+    b->dirty = 0;
+    b->prefetched = 0;
+    b->hash_next = g_bcache_buckets[bucket];
+    g_bcache_buckets[bucket] = idx;
+    *out = idx;
+    return 0;
+}
+
+static void bcache_touch(uint16_t idx)
+{
+    bcache_lru_unlink(idx);
+    bcache_lru_push_front(idx);
+}
+
+static void bcache_note_hit(uint16_t idx)
+{
+    g_bcache_stats.hits++;
+    if (g_bcache[idx].prefetched)
+    {
+        g_bcache[idx].prefetched = 0;
+        g_bcache_stats.prefetch_hits++;
+    }
+}
+
+// Serves a multi-sector read from the cache when every sector is resident.
+static int bcache_read_cached(struct block_device* dev, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (bcache_lookup(dev, lba + i) == BCACHE_NONE)
+        {
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint16_t idx = bcache_lookup(dev, lba + i);
+        bcache_note_hit(idx);
+        bcache_copy(buffer + i * BLOCK_SECTOR_SIZE, g_bcache[idx].data, BLOCK_SECTOR_SIZE);
+        bcache_touch(idx);
+    }
+    return 0;
+}
+
+// Single sectors go through the cache. Larger transfers are file data: they
+// go straight to the device after any cached copy in range is made coherent.
+int bcache_read(struct block_device* dev, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+    if (count != 1)
+    {
+        if (bcache_read_cached(dev, lba, count, buffer) == 0)
+        {
+            return 0;
+        }
+        int rc = bcache_sync_range(dev, lba, count);
+        if (rc != 0)
+        {
+            return rc;
+        }
+        return block_read(dev, lba, count, buffer);
+    }
+
+    uint16_t idx = bcache_lookup(dev, lba);
+    if (idx != BCACHE_NONE)
+    {
+        bcache_note_hit(idx);
+    }
+    else
+    {
+        g_bcache_stats.misses++;
+        int rc = bcache_claim(dev, lba, &idx);
+        if (rc != 0)
+        {
+            return rc;
+        }
+        rc = block_read(dev, lba, 1, g_bcache[idx].data);
+        if (rc != 0)
+        {
+            bcache_unhash(idx);
+            return rc;
+        }
+    }
+    bcache_copy(buffer, g_bcache[idx].data, BLOCK_SECTOR_SIZE);
+    bcache_touch(idx);
+    return 0;
+}
+
+int bcache_write(struct block_device* dev, uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+    if (count != 1)
+    {
+        bcache_update_range(dev, lba, count, buffer);
+        return block_write(dev, lba, count, buffer);
+    }
+
+    uint16_t idx = bcache_lookup(dev, lba);
+    if (idx != BCACHE_NONE)
+    {
+        g_bcache_stats.hits++;
+    }
+    else
+    {
+        g_bcache_stats.misses++;
+        int rc = bcache_claim(dev, lba, &idx);
+        if (rc != 0)
+        {
+            return rc;
+        }
+    }
+    bcache_copy(g_bcache[idx].data, buffer, BLOCK_SECTOR_SIZE);
+    g_bcache[idx].dirty = 1;
+    bcache_touch(idx);
+    return 0;
+}
+
+// Loads [lba, lba+count) into the cache ahead of use. Each span of sectors
+// that is not resident yet is read with one multi-sector transfer; resident
+// sectors (possibly dirty) are left alone.
+int bcache_prefetch(struct block_device* dev, uint32_t lba, uint32_t count)
+{
+    if (count > BCACHE_PREFETCH_MAX)
+    {
+        count = BCACHE_PREFETCH_MAX;
+    }
+
+    uint32_t i = 0;
+    while (i < count)
+    {
+        if (bcache_lookup(dev, lba + i) != BCACHE_NONE)
+        {
+            i++;
+            continue;
+        }
+
+        uint32_t span = 1;
+        while (i + span < count && bcache_lookup(dev, lba + i + span) == BCACHE_NONE)
+        {
+            span++;
+        }
+
+        int rc = block_read(dev, lba + i, span, g_bcache_staging);
+        if (rc != 0)
+        {
+            return rc;
+        }
+        for (uint32_t j = 0; j < span; ++j)
+        {
+            uint16_t idx = 0;
+            rc = bcache_claim(dev, lba + i + j, &idx);
+            if (rc != 0)
+            {
+                return rc;
+            }
+            bcache_copy(g_bcache[idx].data, g_bcache_staging + j * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE);
+            g_bcache[idx].prefetched = 1;
+            bcache_touch(idx);
+        }
+        g_bcache_stats.prefetched += span;
+        i += span;
+    }
+    return 0;
+}
+
+int bcache_sync_range(struct block_device* dev, uint32_t lba, uint32_t count)
+{
+    if (!g_bcache_ready)
+    {
+        return 0;
+    }
+    for (uint16_t i = 0; i < BCACHE_BLOCKS; ++i)
+    {
+        struct bcache_block* b = &g_bcache[i];
+        if (b->valid && b->dirty && b->dev == dev && b->lba >= lba && b->lba - lba < count)
+        {
+            int rc = bcache_writeback(i);
+            if (rc != 0)
+            {
+                return rc;
+            }
+        }
+    }
+    return 0;
+}
+
+// Called when a transfer bypasses the cache to write [lba, lba+count): any
+// cached copy takes the new contents and is clean, since the device gets
+// the same data.
+void bcache_update_range(struct block_device* dev, uint32_t lba, uint32_t count, const uint8_t* buffer)
+{
+    if (!g_bcache_ready)
+    {
+        return;
+    }
+    for (uint16_t i = 0; i < BCACHE_BLOCKS; ++i)
+    {
+        struct bcache_block* b = &g_bcache[i];
+        if (b->valid && b->dev == dev && b->lba >= lba && b->lba - lba < count)
+        {
+            bcache_copy(b->data, buffer + (b->lba - lba) * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE);
+            b->dirty = 0;
+        }
+    }
+}
+
+// Writes every dirty block of `dev` through a plugged queue so the elevator
+// sorts them and merges neighbours into multi-sector writes.
+int bcache_sync(struct block_device* dev)
+{
+    if (!g_bcache_ready)
+    {
+        return 0;
+    }
+
+    int rc = bcache_barrier(dev);
+    if (rc != 0)
+    {
+        return rc;
+    }
+
+    uint32_t queued = 0;
+    block_plug(dev);
+    for (uint16_t i = 0; i < BCACHE_BLOCKS; ++i)
+    {
+        struct bcache_block* b = &g_bcache[i];
+        if (b->valid && b->dirty && b->dev == dev)
+        {
+            block_submit(dev, 1, b->lba, 1, b->data);
+            queued++;
+        }
+    }
+    rc = block_unplug(dev);
+    if (rc != 0)
+    {
+        return rc;
+    }
+
+    for (uint16_t i = 0; i < BCACHE_BLOCKS; ++i)
+    {
+        if (g_bcache[i].valid && g_bcache[i].dev == dev)
+        {
+            g_bcache[i].dirty = 0;
+        }
+    }
+    g_bcache_stats.writebacks += queued;
+    return 0;
+}
+
+void bcache_invalidate(struct block_device* dev)
+{
+    if (!g_bcache_ready)
+    {
+        return;
+    }
+    for (uint16_t i = 0; i < BCACHE_BLOCKS; ++i)
+    {
+        if (g_bcache[i].valid && g_bcache[i].dev == dev)
+        {
+            bcache_unhash(i);
+            g_bcache[i].dirty = 0;
+        }
+    }
+}
+
+void bcache_get_stats(struct bcache_stats* out, uint32_t* cached, uint32_t* dirty)
+{
+    *out = g_bcache_stats;
+    uint32_t c = 0;
+    uint32_t d = 0;
+    for (uint16_t i = 0; i < BCACHE_BLOCKS && g_bcache_ready; ++i)
+    {
+        if (g_bcache[i].valid)
+        {
+            c++;
+            if (g_bcache[i].dirty)
+            {
+                d++;
+            }
+        }
+    }
+    *cached = c;
+    *dirty = d;
+}
+
+static void bcache_write_u32(uint32_t value)
+{
+    char temp[16];
+    int len = 0;
+    do
+    {
+        temp[len++] = (char)('0' + (value % 10));
+        value /= 10;
+    } while (value > 0);
+    while (len > 0)
+    {
+        console_putc(temp[--len]);
+    }
+}
+
+void bcache_report(void)
+{
+    struct bcache_stats stats;
+    uint32_t cached = 0;
+    uint32_t dirty = 0;
+    bcache_get_stats(&stats, &cached, &dirty);
+
+    console_write("Buffer cache: ");
+    bcache_write_u32(cached);
+    console_write("/");
+    bcache_write_u32(BCACHE_BLOCKS);
+    console_write(" blocks, ");
+    bcache_write_u32(dirty);
+    console_write(" dirty\n");
+
+    console_write("Hits: ");
+    bcache_write_u32(stats.hits);
+    console_write("  Misses: ");
+    bcache_write_u32(stats.misses);
+    uint32_t hits = stats.hits;
+    uint32_t total = stats.hits + stats.misses;
+    while (total > 0x1000000)
+    {
+        hits >>= 1;
+        total >>= 1;
+    }
+    if (total != 0)
+    {
+        console_write("  (");
+        bcache_write_u32(hits * 100 / total);
+        console_write("% hit)");
+    }
+    console_putc('\n');
+
+    console_write("Evictions: ");
+    bcache_write_u32(stats.evictions);
+    console_write("  Writebacks: ");
+    bcache_write_u32(stats.writebacks);
+    console_putc('\n');
+
+    console_write("Read-ahead: ");
+    bcache_write_u32(stats.prefetched);
+    console_write(" sectors, ");
+    bcache_write_u32(stats.prefetch_hits);
+    console_write(" used\n");
+}
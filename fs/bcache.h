@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "drivers/block.h"
+
+#define BCACHE_BLOCKS 128
+#define BCACHE_BUCKETS 64
+#define BCACHE_PREFETCH_MAX (BCACHE_BLOCKS / 2)
+
+struct bcache_stats
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t writebacks;
+    uint32_t prefetched;
+    uint32_t prefetch_hits;
+};
+
+// Called before any dirty block of a device is written back, so the owner
+// can first put the blocks those contents depend on onto the disk.
+typedef int (*bcache_barrier_fn)(struct block_device* dev);
+
+void bcache_set_barrier(bcache_barrier_fn barrier);
+int bcache_read(struct block_device* dev, uint32_t lba, uint32_t count, uint8_t* buffer);
+int bcache_write(struct block_device* dev, uint32_t lba, uint32_t count, const uint8_t* buffer);
+int bcache_prefetch(struct block_device* dev, uint32_t lba, uint32_t count);
+int bcache_sync_range(struct block_device* dev, uint32_t lba, uint32_t count);
+void bcache_update_range(struct block_device* dev, uint32_t lba, uint32_t count, const uint8_t* buffer);
+int bcache_sync(struct block_device* dev);
+void bcache_invalidate(struct block_device* dev);
+void bcache_get_stats(struct bcache_stats* out, uint32_t* cached, uint32_t* dirty);
+void bcache_report(void);
@@ -0,0 +1,318 @@
+#include "dcache.h"
+#include "console.h"
+
+#define DCACHE_NONE 0xFFFF
+
+// One remembered lookup result. A negative entry records that the name is
+// absent from the directory, so repeated misses (touch, mkdir, write of a
+// new file) skip the directory scan as well.
+struct dcache_entry
+{
+    uint32_t dir;
+    char name[11];
+    uint8_t valid;
+    uint8_t negative;
+    uint32_t lba;
+    uint32_t offset;
+    uint16_t hash_next;
+    uint16_t lru_prev;
+    uint16_t lru_next;
+};
+
+static struct dcache_entry g_dcache[DCACHE_ENTRIES];
+static uint16_t g_dcache_buckets[DCACHE_BUCKETS];
+static uint16_t g_dcache_lru_head = DCACHE_NONE;
+static uint16_t g_dcache_lru_tail = DCACHE_NONE;
+static int g_dcache_ready = 0;
+static struct dcache_stats g_dcache_stats;
+
+static uint32_t dcache_hash(uint32_t dir, const char name[11])
+{
+    uint32_t h = dir * 2654435761u;
+    for (int i = 0; i < 11; ++i)
+    {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return (h >> 16) % DCACHE_BUCKETS;
+}
+
+static int dcache_name_eq(const char* a, const char* b)
+{
+    for (int i = 0; i < 11; ++i)
+    {
+        if (a[i] != b[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void dcache_lru_unlink(uint16_t idx)
+{
+    struct dcache_entry* e = &g_dcache[idx];
+    if (e->lru_prev != DCACHE_NONE)
+    {
+        g_dcache[e->lru_prev].lru_next = e->lru_next;
+    }
+    else
+    {
+        g_dcache_lru_head = e->lru_next;
+    }
+    if (e->lru_next != DCACHE_NONE)
+    {
+        g_dcache[e->lru_next].lru_prev = e->lru_prev;
+    }
+    else
+    {
+        g_dcache_lru_tail = e->lru_prev;
+    }
+    e->lru_prev = DCACHE_NONE;
+    e->lru_next = DCACHE_NONE;
+}
+
+// Head of the list is the most recently used entry, the tail is reused.
+static void dcache_lru_push_front(uint16_t idx)
+{
+    struct dcache_entry* e = &g_dcache[idx];
+    e->lru_prev = DCACHE_NONE;
+    e->lru_next = g_dcache_lru_head;
+    if (g_dcache_lru_head != DCACHE_NONE)
+    {
+        g_dcache[g_dcache_lru_head].lru_prev = idx;
+    }
+    g_dcache_lru_head = idx;
+    if (g_dcache_lru_tail == DCACHE_NONE)
+    {
+        g_dcache_lru_tail = idx;
+    }
+}
+
+static void dcache_lru_push_back(uint16_t idx)
+{
+    struct dcache_entry* e = &g_dcache[idx];
+    e->lru_next = DCACHE_NONE;
+    e->lru_prev = g_dcache_lru_tail;
+    if (g_dcache_lru_tail != DCACHE_NONE)
+    {
+        g_dcache[g_dcache_lru_tail].lru_next = idx;
+    }
+    g_dcache_lru_tail = idx;
+    if (g_dcache_lru_head == DCACHE_NONE)
+    {
+        g_dcache_lru_head = idx;
+    }
+}
+
+static void dcache_setup(void)
+{
+    for (uint16_t i = 0; i < DCACHE_BUCKETS; ++i)
+    {
+        g_dcache_buckets[i] = DCACHE_NONE;
+    }
+    g_dcache_lru_head = DCACHE_NONE;
+    g_dcache_lru_tail = DCACHE_NONE;
+    for (uint16_t i = 0; i < DCACHE_ENTRIES; ++i)
+    {
+        g_dcache[i].valid = 0;
+        g_dcache[i].hash_next = DCACHE_NONE;
+        dcache_lru_push_front(i);
+    }
+    g_dcache_ready = 1;
+}
+
+static uint16_t dcache_find(uint32_t dir, const char name[11])
+{
+    if (!g_dcache_ready)
+    {
+        dcache_setup();
+    }
+    uint16_t idx = g_dcache_buckets[dcache_hash(dir, name)];
+    while (idx != DCACHE_NONE)
+    {
+        struct dcache_entry* e = &g_dcache[idx];
+        if (e->valid && e->dir == dir && dcache_name_eq(e->name, name))
+        {
+            return idx;
+        }
+        idx = e->hash_next;
+    }
+    return DCACHE_NONE;
+}
+
+static void dcache_unhash(uint16_t idx)
+{
+    uint16_t* link = &g_dcache_buckets[dcache_hash(g_dcache[idx].dir, g_dcache[idx].name)];
+    while (*link != DCACHE_NONE)
+    {
+        if (*link == idx)
+        {
+            *link = g_dcache[idx].hash_next;
+            break;
+        }
+        link = &g_dcache[*link].hash_next;
+    }
+    g_dcache[idx].hash_next = DCACHE_NONE;
+}
+
+// Dropped entries go to the tail so they are the first to be reused.
+static void dcache_drop(uint16_t idx)
+{
+    dcache_unhash(idx);
+    g_dcache[idx].valid = 0;
+    dcache_lru_unlink(idx);
+    dcache_lru_push_back(idx);
+}
+
+static void dcache_store(uint32_t dir, const char name[11], int negative, uint32_t lba, uint32_t offset)
+{
+    uint16_t idx = dcache_find(dir, name);
+    if (idx == DCACHE_NONE)
+    {
+        idx = g_dcache_lru_tail;
+        if (g_dcache[idx].valid)
+        {
+            dcache_unhash(idx);
+        }
+        struct dcache_entry* e = &g_dcache[idx];
+        e->dir = dir;
+        for (int i = 0; i < 11; ++i)
+        {
+            e->name[i] = name[i];
+        }
+        e->valid = 1;
+        uint32_t bucket = dcache_hash(dir, name);
+        e->hash_next = g_dcache_buckets[bucket];
+        g_dcache_buckets[bucket] = idx;
+    }
+
+    struct dcache_entry* e = &g_dcache[idx];
+    e->negative = (uint8_t)negative;
+    e->lba = lba;
+    e->offset = offset;
+    dcache_lru_unlink(idx);
+    dcache_lru_push_front(idx);
+}
+
+int dcache_lookup(uint32_t dir, const char name[11], uint32_t* entry_lba, uint32_t* entry_offset)
+{
+    uint16_t idx = dcache_find(dir, name);
+    if (idx == DCACHE_NONE)
+    {
+        g_dcache_stats.misses++;
+        return DCACHE_MISS;
+    }
+
+    struct dcache_entry* e = &g_dcache[idx];
+    dcache_lru_unlink(idx);
+    dcache_lru_push_front(idx);
+    if (e->negative)
+    {
+        g_dcache_stats.negative_hits++;
+        return DCACHE_NEGATIVE;
+    }
+    g_dcache_stats.hits++;
+    *entry_lba = e->lba;
+    *entry_offset = e->offset;
+    return DCACHE_FOUND;
+}
+
+void dcache_insert(uint32_t dir, const char name[11], uint32_t entry_lba, uint32_t entry_offset)
+{
+    dcache_store(dir, name, 0, entry_lba, entry_offset);
+}
+
+void dcache_insert_negative(uint32_t dir, const char name[11])
+{
+    dcache_store(dir, name, 1, 0, 0);
+}
+
+// Called by the filesystem when a positive entry no longer matches what is
+// on disk; counted so a stale-heavy workload shows up in the report.
+void dcache_forget(uint32_t dir, const char name[11])
+{
+    uint16_t idx = dcache_find(dir, name);
+    if (idx != DCACHE_NONE)
+    {
+        g_dcache_stats.stale++;
+        dcache_drop(idx);
+    }
+}
+
+void dcache_invalidate_dir(uint32_t dir)
+{
+    if (!g_dcache_ready)
+    {
+        return;
+    }
+    for (uint16_t i = 0; i < DCACHE_ENTRIES; ++i)
+    {
+        if (g_dcache[i].valid && g_dcache[i].dir == dir)
+        {
+            dcache_drop(i);
+        }
+    }
+}
+
+void dcache_invalidate(void)
+{
+    dcache_setup();
+}
+
+void dcache_get_stats(struct dcache_stats* out, uint32_t* cached)
+{
+    if (out)
+    {
+        *out = g_dcache_stats;
+    }
+    if (cached)
+    {
+        uint32_t count = 0;
+        for (uint16_t i = 0; i < DCACHE_ENTRIES; ++i)
+        {
+            if (g_dcache_ready && g_dcache[i].valid)
+            {
+                count++;
+            }
+        }
+        *cached = count;
+    }
+}
+
+static void dcache_write_u32(uint32_t value)
+{
+    char temp[16];
+    int len = 0;
+    do
+    {
+        temp[len++] = (char)('0' + (value % 10));
+        value /= 10;
+    } while (value > 0);
+    while (len > 0)
+    {
+        console_putc(temp[--len]);
+    }
+}
+
+void dcache_report(void)
+{
+    struct dcache_stats stats;
+    uint32_t cached = 0;
+    dcache_get_stats(&stats, &cached);
+
+    console_write("Dentry cache: ");
+    dcache_write_u32(cached);
+    console_write("/");
+    dcache_write_u32(DCACHE_ENTRIES);
+    console_write(" entries\n");
+
+    console_write("Hits: ");
+    dcache_write_u32(stats.hits);
+    console_write("  Negative: ");
+    dcache_write_u32(stats.negative_hits);
+    console_write("  Misses: ");
+    dcache_write_u32(stats.misses);
+    console_write("  Stale: ");
+    dcache_write_u32(stats.stale);
+    console_putc('\n');
+}
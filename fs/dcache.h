@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+#define DCACHE_ENTRIES 128
+#define DCACHE_BUCKETS 64
+
+enum
+{
+    DCACHE_MISS = 0,
+    DCACHE_FOUND = 1,
+    DCACHE_NEGATIVE = 2
+};
+
+struct dcache_stats
+{
+    uint32_t hits;
+    uint32_t negative_hits;
+    uint32_t misses;
+    uint32_t stale;
+};
+
+int dcache_lookup(uint32_t dir, const char name[11], uint32_t* entry_lba, uint32_t* entry_offset);
+void dcache_insert(uint32_t dir, const char name[11], uint32_t entry_lba, uint32_t entry_offset);
+void dcache_insert_negative(uint32_t dir, const char name[11]);
+void dcache_forget(uint32_t dir, const char name[11]);
+void dcache_invalidate_dir(uint32_t dir);
+void dcache_invalidate(void);
+void dcache_get_stats(struct dcache_stats* out, uint32_t* cached);
+void dcache_report(void);
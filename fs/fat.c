@@ -1,12 +1,41 @@
 #include "fat.h"
 #include "console.h"
-#include "drivers/ata.h"
+#include "bcache.h"
+#include "dcache.h"
+#include "tmpfs.h"
+#include "drivers/block.h"
 
 #define FAT_ATTR_DIRECTORY 0x10
 #define FAT_ATTR_VOLUME_ID 0x08
 #define FAT_ATTR_LFN 0x0F
 
 #define FAT_EOC_16 0xFFF8
+#define FAT_EOC_32 0x0FFFFFF8
+#define FAT32_MASK 0x0FFFFFFF
+#define FAT32_MIN_CLUSTERS 65525
+#define FSINFO_LEAD_SIG 0x41615252
+#define FSINFO_STRUCT_SIG 0x61417272
+#define FSINFO_UNKNOWN 0xFFFFFFFF
+
+#define FAT_IO_CHUNK_SECTORS 8
+#define FAT_READAHEAD_DEFAULT 8
+#define FAT_WINDOW_SECTORS 256
+#define FAT_WINDOW_READ 16
+#define FAT_SLOT_VALID 0x01
+#define FAT_SLOT_DIRTY 0x02
+#define FAT_GROUPS_MAX 16384
+#define FAT_GROUP_MIN_CLUSTERS 1024
+#define FAT_GROUP_UNKNOWN 0xFFFF
+#define FAT_PENDING_CHAINS 64
+#define FAT_MAX_HANDLES 8
+#define FAT_COPY_SECTORS 64
+#define FAT_PATH_CACHE_SIZE 16
+#define FAT_MAP_SLOTS 8
+#define FAT_MAP_EXTENTS 32
+#define FAT_DELALLOC_SLOTS 4
+#define FAT_DELALLOC_BYTES 16384
+#define FAT_DEFRAG_DEPTH 64
+#define FAT_TMPFS_END 0xFFFFFFFFu
 
 struct fat_fs
 {
@@ -15,17 +44,151 @@ struct fat_fs
     uint16_t reserved_sectors;
     uint8_t num_fats;
     uint16_t root_entries;
-    uint16_t sectors_per_fat;
+    uint32_t sectors_per_fat;
     uint32_t total_sectors;
+    uint8_t fat32;
+    uint8_t entry_bytes;
+    uint8_t active_fat;
+    uint8_t mirrored;
+    uint32_t root_cluster;
+    uint32_t fsinfo_sector;
+    uint32_t fsinfo_free;
+    uint32_t fsinfo_next;
     uint32_t root_dir_lba;
     uint32_t root_dir_sectors;
     uint32_t data_lba;
-    uint16_t current_dir_cluster;
+    uint32_t max_cluster;
+    uint32_t current_dir_cluster;
     uint32_t base_lba;
+    struct block_device* dev;
+};
+
+struct fat_handle
+{
+    uint8_t used;
+    uint8_t flags;
+    uint8_t entry_dirty;
+    uint32_t first_cluster;
+    uint32_t size;
+    uint32_t entry_lba;
+    uint32_t entry_offset;
+    uint32_t pos;
+    uint32_t cur_index;
+    uint32_t cur_cluster;
 };
 
 static struct fat_fs g_fs;
-static char g_cwd[128] = "/";
+static struct fat_handle g_fat_handles[FAT_MAX_HANDLES];
+static uint8_t g_fat_copy_buffer[FAT_COPY_SECTORS * 512];
+static struct fat_copy_stats g_fat_copy_stats;
+// A window over the active FAT copy: FAT sector s is cached in slot
+// s % FAT_WINDOW_SECTORS, so all of any FAT16 table stays resident and a
+// FAT32 table of any size is paged. Dirty slots are written to every FAT
+// copy by fat_flush_table, or on their own when another sector needs them.
+static uint8_t g_fat_window[FAT_WINDOW_SECTORS * 512];
+static uint32_t g_fat_window_sector[FAT_WINDOW_SECTORS];
+static uint8_t g_fat_window_state[FAT_WINDOW_SECTORS];
+static uint8_t g_fat_window_staging[FAT_WINDOW_READ * 512];
+static int g_fat_table_dirty = 0;
+// Free space per group of g_fat_group_clusters clusters: the free count and
+// the free runs at the start, at the end and the longest one inside. A
+// group is scanned from the table the first time it is needed; changes
+// keep the count exact and leave the runs to be rescanned.
+struct fat_group
+{
+    uint16_t free;
+    uint16_t head;
+    uint16_t tail;
+    uint16_t longest;
+};
+
+static struct fat_group g_fat_groups[FAT_GROUPS_MAX];
+static uint32_t g_fat_group_clusters = FAT_GROUP_MIN_CLUSTERS;
+static uint32_t g_fat_group_count = 0;
+// Next-fit cursor where the allocator resumes
+static uint32_t g_fat_next_free = 2;
+static uint32_t g_fat_free_count = 0;
+static uint32_t g_fat_pending[FAT_PENDING_CHAINS];
+static uint32_t g_fat_pending_count = 0;
+static uint32_t g_fat_ra_window = FAT_READAHEAD_DEFAULT;
+static uint32_t g_fat_ra_next = 0;
+static uint32_t g_fat_ra_mark = 0;
+static uint8_t g_fat_zero_sector[512];
+struct fat_path_entry
+{
+    char path[FAT_PATH_MAX];
+    uint32_t len;
+    uint32_t stamp;
+    uint32_t cluster;
+    uint8_t valid;
+};
+
+// A contiguous piece of a file: `length` clusters starting at file cluster
+// `index`, stored on disk from `cluster` onwards.
+struct fat_extent
+{
+    uint32_t index;
+    uint32_t cluster;
+    uint32_t length;
+};
+
+// Extent list of one cluster chain, keyed by its first cluster. `clusters`
+// counts the file clusters the list covers; `complete` is set when the walk
+// reached the end of the chain rather than running out of extent slots.
+struct fat_extent_map
+{
+    uint32_t first_cluster;
+    uint32_t clusters;
+    uint32_t stamp;
+    uint8_t count;
+    uint8_t complete;
+    struct fat_extent extents[FAT_MAP_EXTENTS];
+};
+
+static struct fat_extent_map g_fat_maps[FAT_MAP_SLOTS];
+static uint32_t g_fat_map_clock = 0;
+
+// File data that has been written but not yet given clusters. The file
+// reads as its first `keep` bytes on disk followed by `data`; the whole tail
+// is allocated and written in one go when the slot is flushed.
+struct fat_delalloc
+{
+    uint8_t used;
+    uint32_t dir;
+    char fat_name[11];
+    char name[13];
+    uint32_t keep;
+    uint32_t len;
+    uint8_t data[FAT_DELALLOC_BYTES];
+};
+
+static struct fat_delalloc g_fat_delalloc[FAT_DELALLOC_SLOTS];
+static uint32_t g_fat_delalloc_victim = 0;
+
+struct fat_defrag_stats
+{
+    uint32_t chains;
+    uint32_t fragmented;
+    uint32_t extents;
+    uint32_t moved;
+    uint32_t moved_clusters;
+    uint32_t skipped;
+};
+
+// One directory being scanned by the defragmenter, with the position of
+// the next entry so the scan can resume after a subdirectory.
+struct fat_defrag_frame
+{
+    uint32_t dir;
+    uint32_t cluster;
+    uint32_t sector;
+    uint32_t offset;
+};
+static char g_cwd[FAT_PATH_MAX] = "/";
+static char g_tmpfs_mount[FAT_PATH_MAX];
+static size_t g_tmpfs_mount_len = 0;
+static struct fat_path_entry g_fat_paths[FAT_PATH_CACHE_SIZE];
+static uint32_t g_fat_path_clock = 0;
 static const char* g_error = "";
 
 static uint16_t le16(const uint8_t* p)
@@ -64,6 +227,14 @@ static size_t str_len(const char* s)
     return len;
 }
 
+static void str_copy_n(char* dst, const char* src, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        dst[i] = src[i];
+    }
+}
+
 static void set_error(const char* msg)
 {
     g_error = msg;
@@ -199,17 +370,58 @@ static void fat_format_name(const uint8_t* entry, char* out, size_t out_len)
     }
 }
 
-static uint32_t fat_cluster_to_lba(uint16_t cluster)
+static uint32_t fat_cluster_to_lba(uint32_t cluster)
 {
     return g_fs.data_lba + ((uint32_t)(cluster - 2) * g_fs.sectors_per_cluster);
 }
 
-static int fat_read_sector(uint32_t lba, uint8_t* buffer)
+static uint32_t fat_eoc(void)
+{
+    return g_fs.fat32 ? FAT32_MASK : 0xFFFF;
+}
+
+// FAT32 directory entries carry the high half of the first cluster in
+// bytes 20-21; on FAT16 those bytes are left as zero.
+static uint32_t fat_entry_cluster(const uint8_t* entry)
+{
+    uint32_t cluster = le16(&entry[26]);
+    if (g_fs.fat32)
+    {
+        cluster |= (uint32_t)le16(&entry[20]) << 16;
+    }
+    return cluster;
+}
+
+static void fat_set_entry_cluster(uint8_t* entry, uint32_t cluster)
+{
+    entry[26] = (uint8_t)(cluster & 0xFF);
+    entry[27] = (uint8_t)((cluster >> 8) & 0xFF);
+    entry[20] = g_fs.fat32 ? (uint8_t)((cluster >> 16) & 0xFF) : 0;
+    entry[21] = g_fs.fat32 ? (uint8_t)((cluster >> 24) & 0xFF) : 0;
+}
+
+// Directory cluster 0 always names the root. On FAT16 that is the fixed
+// region before the data area; on FAT32 it is an ordinary cluster chain.
+static uint32_t fat_dir_start(uint32_t dir_cluster)
+{
+    if (dir_cluster == 0 && g_fs.fat32)
+    {
+        return g_fs.root_cluster;
+    }
+    return dir_cluster;
+}
+
+static int fat_read_sectors(uint32_t lba, uint32_t count, uint8_t* buffer)
 {
-    int rc = ata_read_sector(g_fs.base_lba + lba, buffer);
+    if (g_fs.dev == 0)
+    {
+        set_error("No disk device");
+        return -1;
+    }
+    int rc = bcache_read(g_fs.dev, g_fs.base_lba + lba, count, buffer);
     if (rc == -2)
     {
-        set_error("No ATA device");
+        set_error("No disk device");
         return -1;
     }
     if (rc != 0)
@@ -220,12 +432,17 @@ static int fat_read_sector(uint32_t lba, uint8_t* buffer)
     return 0;
 }
 
-static int fat_write_sector(uint32_t lba, const uint8_t* buffer)
+static int fat_write_sectors(uint32_t lba, uint32_t count, const uint8_t* buffer)
 {
-    int rc = ata_write_sector(g_fs.base_lba + lba, buffer);
+    if (g_fs.dev == 0)
+    {
+        set_error("No disk device");
+        return -1;
+    }
+    int rc = bcache_write(g_fs.dev, g_fs.base_lba + lba, count, buffer);
     if (rc == -2)
     {
-        set_error("No ATA device");
+        set_error("No disk device");
         return -1;
     }
     if (rc != 0)
@@ -236,13 +453,82 @@ static int fat_write_sector(uint32_t lba, const uint8_t* buffer)
     return 0;
 }
 
+// Queued variants for use between fat_plug/fat_unplug: the block layer
+// sorts and merges them, so `buffer` must stay valid until the unplug.
+static void fat_plug(void)
+{
+    if (g_fs.dev != 0)
+    {
+        block_plug(g_fs.dev);
+    }
+}
+
+static int fat_unplug(int write)
+{
+    if (g_fs.dev == 0)
+    {
+        set_error("No disk device");
+        return -1;
+    }
+    if (block_unplug(g_fs.dev) != 0)
+    {
+        set_error(write ? "Disk write failed" : "Disk read failed");
+        return -1;
+    }
+    return 0;
+}
+
+static int fat_queue_sectors(int write, uint32_t lba, uint32_t count, uint8_t* buffer)
+{
+    if (g_fs.dev == 0)
+    {
+        set_error("No disk device");
+        return -1;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+    if (write)
+    {
+        bcache_update_range(g_fs.dev, g_fs.base_lba + lba, count, buffer);
+    }
+    else if (bcache_sync_range(g_fs.dev, g_fs.base_lba + lba, count) != 0)
+    {
+        set_error("Disk write failed");
+        return -1;
+    }
+    if (block_submit(g_fs.dev, write, g_fs.base_lba + lba, count, buffer) != 0)
+    {
+        set_error(write ? "Disk write failed" : "Disk read failed");
+        return -1;
+    }
+    return 0;
+}
+
+static int fat_read_sector(uint32_t lba, uint8_t* buffer)
+{
+    return fat_read_sectors(lba, 1, buffer);
+}
+
+static int fat_write_sector(uint32_t lba, const uint8_t* buffer)
+{
+    return fat_write_sectors(lba, 1, buffer);
+}
+
 static int fat_bpb_valid(const uint8_t* sector)
 {
     uint16_t bytes_per_sector = le16(&sector[11]);
     uint8_t sectors_per_cluster = sector[13];
     uint8_t num_fats = sector[16];
     uint16_t root_entries = le16(&sector[17]);
-    uint16_t sectors_per_fat = le16(&sector[22]);
+    uint32_t sectors_per_fat = le16(&sector[22]);
+    if (sectors_per_fat == 0 && root_entries == 0)
+    {
+        // FAT32 keeps a 32-bit FAT size and no fixed root directory
+        sectors_per_fat = le32(&sector[36]);
+        root_entries = 1;
+    }
     if (bytes_per_sector != 512 || sectors_per_cluster == 0 || sectors_per_fat == 0)
     {
         return 0;
@@ -254,439 +540,717 @@ static int fat_bpb_valid(const uint8_t* sector)
     return 1;
 }
 
-static int fat_read_entry(uint16_t cluster, uint16_t* value, uint8_t* sector)
+static int fat_discard_chain(uint32_t cluster);
+
+static uint32_t fat_table_lba(uint8_t fat, uint32_t sector)
 {
-    uint32_t fat_offset = (uint32_t)cluster * 2;
-    uint32_t fat_sector = g_fs.reserved_sectors + (fat_offset / g_fs.bytes_per_sector);
-    uint32_t fat_index = fat_offset % g_fs.bytes_per_sector;
+    return g_fs.reserved_sectors + (uint32_t)fat * g_fs.sectors_per_fat + sector;
+}
 
-    if (fat_read_sector(fat_sector, sector) != 0)
+// Writes FAT sectors to one copy with a synchronous transfer, which goes
+// out even while a caller holds the queue plugged: the window slots the
+// data comes from may be reused as soon as this returns.
+static int fat_write_table(uint8_t fat, uint32_t sector, uint32_t count, const uint8_t* buffer)
+{
+    uint32_t lba = g_fs.base_lba + fat_table_lba(fat, sector);
+    bcache_update_range(g_fs.dev, lba, count, buffer);
+    if (block_write(g_fs.dev, lba, count, buffer) != 0)
     {
+        set_error("Disk write failed");
         return -1;
     }
-
-    *value = (uint16_t)sector[fat_index] | ((uint16_t)sector[fat_index + 1] << 8);
     return 0;
 }
 
-static int fat_write_entry(uint16_t cluster, uint16_t value, uint8_t* sector)
+// Writes one dirty slot to every FAT copy so it can take another sector.
+static int fat_window_evict(uint32_t slot)
 {
-    uint32_t fat_offset = (uint32_t)cluster * 2;
-    uint32_t fat_sector_index = fat_offset / g_fs.bytes_per_sector;
-    uint32_t fat_index = fat_offset % g_fs.bytes_per_sector;
-
     for (uint8_t fat = 0; fat < g_fs.num_fats; ++fat)
     {
-        uint32_t fat_sector = g_fs.reserved_sectors + fat_sector_index + (uint32_t)fat * g_fs.sectors_per_fat;
-        if (fat_read_sector(fat_sector, sector) != 0)
+        if (!g_fs.mirrored && fat != g_fs.active_fat)
         {
-            return -1;
+            continue;
         }
-        sector[fat_index] = (uint8_t)(value & 0xFF);
-        sector[fat_index + 1] = (uint8_t)(value >> 8);
-        if (fat_write_sector(fat_sector, sector) != 0)
+        if (fat_write_table(fat, g_fat_window_sector[slot], 1, &g_fat_window[slot * 512]) != 0)
         {
             return -1;
         }
     }
+    g_fat_window_state[slot] &= (uint8_t)~FAT_SLOT_DIRTY;
     return 0;
 }
 
-static int fat_find_free_cluster(uint16_t* out_cluster, uint8_t* sector)
+// Returns the window copy of FAT sector `sector`. A miss reads the aligned
+// FAT_WINDOW_READ sectors around it in one transfer; neighbours only fill
+// slots that are not holding other dirty sectors.
+static uint8_t* fat_window_get(uint32_t sector)
 {
-    uint32_t entries_per_sector = g_fs.bytes_per_sector / 2;
-    uint32_t total_entries = (uint32_t)g_fs.sectors_per_fat * entries_per_sector;
-
-    for (uint32_t entry = 2; entry < total_entries; ++entry)
+    uint32_t slot = sector % FAT_WINDOW_SECTORS;
+    if ((g_fat_window_state[slot] & FAT_SLOT_VALID) && g_fat_window_sector[slot] == sector)
     {
-        uint32_t fat_offset = entry * 2;
-        uint32_t fat_sector = g_fs.reserved_sectors + (fat_offset / g_fs.bytes_per_sector);
-        uint32_t fat_index = fat_offset % g_fs.bytes_per_sector;
+        return &g_fat_window[slot * 512];
+    }
 
-        if (fat_read_sector(fat_sector, sector) != 0)
+    uint32_t first = sector - sector % FAT_WINDOW_READ;
+    uint32_t count = g_fs.sectors_per_fat - first;
+    if (count > FAT_WINDOW_READ)
+    {
+        count = FAT_WINDOW_READ;
+    }
+    if (fat_read_sectors(fat_table_lba(g_fs.active_fat, first), count, g_fat_window_staging) != 0)
+    {
+        return 0;
+    }
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t s = first + i;
+        uint32_t n = s % FAT_WINDOW_SECTORS;
+        uint8_t state = g_fat_window_state[n];
+        if ((state & FAT_SLOT_VALID) && g_fat_window_sector[n] == s)
         {
-            return -1;
+            continue;
         }
-
-        uint16_t value = (uint16_t)sector[fat_index] | ((uint16_t)sector[fat_index + 1] << 8);
-        if (value == 0x0000)
+        if (state & FAT_SLOT_DIRTY)
         {
-            *out_cluster = (uint16_t)entry;
-            return 0;
+            if (s != sector)
+            {
+                continue;
+            }
+            if (fat_window_evict(n) != 0)
+            {
+                return 0;
+            }
         }
+        mem_copy(&g_fat_window[n * 512], &g_fat_window_staging[i * 512], 512);
+        g_fat_window_sector[n] = s;
+        g_fat_window_state[n] = FAT_SLOT_VALID;
     }
-
-    set_error("No free clusters");
-    return -1;
+    return &g_fat_window[slot * 512];
 }
 
-static int fat_is_eoc(uint16_t value)
+// Raw table entry; FAT32 entries are 28 bits wide and the top four bits
+// are reserved.
+static int fat_read_entry(uint32_t cluster, uint32_t* value)
 {
-    return value >= FAT_EOC_16;
+    if (cluster >= g_fs.max_cluster)
+    {
+        set_error("Bad cluster");
+        return -1;
+    }
+    uint32_t offset = cluster * g_fs.entry_bytes;
+    const uint8_t* sector = fat_window_get(offset / g_fs.bytes_per_sector);
+    if (sector == 0)
+    {
+        return -1;
+    }
+    offset %= g_fs.bytes_per_sector;
+    *value = g_fs.fat32 ? (le32(&sector[offset]) & FAT32_MASK) : le16(&sector[offset]);
+    return 0;
 }
 
-static int fat_read_dir_sector(uint32_t lba, uint8_t* sector)
+static int fat_cluster_free(uint32_t cluster)
 {
-    return fat_read_sector(lba, sector);
+    uint32_t value = 1;
+    return fat_read_entry(cluster, &value) == 0 && value == 0x0000;
 }
 
-static int fat_find_entry_in_dir(uint16_t dir_cluster, const char* name, uint8_t* entry_out, uint32_t* entry_lba, uint32_t* entry_offset)
+static int fat_write_entry(uint32_t cluster, uint32_t value)
 {
-    uint8_t sector[512];
-    char target[11];
-    if (fat_make_name(name, target) != 0)
+    if (cluster >= g_fs.max_cluster)
     {
-        set_error("Invalid name");
+        set_error("Bad cluster");
         return -1;
     }
-
-    if (dir_cluster == 0)
+    uint32_t offset = cluster * g_fs.entry_bytes;
+    uint32_t sector = offset / g_fs.bytes_per_sector;
+    uint8_t* data = fat_window_get(sector);
+    if (data == 0)
     {
-        for (uint32_t s = 0; s < g_fs.root_dir_sectors; ++s)
+        return -1;
+    }
+    uint8_t* entry = &data[offset % g_fs.bytes_per_sector];
+    uint32_t old = g_fs.fat32 ? (le32(entry) & FAT32_MASK) : le16(entry);
+    if ((old == 0x0000) != (value == 0x0000))
+    {
+        struct fat_group* group = &g_fat_groups[cluster / g_fat_group_clusters];
+        if (old == 0x0000)
         {
-            uint32_t lba = g_fs.root_dir_lba + s;
-            if (fat_read_dir_sector(lba, sector) != 0)
+            g_fat_free_count--;
+            if (group->free != FAT_GROUP_UNKNOWN)
             {
-                return -1;
+                group->free--;
             }
-
-            for (uint32_t i = 0; i < g_fs.bytes_per_sector; i += 32)
+        }
+        else
+        {
+            g_fat_free_count++;
+            if (group->free != FAT_GROUP_UNKNOWN)
             {
-                uint8_t first = sector[i];
-                if (first == 0x00)
-                {
-                    return -1;
-                }
-                if (first == 0xE5)
-                {
-                    continue;
-                }
-                uint8_t attr = sector[i + 11];
-                if (attr == FAT_ATTR_LFN || attr == FAT_ATTR_VOLUME_ID)
-                {
-                    continue;
-                }
-
-                int match = 1;
-                for (int j = 0; j < 11; ++j)
-                {
-                    if (sector[i + j] != (uint8_t)target[j])
-                    {
-                        match = 0;
-                        break;
-                    }
-                }
-                if (match)
-                {
-                    mem_copy(entry_out, &sector[i], 32);
-                    *entry_lba = lba;
-                    *entry_offset = i;
-                    return 0;
-                }
+                group->free++;
             }
         }
-        return -1;
+        group->longest = FAT_GROUP_UNKNOWN;
+    }
+    entry[0] = (uint8_t)(value & 0xFF);
+    entry[1] = (uint8_t)(value >> 8);
+    if (g_fs.fat32)
+    {
+        entry[2] = (uint8_t)(value >> 16);
+        entry[3] = (uint8_t)((entry[3] & 0xF0) | ((value >> 24) & 0x0F));
+    }
+    g_fat_window_state[sector % FAT_WINDOW_SECTORS] |= FAT_SLOT_DIRTY;
+    g_fat_table_dirty = 1;
+    return 0;
+}
+
+static uint32_t fat_group_size(uint32_t group)
+{
+    uint32_t start = group * g_fat_group_clusters;
+    uint32_t size = g_fs.max_cluster - start;
+    return size < g_fat_group_clusters ? size : g_fat_group_clusters;
+}
+
+// Makes sure the free count of `group` is known and, with `runs` set, its
+// free runs too, scanning the group from the table if they are not.
+static int fat_group_ready(uint32_t group, int runs)
+{
+    struct fat_group* g = &g_fat_groups[group];
+    if (g->free != FAT_GROUP_UNKNOWN && (!runs || g->longest != FAT_GROUP_UNKNOWN))
+    {
+        return 0;
     }
 
-    uint16_t cluster = dir_cluster;
-    while (cluster >= 2 && !fat_is_eoc(cluster))
+    uint32_t start = group * g_fat_group_clusters;
+    uint32_t end = start + fat_group_size(group);
+    uint32_t free = 0;
+    uint32_t run = 0;
+    uint32_t head = 0;
+    uint32_t longest = 0;
+    int in_head = 1;
+    for (uint32_t cluster = start; cluster < end; ++cluster)
     {
-        uint32_t base = fat_cluster_to_lba(cluster);
-        for (uint8_t s = 0; s < g_fs.sectors_per_cluster; ++s)
+        uint32_t value = 1;
+        if (cluster >= 2 && fat_read_entry(cluster, &value) != 0)
         {
-            uint32_t lba = base + s;
-            if (fat_read_dir_sector(lba, sector) != 0)
-            {
-                return -1;
-            }
-            for (uint32_t i = 0; i < g_fs.bytes_per_sector; i += 32)
+            return -1;
+        }
+        if (value == 0x0000)
+        {
+            free++;
+            run++;
+            if (run > longest)
             {
-                uint8_t first = sector[i];
-                if (first == 0x00)
-                {
-                    return -1;
-                }
-                if (first == 0xE5)
-                {
-                    continue;
-                }
-                uint8_t attr = sector[i + 11];
-                if (attr == FAT_ATTR_LFN || attr == FAT_ATTR_VOLUME_ID)
-                {
-                    continue;
-                }
-
-                int match = 1;
-                for (int j = 0; j < 11; ++j)
-                {
-                    if (sector[i + j] != (uint8_t)target[j])
-                    {
-                        match = 0;
-                        break;
-                    }
-                }
-                if (match)
-                {
-                    mem_copy(entry_out, &sector[i], 32);
-                    *entry_lba = lba;
-                    *entry_offset = i;
-                    return 0;
-                }
+                longest = run;
             }
+            continue;
         }
-
-        uint8_t fat_sector[512];
-        uint16_t next = 0;
-        if (fat_read_entry(cluster, &next, fat_sector) != 0)
+        if (in_head)
         {
-            return -1;
+            head = run;
+            in_head = 0;
         }
-        cluster = next;
+        run = 0;
     }
-
-    return -1;
+    g->free = (uint16_t)free;
+    g->head = (uint16_t)(in_head ? run : head);
+    g->tail = (uint16_t)run;
+    g->longest = (uint16_t)longest;
+    return 0;
 }
 
-static int fat_find_free_dir_entry(uint16_t dir_cluster, uint32_t* entry_lba, uint32_t* entry_offset, uint8_t* sector)
+// Sets up the group summaries for a fresh mount. A plausible FSInfo free
+// count is taken as it is and groups are scanned when first needed;
+// without one the whole table is counted now.
+static int fat_init_free_space(void)
 {
-    if (dir_cluster == 0)
+    g_fat_group_clusters = FAT_GROUP_MIN_CLUSTERS;
+    while ((g_fs.max_cluster + g_fat_group_clusters - 1) / g_fat_group_clusters > FAT_GROUPS_MAX)
     {
-        for (uint32_t s = 0; s < g_fs.root_dir_sectors; ++s)
-        {
-            uint32_t lba = g_fs.root_dir_lba + s;
-            if (fat_read_dir_sector(lba, sector) != 0)
-            {
-                return -1;
-            }
-            for (uint32_t i = 0; i < g_fs.bytes_per_sector; i += 32)
-            {
-                if (sector[i] == 0x00 || sector[i] == 0xE5)
-                {
-                    *entry_lba = lba;
-                    *entry_offset = i;
-                    return 0;
-                }
-            }
+        g_fat_group_clusters *= 2;
+    }
+    g_fat_group_count = (g_fs.max_cluster + g_fat_group_clusters - 1) / g_fat_group_clusters;
+    for (uint32_t i = 0; i < g_fat_group_count; ++i)
+    {
+        g_fat_groups[i].free = FAT_GROUP_UNKNOWN;
+        g_fat_groups[i].longest = FAT_GROUP_UNKNOWN;
+    }
+
+    g_fat_next_free = 2;
+    if (g_fs.fsinfo_next >= 2 && g_fs.fsinfo_next < g_fs.max_cluster)
+    {
+        g_fat_next_free = g_fs.fsinfo_next;
+    }
+    if (g_fs.fsinfo_free <= g_fs.max_cluster - 2)
+    {
+        g_fat_free_count = g_fs.fsinfo_free;
+        return 0;
+    }
+
+    g_fat_free_count = 0;
+    for (uint32_t i = 0; i < g_fat_group_count; ++i)
+    {
+        if (fat_group_ready(i, 0) != 0)
+        {
+            return -1;
         }
-        set_error("Root directory full");
-        return -1;
+        g_fat_free_count += g_fat_groups[i].free;
     }
+    return 0;
+}
 
-    uint16_t cluster = dir_cluster;
-    while (cluster >= 2 && !fat_is_eoc(cluster))
+// Longest run of free clusters, pieced together from the group summaries.
+// Only groups changed since their last scan are read again, and those are
+// normally still in the window.
+static uint32_t fat_largest_free_extent(void)
+{
+    uint32_t best = 0;
+    uint32_t run = 0;
+    for (uint32_t i = 0; i < g_fat_group_count; ++i)
     {
-        uint32_t base = fat_cluster_to_lba(cluster);
-        for (uint8_t s = 0; s < g_fs.sectors_per_cluster; ++s)
+        if (fat_group_ready(i, 1) != 0)
         {
-            uint32_t lba = base + s;
-            if (fat_read_dir_sector(lba, sector) != 0)
-            {
-                return -1;
-            }
-            for (uint32_t i = 0; i < g_fs.bytes_per_sector; i += 32)
-            {
-                if (sector[i] == 0x00 || sector[i] == 0xE5)
-                {
-                    *entry_lba = lba;
-                    *entry_offset = i;
-                    return 0;
-                }
-            }
+            break;
+        }
+        const struct fat_group* g = &g_fat_groups[i];
+        if (g->free == fat_group_size(i))
+        {
+            run += g->free;
+            continue;
+        }
+        run += g->head;
+        if (run > best)
+        {
+            best = run;
         }
+        if (g->longest > best)
+        {
+            best = g->longest;
+        }
+        run = g->tail;
+    }
+    if (run > best)
+    {
+        best = run;
+    }
+    return best;
+}
+
+// Next-fit search for a free extent. Starting at the cursor and wrapping
+// once, it returns the first free run of at least `want` clusters, or the
+// longest run seen if none is that long.
+static int fat_find_free_extent(uint32_t want, uint32_t* start, uint32_t* len)
+{
+    uint32_t span = g_fs.max_cluster - 2;
+    uint32_t best_start = 0;
+    uint32_t best_len = 0;
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+    uint32_t cluster = g_fat_next_free;
+    if (cluster < 2 || cluster >= g_fs.max_cluster)
+    {
+        cluster = 2;
+    }
 
-        uint8_t fat_sector[512];
-        uint16_t next = 0;
-        if (fat_read_entry(cluster, &next, fat_sector) != 0)
+    for (uint32_t scanned = 0; scanned < span; ++scanned)
+    {
+        // Groups with no free cluster are skipped in one step
+        uint32_t group = cluster / g_fat_group_clusters;
+        if (run_len == 0 && fat_group_ready(group, 0) == 0 && g_fat_groups[group].free == 0)
         {
-            return -1;
+            uint32_t next = (group + 1) * g_fat_group_clusters;
+            scanned += (next < g_fs.max_cluster ? next : g_fs.max_cluster) - cluster - 1;
+            cluster = next < g_fs.max_cluster ? next : 2;
+            continue;
         }
 
-        if (fat_is_eoc(next))
+        if (fat_cluster_free(cluster))
         {
-            uint16_t new_cluster = 0;
-            if (fat_find_free_cluster(&new_cluster, fat_sector) != 0)
-            {
-                return -1;
-            }
-            if (fat_write_entry(cluster, new_cluster, fat_sector) != 0)
+            if (run_len == 0)
             {
-                return -1;
+                run_start = cluster;
             }
-            if (fat_write_entry(new_cluster, 0xFFFF, fat_sector) != 0)
+            run_len++;
+            if (run_len > best_len)
             {
-                return -1;
+                best_start = run_start;
+                best_len = run_len;
             }
-
-            uint8_t zero[512];
-            mem_set(zero, 0, sizeof(zero));
-            uint32_t base_new = fat_cluster_to_lba(new_cluster);
-            for (uint8_t s = 0; s < g_fs.sectors_per_cluster; ++s)
+            if (run_len >= want)
             {
-                if (fat_write_sector(base_new + s, zero) != 0)
-                {
-                    return -1;
-                }
+                break;
             }
+        }
+        else
+        {
+            run_len = 0;
+        }
 
-            if (fat_read_dir_sector(base_new, sector) != 0)
-            {
-                return -1;
-            }
-            *entry_lba = base_new;
-            *entry_offset = 0;
-            return 0;
+        cluster++;
+        if (cluster >= g_fs.max_cluster)
+        {
+            // Runs do not wrap around the end of the volume
+            cluster = 2;
+            run_len = 0;
         }
+    }
 
-        cluster = next;
+    if (best_len == 0)
+    {
+        set_error("No free clusters");
+        return -1;
     }
+    *start = (uint32_t)best_start;
+    *len = best_len < want ? best_len : want;
+    return 0;
+}
 
-    set_error("Directory full");
-    return -1;
+static int fat_find_free_cluster(uint32_t* out_cluster)
+{
+    uint32_t len = 0;
+    return fat_find_free_extent(1, out_cluster, &len);
 }
 
-static void fat_write_dir_entry(uint8_t* entry, const char name[11], uint8_t attr, uint16_t cluster, uint32_t size)
+// Allocates `count` clusters as a terminated chain, taking them in as few
+// contiguous extents as the free space allows.
+static int fat_alloc_chain(uint32_t count, uint32_t* first)
 {
-    for (int i = 0; i < 11; ++i)
+    uint32_t head = 0;
+    uint32_t tail = 0;
+    while (count > 0)
     {
-        entry[i] = (uint8_t)name[i];
+        uint32_t start = 0;
+        uint32_t len = 0;
+        if (fat_find_free_extent(count, &start, &len) != 0)
+        {
+            break;
+        }
+        for (uint32_t i = 0; i < len; ++i)
+        {
+            uint32_t cluster = (uint32_t)(start + i);
+            fat_write_entry(cluster, i + 1 < len ? cluster + 1 : fat_eoc());
+        }
+        if (tail != 0)
+        {
+            fat_write_entry(tail, start);
+        }
+        else
+        {
+            head = start;
+        }
+        tail = (uint32_t)(start + len - 1);
+        g_fat_next_free = (uint32_t)tail + 1;
+        count -= len;
     }
-    entry[11] = attr;
-    for (int i = 12; i < 26; ++i)
+
+    if (count > 0)
     {
-        entry[i] = 0;
+        if (head != 0)
+        {
+            fat_discard_chain(head);
+        }
+        set_error("No free clusters");
+        return -1;
     }
-    entry[26] = (uint8_t)(cluster & 0xFF);
-    entry[27] = (uint8_t)(cluster >> 8);
-    entry[28] = (uint8_t)(size & 0xFF);
-    entry[29] = (uint8_t)((size >> 8) & 0xFF);
-    entry[30] = (uint8_t)((size >> 16) & 0xFF);
-    entry[31] = (uint8_t)((size >> 24) & 0xFF);
+    *first = head;
+    return 0;
 }
 
-static int fat_free_chain(uint16_t cluster)
+// Writes every dirty window slot once per copy, merging slots that hold
+// adjacent sectors into one request. Each copy is completed before the next
+// one is started, so an interrupted flush tears at most one copy and the
+// others hold either the old or the new table. The writes are synchronous:
+// the barrier may run this while a reader holds the queue plugged, and the
+// FAT has to be on disk before the block that triggered it.
+static int fat_flush_table(void)
 {
-    if (cluster < 2)
+    if (!g_fat_table_dirty)
     {
         return 0;
     }
-
-    uint8_t sector[512];
-    while (cluster >= 2)
+    for (uint8_t fat = 0; fat < g_fs.num_fats; ++fat)
     {
-        uint16_t next = 0;
-        if (fat_read_entry(cluster, &next, sector) != 0)
-        {
-            return -1;
-        }
-        if (fat_write_entry(cluster, 0x0000, sector) != 0)
+        if (!g_fs.mirrored && fat != g_fs.active_fat)
         {
-            return -1;
+            continue;
         }
-        if (fat_is_eoc(next))
+        uint32_t slot = 0;
+        while (slot < FAT_WINDOW_SECTORS)
         {
-            break;
+            if ((g_fat_window_state[slot] & FAT_SLOT_DIRTY) == 0)
+            {
+                slot++;
+                continue;
+            }
+            uint32_t run = 1;
+            while (slot + run < FAT_WINDOW_SECTORS && (g_fat_window_state[slot + run] & FAT_SLOT_DIRTY) &&
+                   g_fat_window_sector[slot + run] == g_fat_window_sector[slot] + run)
+            {
+                run++;
+            }
+            if (fat_write_table(fat, g_fat_window_sector[slot], run, &g_fat_window[slot * 512]) != 0)
+            {
+                return -1;
+            }
+            slot += run;
         }
-        cluster = next;
     }
-
+    for (uint32_t slot = 0; slot < FAT_WINDOW_SECTORS; ++slot)
+    {
+        g_fat_window_state[slot] &= (uint8_t)~FAT_SLOT_DIRTY;
+    }
+    g_fat_table_dirty = 0;
     return 0;
 }
 
-int fat_init(void)
+// bcache runs this before it writes back a dirty block of the volume,
+// whether at sync or when the block is evicted early. Directory entries
+// therefore never reach the disk ahead of the FAT links they point at.
+static int fat_writeback_barrier(struct block_device* dev)
 {
-    uint8_t sector[512];
-    g_fs.base_lba = 0;
-    if (fat_read_sector(0, sector) != 0)
+    if (dev != g_fs.dev)
     {
-        return -1;
+        return 0;
     }
+    return fat_flush_table();
+}
 
-    if (!fat_bpb_valid(sector))
+static int fat_is_eoc(uint32_t value)
+{
+    return value >= (g_fs.fat32 ? FAT_EOC_32 : FAT_EOC_16);
+}
+
+// Follows the chain from `cluster` while the clusters are physically adjacent,
+// stopping once `max_clusters` are collected. `*next` receives the cluster that
+// follows the run so the caller can continue the walk from there.
+static int fat_chain_run(uint32_t cluster, uint32_t max_clusters, uint32_t* run_len, uint32_t* next)
+{
+    uint32_t len = 1;
+    uint32_t value = 0;
+    if (fat_read_entry(cluster, &value) != 0)
     {
-        if (sector[510] != 0x55 || sector[511] != 0xAA)
+        return -1;
+    }
+    while (len < max_clusters && value == (uint32_t)(cluster + len))
+    {
+        uint32_t following = 0;
+        if (fat_read_entry(value, &following) != 0)
         {
-            set_error("No boot sector");
             return -1;
         }
+        len++;
+        value = following;
+    }
+    *run_len = len;
+    *next = value;
+    return 0;
+}
 
-        uint32_t part_lba = 0;
-        for (int i = 0; i < 4; ++i)
+static void fat_map_forget(uint32_t first_cluster)
+{
+    for (uint32_t i = 0; i < FAT_MAP_SLOTS; ++i)
+    {
+        if (g_fat_maps[i].first_cluster == first_cluster)
         {
-            uint32_t entry = 446 + (uint32_t)i * 16;
-            uint8_t type = sector[entry + 4];
-            if (type == 0)
-            {
-                continue;
-            }
-            part_lba = le32(&sector[entry + 8]);
-            break;
+            g_fat_maps[i].first_cluster = 0;
+            g_fat_maps[i].stamp = 0;
         }
+    }
+}
 
-        if (part_lba == 0)
+// Appends the runs of the chain starting at `cluster` to the map until the
+// chain ends or every extent slot is used.
+static int fat_map_walk(struct fat_extent_map* map, uint32_t cluster)
+{
+    while (map->count < FAT_MAP_EXTENTS || map->extents[map->count - 1].cluster +
+           map->extents[map->count - 1].length == cluster)
+    {
+        if (cluster < 2 || fat_is_eoc(cluster))
         {
-            set_error("No FAT partition");
+            set_error("Corrupt cluster chain");
             return -1;
         }
-
-        g_fs.base_lba = part_lba;
-        if (fat_read_sector(0, sector) != 0)
+        uint32_t run = 0;
+        uint32_t next = 0;
+        if (fat_chain_run(cluster, g_fs.max_cluster, &run, &next) != 0)
         {
             return -1;
         }
-        if (!fat_bpb_valid(sector))
+
+        struct fat_extent* last = map->count > 0 ? &map->extents[map->count - 1] : 0;
+        if (last != 0 && last->cluster + last->length == cluster)
         {
-            set_error("Unsupported FAT format");
-            return -1;
+            last->length += run;
         }
-    }
+        else
+        {
+            struct fat_extent* e = &map->extents[map->count++];
+            e->index = map->clusters;
+            e->cluster = cluster;
+            e->length = run;
+        }
+        map->clusters += run;
 
-    g_fs.bytes_per_sector = le16(&sector[11]);
-    g_fs.sectors_per_cluster = sector[13];
-    g_fs.reserved_sectors = le16(&sector[14]);
-    g_fs.num_fats = sector[16];
-    g_fs.root_entries = le16(&sector[17]);
-    uint16_t total16 = le16(&sector[19]);
-    g_fs.sectors_per_fat = le16(&sector[22]);
-    uint32_t total32 = le32(&sector[32]);
-    g_fs.total_sectors = total16 != 0 ? total16 : total32;
+        if (fat_is_eoc(next))
+        {
+            map->complete = 1;
+            return 0;
+        }
+        cluster = next;
+    }
+    return 0;
+}
 
-    if (g_fs.bytes_per_sector != 512 || g_fs.sectors_per_fat == 0)
+// Returns the extent map of the chain starting at `first_cluster`, building
+// it with one walk over the chain if it is not cached.
+static struct fat_extent_map* fat_map_get(uint32_t first_cluster)
+{
+    struct fat_extent_map* victim = &g_fat_maps[0];
+    for (uint32_t i = 0; i < FAT_MAP_SLOTS; ++i)
     {
-        set_error("Unsupported FAT format");
-        return -1;
+        struct fat_extent_map* map = &g_fat_maps[i];
+        if (map->first_cluster == first_cluster)
+        {
+            map->stamp = ++g_fat_map_clock;
+            return map;
+        }
+        if (map->stamp < victim->stamp)
+        {
+            victim = map;
+        }
     }
 
-    g_fs.root_dir_sectors = (uint32_t)((g_fs.root_entries * 32 + g_fs.bytes_per_sector - 1) / g_fs.bytes_per_sector);
-    g_fs.root_dir_lba = g_fs.reserved_sectors + (uint32_t)g_fs.num_fats * g_fs.sectors_per_fat;
-    g_fs.data_lba = g_fs.root_dir_lba + g_fs.root_dir_sectors;
-
-    uint32_t data_sectors = g_fs.total_sectors - (g_fs.reserved_sectors + (uint32_t)g_fs.num_fats * g_fs.sectors_per_fat + g_fs.root_dir_sectors);
-    uint32_t cluster_count = data_sectors / g_fs.sectors_per_cluster;
-    if (cluster_count < 4085)
+    victim->first_cluster = first_cluster;
+    victim->clusters = 0;
+    victim->count = 0;
+    victim->complete = 0;
+    victim->stamp = ++g_fat_map_clock;
+    if (fat_map_walk(victim, first_cluster) != 0)
     {
-        set_error("FAT12 not supported");
-        return -1;
+        victim->first_cluster = 0;
+        victim->stamp = 0;
+        return 0;
     }
-    if (cluster_count >= 65525)
+    return victim;
+}
+
+// Binary search for the extent holding file cluster `index`, which must be
+// below map->clusters. `*run` receives the clusters left in that extent.
+static uint32_t fat_map_lookup(const struct fat_extent_map* map, uint32_t index, uint32_t* run)
+{
+    uint32_t lo = 0;
+    uint32_t hi = (uint32_t)map->count - 1;
+    while (lo < hi)
     {
-        set_error("FAT32 not supported");
-        return -1;
+        uint32_t mid = (lo + hi + 1) / 2;
+        if (map->extents[mid].index <= index)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
     }
+    const struct fat_extent* e = &map->extents[lo];
+    *run = e->length - (index - e->index);
+    return e->cluster + (index - e->index);
+}
 
-    g_fs.current_dir_cluster = 0;
-    g_cwd[0] = '/';
-    g_cwd[1] = '\0';
-    set_error("");
-    return 0;
+static uint32_t fat_readahead_limit(void)
+{
+    return BCACHE_PREFETCH_MAX / g_fs.sectors_per_cluster;
 }
 
-int fat_ls(void)
+// Called by chain readers just before they start on `cluster`. A reader that
+// arrives from the cluster it read last is sequential: when it reaches the
+// mark at the end of the previous window, the next window of clusters is
+// pulled into the buffer cache with multi-sector transfers. A reader that
+// jumps somewhere else starts a new stream and only gets its own cluster.
+static void fat_readahead(uint32_t cluster)
 {
-    uint8_t sector[512];
-    char name[16];
+    if (g_fs.dev == 0 || cluster < 2 || fat_is_eoc(cluster))
+    {
+        return;
+    }
 
-    if (g_fs.current_dir_cluster == 0)
+    int sequential = (cluster == g_fat_ra_next);
+    uint32_t next = 0;
+    if (fat_read_entry(cluster, &next) != 0)
     {
+        return;
+    }
+    g_fat_ra_next = next;
+
+    if (g_fat_ra_window == 0 || (sequential && cluster != g_fat_ra_mark))
+    {
+        return;
+    }
+
+    uint32_t clusters = sequential ? g_fat_ra_window : 1;
+    uint32_t current = cluster;
+    while (clusters > 0 && current >= 2 && !fat_is_eoc(current))
+    {
+        uint32_t run = 0;
+        uint32_t after = 0;
+        if (fat_chain_run(current, clusters, &run, &after) != 0)
+        {
+            return;
+        }
+        uint32_t lba = g_fs.base_lba + fat_cluster_to_lba(current);
+        if (bcache_prefetch(g_fs.dev, lba, run * g_fs.sectors_per_cluster) != 0)
+        {
+            return;
+        }
+        clusters -= run;
+        current = after;
+    }
+    g_fat_ra_mark = current;
+}
+
+// The fixed FAT16 root directory is one contiguous region; pull in as much
+// of it as the window allows on the first sector.
+static void fat_readahead_root(void)
+{
+    if (g_fs.dev == 0 || g_fat_ra_window == 0)
+    {
+        return;
+    }
+    uint32_t count = g_fat_ra_window * g_fs.sectors_per_cluster;
+    if (count > g_fs.root_dir_sectors)
+    {
+        count = g_fs.root_dir_sectors;
+    }
+    bcache_prefetch(g_fs.dev, g_fs.base_lba + g_fs.root_dir_lba, count);
+}
+
+void fat_set_readahead(uint32_t clusters)
+{
+    if (g_fs.sectors_per_cluster != 0 && clusters > fat_readahead_limit())
+    {
+        clusters = fat_readahead_limit();
+    }
+    g_fat_ra_window = clusters;
+}
+
+uint32_t fat_get_readahead(void)
+{
+    return g_fat_ra_window;
+}
+
+static int fat_read_dir_sector(uint32_t lba, uint8_t* sector)
+{
+    return fat_read_sector(lba, sector);
+}
+
+// Linear scan of a directory. Returns 0 when found, 1 when the name is
+// absent and -1 on a read error.
+static int fat_scan_dir(uint32_t dir_cluster, const char* target, uint8_t* entry_out, uint32_t* entry_lba, uint32_t* entry_offset)
+{
+    uint8_t sector[512];
+
+    if (dir_cluster == 0 && !g_fs.fat32)
+    {
+        fat_readahead_root();
         for (uint32_t s = 0; s < g_fs.root_dir_sectors; ++s)
         {
             uint32_t lba = g_fs.root_dir_lba + s;
@@ -694,12 +1258,13 @@ int fat_ls(void)
             {
                 return -1;
             }
+
             for (uint32_t i = 0; i < g_fs.bytes_per_sector; i += 32)
             {
                 uint8_t first = sector[i];
                 if (first == 0x00)
                 {
-                    return 0;
+                    return 1;
                 }
                 if (first == 0xE5)
                 {
@@ -710,31 +1275,37 @@ int fat_ls(void)
                 {
                     continue;
                 }
-                fat_format_name(&sector[i], name, sizeof(name));
-                if (attr & FAT_ATTR_DIRECTORY)
+
+                int match = 1;
+                for (int j = 0; j < 11; ++j)
                 {
-                    console_write("<DIR> ");
-                    console_write(name);
-                    console_putc('\n');
+                    if (sector[i + j] != (uint8_t)target[j])
+                    {
+                        match = 0;
+                        break;
+                    }
                 }
-                else
+                if (match)
                 {
-                    console_write("      ");
-                    console_write(name);
-                    console_putc('\n');
+                    mem_copy(entry_out, &sector[i], 32);
+                    *entry_lba = lba;
+                    *entry_offset = i;
+                    return 0;
                 }
             }
         }
-        return 0;
+        return 1;
     }
 
-    uint16_t cluster = g_fs.current_dir_cluster;
+    uint32_t cluster = fat_dir_start(dir_cluster);
     while (cluster >= 2 && !fat_is_eoc(cluster))
     {
+        fat_readahead(cluster);
         uint32_t base = fat_cluster_to_lba(cluster);
         for (uint8_t s = 0; s < g_fs.sectors_per_cluster; ++s)
         {
-            if (fat_read_dir_sector(base + s, sector) != 0)
+            uint32_t lba = base + s;
+            if (fat_read_dir_sector(lba, sector) != 0)
             {
                 return -1;
             }
@@ -743,7 +1314,7 @@ int fat_ls(void)
                 uint8_t first = sector[i];
                 if (first == 0x00)
                 {
-                    return 0;
+                    return 1;
                 }
                 if (first == 0xE5)
                 {
@@ -754,776 +1325,3334 @@ int fat_ls(void)
                 {
                     continue;
                 }
-                fat_format_name(&sector[i], name, sizeof(name));
-                if (attr & FAT_ATTR_DIRECTORY)
+
+                int match = 1;
+                for (int j = 0; j < 11; ++j)
                 {
-                    console_write("<DIR> ");
-                    console_write(name);
-                    console_putc('\n');
+                    if (sector[i + j] != (uint8_t)target[j])
+                    {
+                        match = 0;
+                        break;
+                    }
                 }
-                else
+                if (match)
                 {
-                    console_write("      ");
-                    console_write(name);
-                    console_putc('\n');
+                    mem_copy(entry_out, &sector[i], 32);
+                    *entry_lba = lba;
+                    *entry_offset = i;
+                    return 0;
                 }
             }
         }
-        uint8_t fat_sector[512];
-        uint16_t next = 0;
-        if (fat_read_entry(cluster, &next, fat_sector) != 0)
+
+        uint32_t next = 0;
+        if (fat_read_entry(cluster, &next) != 0)
         {
             return -1;
         }
         cluster = next;
     }
 
+    return 1;
+}
+
+// Lookups go through the dentry cache first. A cached location is checked
+// against the directory sector (normally a buffer cache hit) before it is
+// trusted, so an entry that changed underneath only costs a rescan.
+static int fat_find_entry_in_dir(uint32_t dir_cluster, const char* name, uint8_t* entry_out, uint32_t* entry_lba, uint32_t* entry_offset)
+{
+    char target[11];
+    if (fat_make_name(name, target) != 0)
+    {
+        set_error("Invalid name");
+        return -1;
+    }
+
+    uint32_t lba = 0;
+    uint32_t offset = 0;
+    int cached = dcache_lookup(dir_cluster, target, &lba, &offset);
+    if (cached == DCACHE_NEGATIVE)
+    {
+        return -1;
+    }
+    if (cached == DCACHE_FOUND)
+    {
+        uint8_t sector[512];
+        if (fat_read_dir_sector(lba, sector) != 0)
+        {
+            return -1;
+        }
+        int match = sector[offset] != 0x00 && sector[offset] != 0xE5;
+        for (int j = 0; match && j < 11; ++j)
+        {
+            match = sector[offset + j] == (uint8_t)target[j];
+        }
+        if (match)
+        {
+            mem_copy(entry_out, &sector[offset], 32);
+            *entry_lba = lba;
+            *entry_offset = offset;
+            return 0;
+        }
+        dcache_forget(dir_cluster, target);
+    }
+
+    int rc = fat_scan_dir(dir_cluster, target, entry_out, entry_lba, entry_offset);
+    if (rc == 0)
+    {
+        dcache_insert(dir_cluster, target, *entry_lba, *entry_offset);
+    }
+    else if (rc == 1)
+    {
+        dcache_insert_negative(dir_cluster, target);
+    }
+    return rc == 0 ? 0 : -1;
+}
+
+static void fat_path_invalidate(void)
+{
+    for (uint32_t i = 0; i < FAT_PATH_CACHE_SIZE; ++i)
+    {
+        g_fat_paths[i].valid = 0;
+    }
+}
+
+static void fat_path_remember(const char* path, size_t len, uint32_t cluster)
+{
+    struct fat_path_entry* slot = &g_fat_paths[0];
+    for (uint32_t i = 0; i < FAT_PATH_CACHE_SIZE; ++i)
+    {
+        struct fat_path_entry* e = &g_fat_paths[i];
+        if (!e->valid)
+        {
+            slot = e;
+            break;
+        }
+        if (e->stamp < slot->stamp)
+        {
+            slot = e;
+        }
+    }
+    str_copy_n(slot->path, path, len);
+    slot->path[len] = '\0';
+    slot->len = (uint32_t)len;
+    slot->cluster = cluster;
+    slot->stamp = ++g_fat_path_clock;
+    slot->valid = 1;
+}
+
+// Canonical absolute form of the first `len` bytes of `path`: relative
+// paths start at the working directory, "." and ".." are folded in, and
+// every component is rewritten as its on-disk 8.3 name so equal paths
+// compare equal as strings.
+static int fat_normalize_path(const char* path, size_t len, char* out)
+{
+    size_t out_len = 0;
+    if (len > 0 && path[0] == '/')
+    {
+        out[out_len++] = '/';
+    }
+    else
+    {
+        out_len = str_len(g_cwd);
+        str_copy_n(out, g_cwd, out_len);
+    }
+    out[out_len] = '\0';
+
+    size_t i = 0;
+    while (i < len)
+    {
+        while (i < len && path[i] == '/')
+        {
+            i++;
+        }
+        size_t start = i;
+        while (i < len && path[i] != '/')
+        {
+            i++;
+        }
+        size_t n = i - start;
+        if (n == 0 || (n == 1 && path[start] == '.'))
+        {
+            continue;
+        }
+        if (n == 2 && path[start] == '.' && path[start + 1] == '.')
+        {
+            while (out_len > 1 && out[out_len - 1] != '/')
+            {
+                out_len--;
+            }
+            if (out_len > 1)
+            {
+                out_len--;
+            }
+            out[out_len] = '\0';
+            continue;
+        }
+
+        char component[13];
+        char fat_name[11];
+        if (n >= sizeof(component))
+        {
+            set_error("Invalid name");
+            return -1;
+        }
+        str_copy_n(component, &path[start], n);
+        component[n] = '\0';
+        if (fat_make_name(component, fat_name) != 0)
+        {
+            set_error("Invalid name");
+            return -1;
+        }
+        fat_format_name((const uint8_t*)fat_name, component, sizeof(component));
+
+        size_t add = str_len(component);
+        if (out_len + add + 2 > FAT_PATH_MAX)
+        {
+            set_error("Path too long");
+            return -1;
+        }
+        if (out_len > 1)
+        {
+            out[out_len++] = '/';
+        }
+        str_copy_n(&out[out_len], component, add);
+        out_len += add;
+        out[out_len] = '\0';
+    }
+    return 0;
+}
+
+// Resolves a canonical absolute path to its directory cluster. The walk
+// starts from the longest prefix already in the path cache, so only the
+// components past it cost a directory lookup.
+static int fat_resolve_dir(const char* path, uint32_t* cluster_out)
+{
+    size_t len = str_len(path);
+    size_t pos = 1;
+    uint32_t cluster = 0;
+    struct fat_path_entry* best = 0;
+    for (uint32_t i = 0; i < FAT_PATH_CACHE_SIZE; ++i)
+    {
+        struct fat_path_entry* e = &g_fat_paths[i];
+        if (!e->valid || e->len > len || (best && e->len <= best->len))
+        {
+            continue;
+        }
+        if (path[e->len] != '\0' && path[e->len] != '/')
+        {
+            continue;
+        }
+        int match = 1;
+        for (uint32_t j = 0; j < e->len; ++j)
+        {
+            if (e->path[j] != path[j])
+            {
+                match = 0;
+                break;
+            }
+        }
+        if (match)
+        {
+            best = e;
+        }
+    }
+    if (best)
+    {
+        best->stamp = ++g_fat_path_clock;
+        cluster = best->cluster;
+        pos = best->len + 1;
+    }
+
+    while (pos < len)
+    {
+        size_t end = pos;
+        while (end < len && path[end] != '/')
+        {
+            end++;
+        }
+        char component[13];
+        str_copy_n(component, &path[pos], end - pos);
+        component[end - pos] = '\0';
+
+        uint8_t entry[32];
+        uint32_t lba = 0;
+        uint32_t offset = 0;
+        if (fat_find_entry_in_dir(cluster, component, entry, &lba, &offset) != 0)
+        {
+            set_error("Not found");
+            return -1;
+        }
+        if ((entry[11] & FAT_ATTR_DIRECTORY) == 0)
+        {
+            set_error("Not a directory");
+            return -1;
+        }
+        cluster = fat_entry_cluster(entry);
+        fat_path_remember(path, end, cluster);
+        pos = end + 1;
+    }
+
+    *cluster_out = cluster;
+    return 0;
+}
+
+// Splits `path` into its parent directory cluster and the final component,
+// which is returned as typed so callers can still reject "." and "..".
+static int fat_resolve_parent(const char* path, uint32_t* dir, char* leaf)
+{
+    if (path == 0 || path[0] == '\0')
+    {
+        set_error("Invalid name");
+        return -1;
+    }
+
+    size_t len = str_len(path);
+    while (len > 1 && path[len - 1] == '/')
+    {
+        len--;
+    }
+    size_t slash = len;
+    while (slash > 0 && path[slash - 1] != '/')
+    {
+        slash--;
+    }
+    if (len - slash == 0 || len - slash > 12)
+    {
+        set_error("Invalid name");
+        return -1;
+    }
+    str_copy_n(leaf, &path[slash], len - slash);
+    leaf[len - slash] = '\0';
+
+    if (slash == 0)
+    {
+        *dir = g_fs.current_dir_cluster;
+        return 0;
+    }
+
+    char parent[FAT_PATH_MAX];
+    if (fat_normalize_path(path, slash, parent) != 0)
+    {
+        return -1;
+    }
+    return fat_resolve_dir(parent, dir);
+}
+
+// Returns 1 if `path` lies on the tmpfs mount, with its canonical form in
+// `abs` and the part below the mount point in `*rel`; 0 if it belongs to
+// FAT; -1 if it is invalid.
+static int fat_tmpfs_path(const char* path, char* abs, const char** rel)
+{
+    if (g_tmpfs_mount_len == 0 || path == 0 || path[0] == '\0')
+    {
+        return 0;
+    }
+    if (fat_normalize_path(path, str_len(path), abs) != 0)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < g_tmpfs_mount_len; ++i)
+    {
+        if (abs[i] != g_tmpfs_mount[i])
+        {
+            return 0;
+        }
+    }
+    if (abs[g_tmpfs_mount_len] == '\0')
+    {
+        *rel = "/";
+        return 1;
+    }
+    if (abs[g_tmpfs_mount_len] != '/')
+    {
+        return 0;
+    }
+    *rel = &abs[g_tmpfs_mount_len];
+    return 1;
+}
+
+static int fat_tmpfs_result(int rc)
+{
+    if (rc != 0)
+    {
+        set_error(tmpfs_last_error());
+    }
+    return rc;
+}
+
+static int fat_find_free_dir_entry(uint32_t dir_cluster, uint32_t* entry_lba, uint32_t* entry_offset, uint8_t* sector)
+{
+    if (dir_cluster == 0 && !g_fs.fat32)
+    {
+        fat_readahead_root();
+        for (uint32_t s = 0; s < g_fs.root_dir_sectors; ++s)
+        {
+            uint32_t lba = g_fs.root_dir_lba + s;
+            if (fat_read_dir_sector(lba, sector) != 0)
+            {
+                return -1;
+            }
+            for (uint32_t i = 0; i < g_fs.bytes_per_sector; i += 32)
+            {
+                if (sector[i] == 0x00 || sector[i] == 0xE5)
+                {
+                    *entry_lba = lba;
+                    *entry_offset = i;
+                    return 0;
+                }
+            }
+        }
+        set_error("Root directory full");
+        return -1;
+    }
+
+    uint32_t cluster = fat_dir_start(dir_cluster);
+    while (cluster >= 2 && !fat_is_eoc(cluster))
+    {
+        fat_readahead(cluster);
+        uint32_t base = fat_cluster_to_lba(cluster);
+        for (uint8_t s = 0; s < g_fs.sectors_per_cluster; ++s)
+        {
+            uint32_t lba = base + s;
+            if (fat_read_dir_sector(lba, sector) != 0)
+            {
+                return -1;
+            }
+            for (uint32_t i = 0; i < g_fs.bytes_per_sector; i += 32)
+            {
+                if (sector[i] == 0x00 || sector[i] == 0xE5)
+                {
+                    *entry_lba = lba;
+                    *entry_offset = i;
+                    return 0;
+                }
+            }
+        }
+
+        uint32_t next = 0;
+        if (fat_read_entry(cluster, &next) != 0)
+        {
+            return -1;
+        }
+
+        if (fat_is_eoc(next))
+        {
+            uint32_t new_cluster = 0;
+            if (fat_find_free_cluster(&new_cluster) != 0)
+            {
+                return -1;
+            }
+            if (fat_write_entry(cluster, new_cluster) != 0)
+            {
+                return -1;
+            }
+            if (fat_write_entry(new_cluster, fat_eoc()) != 0)
+            {
+                return -1;
+            }
+
+            uint8_t zero[512];
+            mem_set(zero, 0, sizeof(zero));
+            uint32_t base_new = fat_cluster_to_lba(new_cluster);
+            for (uint8_t s = 0; s < g_fs.sectors_per_cluster; ++s)
+            {
+                if (fat_write_sector(base_new + s, zero) != 0)
+                {
+                    return -1;
+                }
+            }
+
+            if (fat_read_dir_sector(base_new, sector) != 0)
+            {
+                return -1;
+            }
+            *entry_lba = base_new;
+            *entry_offset = 0;
+            return 0;
+        }
+
+        cluster = next;
+    }
+
+    set_error("Directory full");
+    return -1;
+}
+
+static void fat_write_dir_entry(uint8_t* entry, const char name[11], uint8_t attr, uint32_t cluster, uint32_t size)
+{
+    for (int i = 0; i < 11; ++i)
+    {
+        entry[i] = (uint8_t)name[i];
+    }
+    entry[11] = attr;
+    for (int i = 12; i < 26; ++i)
+    {
+        entry[i] = 0;
+    }
+    fat_set_entry_cluster(entry, cluster);
+    entry[28] = (uint8_t)(size & 0xFF);
+    entry[29] = (uint8_t)((size >> 8) & 0xFF);
+    entry[30] = (uint8_t)((size >> 16) & 0xFF);
+    entry[31] = (uint8_t)((size >> 24) & 0xFF);
+}
+
+// Returns a chain to the free pool immediately. Only safe for clusters no
+// directory entry on disk can reference, such as a half-built allocation.
+static int fat_discard_chain(uint32_t cluster)
+{
+    if (cluster < 2)
+    {
+        return 0;
+    }
+    fat_map_forget(cluster);
+
+    while (cluster >= 2)
+    {
+        uint32_t next = 0;
+        if (fat_read_entry(cluster, &next) != 0)
+        {
+            return -1;
+        }
+        if (fat_write_entry(cluster, 0x0000) != 0)
+        {
+            return -1;
+        }
+        if (fat_is_eoc(next))
+        {
+            break;
+        }
+        cluster = next;
+    }
+
+    return 0;
+}
+
+static void fat_commit_frees(void)
+{
+    for (uint32_t i = 0; i < g_fat_pending_count; ++i)
+    {
+        uint32_t cluster = g_fat_pending[i];
+        for (uint32_t n = 0; cluster >= 2 && !fat_is_eoc(cluster) && n < g_fs.max_cluster; ++n)
+        {
+            uint32_t next = 0;
+            if (fat_read_entry(cluster, &next) != 0 || fat_write_entry(cluster, 0x0000) != 0)
+            {
+                break;
+            }
+            cluster = next;
+        }
+    }
+    g_fat_pending_count = 0;
+}
+
+// Writes the FAT and then every dirty directory block, after which no entry
+// on disk can point at a pending chain and the chains are freed.
+static int fat_commit(void)
+{
+    if (fat_flush_table() != 0)
+    {
+        return -1;
+    }
+    if (bcache_sync(g_fs.dev) != 0)
+    {
+        set_error("Disk write failed");
+        return -1;
+    }
+    fat_commit_frees();
+    return 0;
+}
+
+// Frees a chain that a directory entry may still point at on disk. The
+// chain is only recorded as pending: the FAT keeps its links and the
+// allocator cannot hand the clusters out until fat_sync has written the
+// directory change, so a crash never leaves an entry pointing at reused
+// clusters. Callers free a chain only once the entry no longer points at
+// it, so a full list can be committed before the new chain joins it.
+static int fat_free_chain(uint32_t cluster)
+{
+    if (cluster < 2 || fat_is_eoc(cluster))
+    {
+        return 0;
+    }
+    fat_map_forget(cluster);
+    for (uint32_t i = 0; i < g_fat_pending_count; ++i)
+    {
+        if (g_fat_pending[i] == cluster)
+        {
+            set_error("Corrupt cluster chain");
+            return -1;
+        }
+    }
+    if (g_fat_pending_count == FAT_PENDING_CHAINS && fat_commit() != 0)
+    {
+        return -1;
+    }
+    g_fat_pending[g_fat_pending_count++] = cluster;
+    return 0;
+}
+
+static int fat_mount(struct block_device* dev)
+{
+    uint8_t sector[512];
+    g_fs.dev = dev;
+    g_fs.base_lba = 0;
+    if (fat_read_sector(0, sector) != 0)
+    {
+        return -1;
+    }
+
+    if (!fat_bpb_valid(sector))
+    {
+        if (sector[510] != 0x55 || sector[511] != 0xAA)
+        {
+            set_error("No boot sector");
+            return -1;
+        }
+
+        uint32_t part_lba = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            uint32_t entry = 446 + (uint32_t)i * 16;
+            uint8_t type = sector[entry + 4];
+            if (type == 0)
+            {
+                continue;
+            }
+            part_lba = le32(&sector[entry + 8]);
+            break;
+        }
+
+        if (part_lba == 0)
+        {
+            set_error("No FAT partition");
+            return -1;
+        }
+
+        g_fs.base_lba = part_lba;
+        if (fat_read_sector(0, sector) != 0)
+        {
+            return -1;
+        }
+        if (!fat_bpb_valid(sector))
+        {
+            set_error("Unsupported FAT format");
+            return -1;
+        }
+    }
+
+    g_fs.bytes_per_sector = le16(&sector[11]);
+    g_fs.sectors_per_cluster = sector[13];
+    g_fs.reserved_sectors = le16(&sector[14]);
+    g_fs.num_fats = sector[16];
+    g_fs.root_entries = le16(&sector[17]);
+    uint16_t total16 = le16(&sector[19]);
+    g_fs.sectors_per_fat = le16(&sector[22]);
+    uint32_t total32 = le32(&sector[32]);
+    g_fs.total_sectors = total16 != 0 ? total16 : total32;
+    g_fs.fat32 = 0;
+    g_fs.active_fat = 0;
+    g_fs.mirrored = 1;
+    g_fs.root_cluster = 0;
+    g_fs.fsinfo_sector = 0;
+    g_fs.fsinfo_free = FSINFO_UNKNOWN;
+    g_fs.fsinfo_next = FSINFO_UNKNOWN;
+    if (g_fs.sectors_per_fat == 0)
+    {
+        g_fs.sectors_per_fat = le32(&sector[36]);
+        g_fs.root_cluster = le32(&sector[44]);
+        g_fs.fsinfo_sector = le16(&sector[48]);
+        // Bit 7 of the extended flags turns mirroring off; only the FAT
+        // named in bits 0-3 is then maintained.
+        uint16_t ext_flags = le16(&sector[40]);
+        if (ext_flags & 0x80)
+        {
+            g_fs.mirrored = 0;
+            g_fs.active_fat = (uint8_t)(ext_flags & 0x0F);
+        }
+    }
+
+    if (g_fs.bytes_per_sector != 512 || g_fs.sectors_per_fat == 0 || g_fs.active_fat >= g_fs.num_fats)
+    {
+        set_error("Unsupported FAT format");
+        return -1;
+    }
+
+    g_fs.root_dir_sectors = (uint32_t)((g_fs.root_entries * 32 + g_fs.bytes_per_sector - 1) / g_fs.bytes_per_sector);
+    g_fs.root_dir_lba = g_fs.reserved_sectors + (uint32_t)g_fs.num_fats * g_fs.sectors_per_fat;
+    g_fs.data_lba = g_fs.root_dir_lba + g_fs.root_dir_sectors;
+
+    uint32_t data_sectors = g_fs.total_sectors - (g_fs.reserved_sectors + (uint32_t)g_fs.num_fats * g_fs.sectors_per_fat + g_fs.root_dir_sectors);
+    uint32_t cluster_count = data_sectors / g_fs.sectors_per_cluster;
+    if (cluster_count < 4085)
+    {
+        set_error("FAT12 not supported");
+        return -1;
+    }
+    if (cluster_count >= FAT32_MIN_CLUSTERS)
+    {
+        if (g_fs.root_entries != 0 || g_fs.root_cluster < 2)
+        {
+            set_error("Unsupported FAT format");
+            return -1;
+        }
+        g_fs.fat32 = 1;
+    }
+    g_fs.entry_bytes = g_fs.fat32 ? 4 : 2;
+    g_fs.max_cluster = cluster_count + 2;
+    uint32_t per_sector = g_fs.bytes_per_sector / g_fs.entry_bytes;
+    if (g_fs.sectors_per_fat < (g_fs.max_cluster + per_sector - 1) / per_sector)
+    {
+        g_fs.max_cluster = g_fs.sectors_per_fat * per_sector;
+    }
+    if (g_fs.max_cluster > FAT_EOC_32 - 1 || (g_fs.fat32 && g_fs.root_cluster >= g_fs.max_cluster))
+    {
+        set_error("Unsupported FAT format");
+        return -1;
+    }
+
+    if (g_fs.fsinfo_sector != 0 && g_fs.fsinfo_sector < g_fs.reserved_sectors)
+    {
+        if (fat_read_sector(g_fs.fsinfo_sector, sector) != 0)
+        {
+            return -1;
+        }
+        if (le32(&sector[0]) == FSINFO_LEAD_SIG && le32(&sector[484]) == FSINFO_STRUCT_SIG)
+        {
+            g_fs.fsinfo_free = le32(&sector[488]);
+            g_fs.fsinfo_next = le32(&sector[492]);
+        }
+        else
+        {
+            g_fs.fsinfo_sector = 0;
+        }
+    }
+
+    mem_set(g_fat_window_state, 0, sizeof(g_fat_window_state));
+    g_fat_table_dirty = 0;
+    g_fat_pending_count = 0;
+    bcache_set_barrier(fat_writeback_barrier);
+    if (fat_init_free_space() != 0)
+    {
+        return -1;
+    }
+    dcache_invalidate();
+    fat_path_invalidate();
+    mem_set((uint8_t*)g_fat_maps, 0, sizeof(g_fat_maps));
+    mem_set((uint8_t*)g_fat_delalloc, 0, sizeof(g_fat_delalloc));
+
+    g_fs.current_dir_cluster = 0;
+    g_cwd[0] = '/';
+    g_cwd[1] = '\0';
+    g_fat_ra_next = 0;
+    g_fat_ra_mark = 0;
+    fat_set_readahead(g_fat_ra_window);
+    set_error("");
+    return 0;
+}
+
+int fat_init(void)
+{
+    g_fs.dev = 0;
+    int count = block_device_count();
+    if (count == 0)
+    {
+        set_error("No disk device");
+        return -1;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (fat_mount(block_device_at(i)) == 0)
+        {
+            return 0;
+        }
+    }
+    g_fs.dev = 0;
+    return -1;
+}
+
+// Mounts the RAM filesystem over `path`. The directory is created on the
+// FAT volume if needed so it shows up in listings of its parent.
+int fat_mount_tmpfs(const char* path)
+{
+    char abs[FAT_PATH_MAX];
+    g_tmpfs_mount_len = 0;
+    if (path == 0 || path[0] == '\0' || fat_normalize_path(path, str_len(path), abs) != 0)
+    {
+        set_error("Invalid mount point");
+        return -1;
+    }
+    if (abs[1] == '\0')
+    {
+        set_error("Invalid mount point");
+        return -1;
+    }
+    uint32_t cluster = 0;
+    if (g_fs.dev != 0 && fat_resolve_dir(abs, &cluster) != 0 && fat_mkdir(abs) != 0)
+    {
+        return -1;
+    }
+
+    tmpfs_init();
+    str_copy_n(g_tmpfs_mount, abs, str_len(abs) + 1);
+    g_tmpfs_mount_len = str_len(abs);
+    return 0;
+}
+
+static int fat_open_in(uint32_t dir, const char* name, int flags);
+
+// Returns 1 when a handle other than `self` has the entry at `lba`/`offset`
+// open; its chain must not be freed or cut underneath it.
+static int fat_entry_open(uint32_t lba, uint32_t offset, const struct fat_handle* self)
+{
+    for (uint32_t i = 0; i < FAT_MAX_HANDLES; ++i)
+    {
+        const struct fat_handle* h = &g_fat_handles[i];
+        if (h != self && h->used && h->entry_lba == lba && h->entry_offset == offset)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int fat_name_open(uint32_t dir, const char* name)
+{
+    uint8_t entry[32];
+    uint32_t lba = 0;
+    uint32_t offset = 0;
+    return fat_find_entry_in_dir(dir, name, entry, &lba, &offset) == 0 && fat_entry_open(lba, offset, 0);
+}
+
+static struct fat_delalloc* fat_delalloc_find(uint32_t dir, const char fat_name[11])
+{
+    for (uint32_t i = 0; i < FAT_DELALLOC_SLOTS; ++i)
+    {
+        struct fat_delalloc* d = &g_fat_delalloc[i];
+        int match = d->used && d->dir == dir;
+        for (int j = 0; match && j < 11; ++j)
+        {
+            match = d->fat_name[j] == fat_name[j];
+        }
+        if (match)
+        {
+            return d;
+        }
+    }
+    return 0;
+}
+
+// Gives the pending data its clusters: one reservation covers the whole
+// tail, so the allocator can hand out a single extent for it.
+static int fat_delalloc_flush(struct fat_delalloc* d)
+{
+    d->used = 0;
+    int fd = fat_open_in(d->dir, d->name, FAT_O_WRITE);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int rc = 0;
+    if (d->len > 0)
+    {
+        rc = fat_write_at(fd, d->keep, d->data, d->len);
+    }
+    // Only a shorter rewrite cuts the chain; appends keep any clusters
+    // reserved past the end by fat_fallocate.
+    if (rc == 0 && fat_size(fd) > d->keep + d->len)
+    {
+        rc = fat_truncate(fd, d->keep + d->len);
+    }
+    if (fat_close(fd) != 0)
+    {
+        rc = -1;
+    }
+    return rc;
+}
+
+// Brings the disk copy of `name` up to date before something reads it or
+// opens it directly. `discard` drops the pending data instead, for callers
+// about to throw the contents away.
+static int fat_delalloc_settle(uint32_t dir, const char* name, int discard)
+{
+    char fat_name[11];
+    if (fat_make_name(name, fat_name) != 0)
+    {
+        return 0;
+    }
+    struct fat_delalloc* d = fat_delalloc_find(dir, fat_name);
+    if (d == 0)
+    {
+        return 0;
+    }
+    if (discard)
+    {
+        d->used = 0;
+        return 0;
+    }
+    return fat_delalloc_flush(d);
+}
+
+// Returns an unused slot for `name`, flushing the oldest one if all are
+// taken.
+static struct fat_delalloc* fat_delalloc_take(uint32_t dir, const char* name)
+{
+    struct fat_delalloc* d = 0;
+    for (uint32_t i = 0; i < FAT_DELALLOC_SLOTS && d == 0; ++i)
+    {
+        if (!g_fat_delalloc[i].used)
+        {
+            d = &g_fat_delalloc[i];
+        }
+    }
+    if (d == 0)
+    {
+        d = &g_fat_delalloc[g_fat_delalloc_victim];
+        g_fat_delalloc_victim = (g_fat_delalloc_victim + 1) % FAT_DELALLOC_SLOTS;
+        if (fat_delalloc_flush(d) != 0)
+        {
+            return 0;
+        }
+    }
+
+    if (fat_make_name(name, d->fat_name) != 0)
+    {
+        set_error("Invalid name");
+        return 0;
+    }
+    str_copy_n(d->name, name, sizeof(d->name));
+    d->dir = dir;
+    d->keep = 0;
+    d->len = 0;
+    d->used = 1;
+    return d;
+}
+
+// Flushes every slot. A slot that fails is dropped rather than retried, so
+// one full disk cannot wedge every later sync.
+static int fat_delalloc_flush_all(void)
+{
+    int rc = 0;
+    for (uint32_t i = 0; i < FAT_DELALLOC_SLOTS; ++i)
+    {
+        if (g_fat_delalloc[i].used && fat_delalloc_flush(&g_fat_delalloc[i]) != 0)
+        {
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+// FSInfo only carries hints, so it is written last and only when the
+// free count or allocation cursor moved since it was read or written.
+static int fat_update_fsinfo(void)
+{
+    if (!g_fs.fat32 || g_fs.fsinfo_sector == 0)
+    {
+        return 0;
+    }
+    if (g_fs.fsinfo_free == g_fat_free_count && g_fs.fsinfo_next == g_fat_next_free)
+    {
+        return 0;
+    }
+
+    uint8_t sector[512];
+    if (fat_read_sector(g_fs.fsinfo_sector, sector) != 0)
+    {
+        return -1;
+    }
+    uint32_t values[2] = { g_fat_free_count, g_fat_next_free };
+    for (int v = 0; v < 2; ++v)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            sector[488 + v * 4 + i] = (uint8_t)(values[v] >> (i * 8));
+        }
+    }
+    if (fat_write_sector(g_fs.fsinfo_sector, sector) != 0 || bcache_sync(g_fs.dev) != 0)
+    {
+        set_error("Disk write failed");
+        return -1;
+    }
+    g_fs.fsinfo_free = g_fat_free_count;
+    g_fs.fsinfo_next = g_fat_next_free;
+    return 0;
+}
+
+int fat_sync(void)
+{
+    if (g_fs.dev == 0)
+    {
+        return 0;
+    }
+    int rc = fat_delalloc_flush_all();
+    // New links reach the FAT before any directory entry that points at
+    // them (bcache also flushes the FAT before an early write-back), and
+    // freed clusters are released only after the entries that referenced
+    // them are gone. A crash between the steps leaks clusters at worst; it
+    // never cross-links two files.
+    if (fat_commit() != 0 || fat_flush_table() != 0)
+    {
+        return -1;
+    }
+    if (fat_update_fsinfo() != 0)
+    {
+        return -1;
+    }
+    return rc;
+}
+
+static int fat_tmpfs_cat(const char* rel)
+{
+    int fd = tmpfs_open(rel, FAT_O_READ);
+    if (fd < 0)
+    {
+        return fat_tmpfs_result(-1);
+    }
+    uint32_t offset = 0;
+    size_t got = 0;
+    do
+    {
+        if (tmpfs_read_at(fd, offset, g_fat_copy_buffer, sizeof(g_fat_copy_buffer), &got) != 0)
+        {
+            tmpfs_close(fd);
+            return fat_tmpfs_result(-1);
+        }
+        for (size_t i = 0; i < got; ++i)
+        {
+            console_putc((char)g_fat_copy_buffer[i]);
+        }
+        offset += (uint32_t)got;
+    } while (got > 0);
+    tmpfs_close(fd);
+    console_putc('\n');
+    return 0;
+}
+
+static int fat_tmpfs_read(const char* rel, char* out, size_t max, size_t* out_size)
+{
+    int fd = tmpfs_open(rel, FAT_O_READ);
+    if (fd < 0)
+    {
+        return fat_tmpfs_result(-1);
+    }
+    uint32_t size = tmpfs_size(fd);
+    size_t got = 0;
+    int rc = 0;
+    if ((size_t)size + 1 > max)
+    {
+        set_error("Buffer too small");
+        rc = -1;
+    }
+    else if (tmpfs_read_at(fd, 0, out, size, &got) != 0)
+    {
+        rc = fat_tmpfs_result(-1);
+    }
+    else
+    {
+        out[got] = '\0';
+        if (out_size)
+        {
+            *out_size = got;
+        }
+    }
+    tmpfs_close(fd);
+    return rc;
+}
+
+// Writes through a tmpfs handle; FAT_TMPFS_END as `offset` appends.
+static int fat_tmpfs_write(const char* rel, int flags, uint32_t offset, const char* data, size_t len)
+{
+    int fd = tmpfs_open(rel, FAT_O_WRITE | FAT_O_CREATE | flags);
+    if (fd < 0)
+    {
+        return fat_tmpfs_result(-1);
+    }
+    if (offset == FAT_TMPFS_END)
+    {
+        offset = tmpfs_size(fd);
+    }
+    int rc = tmpfs_write_at(fd, offset, data, len);
+    tmpfs_close(fd);
+    return fat_tmpfs_result(rc);
+}
+
+int fat_ls(void)
+{
+    char abs[FAT_PATH_MAX];
+    const char* rel = 0;
+    if (fat_tmpfs_path(g_cwd, abs, &rel) > 0)
+    {
+        return fat_tmpfs_result(tmpfs_ls(rel));
+    }
+
+    uint8_t sector[512];
+    char name[16];
+
+    if (g_fs.current_dir_cluster == 0 && !g_fs.fat32)
+    {
+        fat_readahead_root();
+        for (uint32_t s = 0; s < g_fs.root_dir_sectors; ++s)
+        {
+            uint32_t lba = g_fs.root_dir_lba + s;
+            if (fat_read_dir_sector(lba, sector) != 0)
+            {
+                return -1;
+            }
+            for (uint32_t i = 0; i < g_fs.bytes_per_sector; i += 32)
+            {
+                uint8_t first = sector[i];
+                if (first == 0x00)
+                {
+                    return 0;
+                }
+                if (first == 0xE5)
+                {
+                    continue;
+                }
+                uint8_t attr = sector[i + 11];
+                if (attr == FAT_ATTR_LFN || attr == FAT_ATTR_VOLUME_ID)
+                {
+                    continue;
+                }
+                fat_format_name(&sector[i], name, sizeof(name));
+                if (attr & FAT_ATTR_DIRECTORY)
+                {
+                    console_write("<DIR> ");
+                    console_write(name);
+                    console_putc('\n');
+                }
+                else
+                {
+                    console_write("      ");
+                    console_write(name);
+                    console_putc('\n');
+                }
+            }
+        }
+        return 0;
+    }
+
+    uint32_t cluster = fat_dir_start(g_fs.current_dir_cluster);
+    while (cluster >= 2 && !fat_is_eoc(cluster))
+    {
+        fat_readahead(cluster);
+        uint32_t base = fat_cluster_to_lba(cluster);
+        for (uint8_t s = 0; s < g_fs.sectors_per_cluster; ++s)
+        {
+            if (fat_read_dir_sector(base + s, sector) != 0)
+            {
+                return -1;
+            }
+            for (uint32_t i = 0; i < g_fs.bytes_per_sector; i += 32)
+            {
+                uint8_t first = sector[i];
+                if (first == 0x00)
+                {
+                    return 0;
+                }
+                if (first == 0xE5)
+                {
+                    continue;
+                }
+                uint8_t attr = sector[i + 11];
+                if (attr == FAT_ATTR_LFN || attr == FAT_ATTR_VOLUME_ID)
+                {
+                    continue;
+                }
+                fat_format_name(&sector[i], name, sizeof(name));
+                if (attr & FAT_ATTR_DIRECTORY)
+                {
+                    console_write("<DIR> ");
+                    console_write(name);
+                    console_putc('\n');
+                }
+                else
+                {
+                    console_write("      ");
+                    console_write(name);
+                    console_putc('\n');
+                }
+            }
+        }
+        uint32_t next = 0;
+        if (fat_read_entry(cluster, &next) != 0)
+        {
+            return -1;
+        }
+        cluster = next;
+    }
+
+    return 0;
+}
+
+int fat_cd(const char* path)
+{
+    if (path == 0 || path[0] == '\0')
+    {
+        return 0;
+    }
+
+    char target[FAT_PATH_MAX];
+    const char* rel = 0;
+    int where = fat_tmpfs_path(path, target, &rel);
+    if (where < 0)
+    {
+        return -1;
+    }
+    if (where > 0)
+    {
+        if (!tmpfs_is_dir(rel))
+        {
+            return fat_tmpfs_result(-1);
+        }
+    }
+    else
+    {
+        uint32_t cluster = 0;
+        if (fat_normalize_path(path, str_len(path), target) != 0 || fat_resolve_dir(target, &cluster) != 0)
+        {
+            return -1;
+        }
+        g_fs.current_dir_cluster = cluster;
+    }
+
+    str_copy_n(g_cwd, target, str_len(target) + 1);
+    return 0;
+}
+
+const char* fat_pwd(void)
+{
+    return g_cwd;
+}
+
+int fat_mkdir(const char* path)
+{
+    char abs[FAT_PATH_MAX];
+    const char* rel = 0;
+    int where = fat_tmpfs_path(path, abs, &rel);
+    if (where != 0)
+    {
+        return where < 0 ? -1 : fat_tmpfs_result(tmpfs_mkdir(rel));
+    }
+
+    static uint8_t temp_sector[512];
+
+    uint32_t dir = 0;
+    char name[13];
+    if (fat_resolve_parent(path, &dir, name) != 0)
+    {
+        return -1;
+    }
+    
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+    {
+        set_error("Invalid name");
+        return -1;
+    }
+    uint8_t entry[32];
+    uint32_t lba = 0;
+    uint32_t offset = 0;
+    if (fat_find_entry_in_dir(dir, name, entry, &lba, &offset) == 0)
+    {
+        set_error("Already exists");
+        return -1;
+    }
+
+    uint8_t sector[512];
+    if (fat_find_free_dir_entry(dir, &lba, &offset, sector) != 0)
+    {
+        return -1;
+    }
+
+    uint32_t new_cluster = 0;
+    if (fat_find_free_cluster(&new_cluster) != 0)
+    {
+        return -1;
+    }
+    if (fat_write_entry(new_cluster, fat_eoc()) != 0)
+    {
+        return -1;
+    }
+
+    char fat_name[11];
+    if (fat_make_name(name, fat_name) != 0)
+    {
+        set_error("Invalid name");
+        return -1;
+    }
+
+    fat_write_dir_entry(&sector[offset], fat_name, FAT_ATTR_DIRECTORY, new_cluster, 0);
+    if (fat_write_sector(lba, sector) != 0)
+    {
+        return -1;
+    }
+    dcache_insert(dir, fat_name, lba, offset);
+
+    uint32_t base = fat_cluster_to_lba(new_cluster);
+    
+    mem_set((uint8_t*)fat_name, ' ', 11);
+    fat_name[0] = '.';
+    fat_write_dir_entry(temp_sector, fat_name, FAT_ATTR_DIRECTORY, new_cluster, 0);
+
+    mem_set((uint8_t*)entry, ' ', 11);
+    entry[0] = '.';
+    entry[1] = '.';
+    fat_write_dir_entry(&temp_sector[32], (const char*)entry, FAT_ATTR_DIRECTORY, dir, 0);
+
+    if (fat_write_sector(base, temp_sector) != 0)
+    {
+        return -1;
+    }
+    // The rest of the cluster must read as unused entries, not old data
+    for (uint32_t s = 1; s < g_fs.sectors_per_cluster; ++s)
+    {
+        if (fat_write_sector(base + s, g_fat_zero_sector) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int fat_touch(const char* path)
+{
+    char abs[FAT_PATH_MAX];
+    const char* rel = 0;
+    int where = fat_tmpfs_path(path, abs, &rel);
+    if (where != 0)
+    {
+        return where < 0 ? -1 : fat_tmpfs_result(tmpfs_touch(rel));
+    }
+
+    uint32_t dir = 0;
+    char name[13];
+    if (fat_resolve_parent(path, &dir, name) != 0)
+    {
+        return -1;
+    }
+
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+    {
+        set_error("Invalid name");
+        return -1;
+    }
+    uint8_t entry[32];
+    uint32_t lba = 0;
+    uint32_t offset = 0;
+    if (fat_find_entry_in_dir(dir, name, entry, &lba, &offset) == 0)
+    {
+        set_error("Already exists");
+        return -1;
+    }
+
+    uint8_t sector[512];
+    if (fat_find_free_dir_entry(dir, &lba, &offset, sector) != 0)
+    {
+        return -1;
+    }
+
+    char fat_name[11];
+    if (fat_make_name(name, fat_name) != 0)
+    {
+        set_error("Invalid name");
+        return -1;
+    }
+
+    fat_write_dir_entry(&sector[offset], fat_name, 0x20, 0, 0);
+    if (fat_write_sector(lba, sector) != 0)
+    {
+        return -1;
+    }
+    dcache_insert(dir, fat_name, lba, offset);
+
+    return 0;
+}
+
+int fat_cat(const char* path)
+{
+    char abs[FAT_PATH_MAX];
+    const char* rel = 0;
+    int where = fat_tmpfs_path(path, abs, &rel);
+    if (where != 0)
+    {
+        return where < 0 ? -1 : fat_tmpfs_cat(rel);
+    }
+
+    uint32_t dir = 0;
+    char name[13];
+    if (fat_resolve_parent(path, &dir, name) != 0)
+    {
+        return -1;
+    }
+    if (fat_delalloc_settle(dir, name, 0) != 0)
+    {
+        return -1;
+    }
+
+    uint8_t entry[32];
+    uint32_t lba = 0;
+    uint32_t offset = 0;
+    if (fat_find_entry_in_dir(dir, name, entry, &lba, &offset) != 0)
+    {
+        set_error("Not found");
+        return -1;
+    }
+
+    if (entry[11] & FAT_ATTR_DIRECTORY)
+    {
+        set_error("Is a directory");
+        return -1;
+    }
+
+    uint32_t size = le32(&entry[28]);
+    uint32_t cluster = fat_entry_cluster(entry);
+
+    if (size == 0 || cluster == 0)
+    {
+        console_putc('\n');
+        return 0;
+    }
+
+    static uint8_t buffer[FAT_IO_CHUNK_SECTORS * 512];
+    uint32_t remaining = size;
+
+    // Walk the chain a cluster at a time; read-ahead keeps the upcoming
+    // clusters in the buffer cache so the chunk reads below are served from it.
+    while (cluster >= 2 && !fat_is_eoc(cluster) && remaining > 0)
+    {
+        fat_readahead(cluster);
+
+        uint32_t lba = fat_cluster_to_lba(cluster);
+        uint32_t sectors = g_fs.sectors_per_cluster;
+        while (sectors > 0 && remaining > 0)
+        {
+            uint32_t n = sectors > FAT_IO_CHUNK_SECTORS ? FAT_IO_CHUNK_SECTORS : sectors;
+            if (fat_read_sectors(lba, n, buffer) != 0)
+            {
+                return -1;
+            }
+            uint32_t bytes = n * g_fs.bytes_per_sector;
+            if (bytes > remaining)
+            {
+                bytes = remaining;
+            }
+            for (uint32_t i = 0; i < bytes; ++i)
+            {
+                console_putc((char)buffer[i]);
+            }
+            remaining -= bytes;
+            lba += n;
+            sectors -= n;
+        }
+
+        uint32_t next = 0;
+        if (fat_read_entry(cluster, &next) != 0)
+        {
+            return -1;
+        }
+        cluster = next;
+    }
+
+    console_putc('\n');
+    return 0;
+}
+
+int fat_read(const char* path, char* out, size_t max, size_t* out_size)
+{
+    char abs[FAT_PATH_MAX];
+    const char* rel = 0;
+    int where = fat_tmpfs_path(path, abs, &rel);
+    if (where != 0)
+    {
+        return where < 0 ? -1 : fat_tmpfs_read(rel, out, max, out_size);
+    }
+
+    uint32_t dir = 0;
+    char name[13];
+    if (fat_resolve_parent(path, &dir, name) != 0)
+    {
+        return -1;
+    }
+    if (fat_delalloc_settle(dir, name, 0) != 0)
+    {
+        return -1;
+    }
+
+    if (out_size)
+    {
+        *out_size = 0;
+    }
+
+    uint8_t entry[32];
+    uint32_t lba = 0;
+    uint32_t offset = 0;
+    if (fat_find_entry_in_dir(dir, name, entry, &lba, &offset) != 0)
+    {
+        set_error("Not found");
+        return -1;
+    }
+
+    if (entry[11] & FAT_ATTR_DIRECTORY)
+    {
+        set_error("Is a directory");
+        return -1;
+    }
+
+    uint32_t size = le32(&entry[28]);
+    uint32_t cluster = fat_entry_cluster(entry);
+
+    if (size == 0 || cluster == 0)
+    {
+        if (out && max > 0)
+        {
+            out[0] = '\0';
+        }
+        if (out_size)
+        {
+            *out_size = 0;
+        }
+        return 0;
+    }
+
+    if (size + 1 > max)
+    {
+        set_error("Buffer too small");
+        return -1;
+    }
+
+    uint8_t sector[512];
+    uint32_t cluster_size = (uint32_t)g_fs.bytes_per_sector * g_fs.sectors_per_cluster;
+    uint32_t remaining = size;
+    size_t written = 0;
+    size_t tail_pos = 0;
+    uint32_t tail_len = 0;
+
+    fat_plug();
+    while (cluster >= 2 && !fat_is_eoc(cluster) && remaining > 0)
+    {
+        uint32_t run = 0;
+        uint32_t next = 0;
+        if (fat_chain_run(cluster, (remaining + cluster_size - 1) / cluster_size, &run, &next) != 0)
+        {
+            fat_unplug(0);
+            return -1;
+        }
+
+        uint32_t lba = fat_cluster_to_lba(cluster);
+        uint32_t bytes = run * cluster_size;
+        if (bytes > remaining)
+        {
+            bytes = remaining;
+        }
+
+        uint32_t full = bytes / g_fs.bytes_per_sector;
+        if (fat_queue_sectors(0, lba, full, (uint8_t*)&out[written]) != 0)
+        {
+            fat_unplug(0);
+            return -1;
+        }
+        written += (size_t)full * g_fs.bytes_per_sector;
+
+        // Only the last run of the file can end mid-sector
+        uint32_t tail = bytes % g_fs.bytes_per_sector;
+        if (tail > 0)
+        {
+            if (fat_queue_sectors(0, lba + full, 1, sector) != 0)
+            {
+                fat_unplug(0);
+                return -1;
+            }
+            tail_pos = written;
+            tail_len = tail;
+            written += tail;
+        }
+
+        remaining -= bytes;
+        cluster = next;
+    }
+    if (fat_unplug(0) != 0)
+    {
+        return -1;
+    }
+    if (tail_len > 0)
+    {
+        mem_copy((uint8_t*)&out[tail_pos], sector, tail_len);
+    }
+
+    out[written] = '\0';
+    if (out_size)
+    {
+        *out_size = written;
+    }
+    return 0;
+}
+
+static void fat_df_line(const char* label, uint32_t clusters)
+{
+    char buf[32];
+    console_write(label);
+    uint32_to_str(clusters * g_fs.sectors_per_cluster / (1024 / g_fs.bytes_per_sector), buf, sizeof(buf));
+    console_write(buf);
+    console_write(" KB\n");
+}
+
+int fat_df(void)
+{
+    uint32_t total_clusters = g_fs.max_cluster - 2;
+    uint32_t free_clusters = g_fat_free_count;
+    uint32_t used_clusters = total_clusters - free_clusters;
+
+    console_write("Disk usage:\n");
+    fat_df_line("Total: ", total_clusters);
+    fat_df_line("Used:  ", used_clusters);
+    fat_df_line("Free:  ", free_clusters);
+    fat_df_line("Largest free extent: ", fat_largest_free_extent());
+
+    if (g_tmpfs_mount_len > 0)
+    {
+        char buf[16];
+        uint32_t used = 0;
+        uint32_t total = 0;
+        tmpfs_usage(&used, &total);
+        console_write("tmpfs on ");
+        console_write(g_tmpfs_mount);
+        console_write(": ");
+        uint32_to_str(used * (TMPFS_PAGE_SIZE / 1024), buf, sizeof(buf));
+        console_write(buf);
+        console_write(" of ");
+        uint32_to_str(total * (TMPFS_PAGE_SIZE / 1024), buf, sizeof(buf));
+        console_write(buf);
+        console_write(" KB used\n");
+    }
+    return 0;
+}
+
+// Recounts the first FAT copy as stored on disk and compares it with the
+// in-memory counters. The table is flushed first so both describe the same
+// state.
+int fat_df_verify(void)
+{
+    if (g_fs.dev == 0)
+    {
+        set_error("No disk device");
+        return -1;
+    }
+    if (fat_flush_table() != 0)
+    {
+        return -1;
+    }
+
+    static uint8_t chunk[FAT_IO_CHUNK_SECTORS * 512];
+    uint32_t free_clusters = 0;
+    uint32_t largest = 0;
+    uint32_t run = 0;
+    uint32_t stale_sectors = 0;
+    uint32_t per_sector = g_fs.bytes_per_sector / g_fs.entry_bytes;
+    for (uint32_t s = 0; s < g_fs.sectors_per_fat; s += FAT_IO_CHUNK_SECTORS)
+    {
+        uint32_t count = g_fs.sectors_per_fat - s;
+        if (count > FAT_IO_CHUNK_SECTORS)
+        {
+            count = FAT_IO_CHUNK_SECTORS;
+        }
+        uint32_t fat_lba = g_fs.reserved_sectors + (uint32_t)g_fs.active_fat * g_fs.sectors_per_fat;
+        if (fat_read_sectors(fat_lba + s, count, chunk) != 0)
+        {
+            return -1;
+        }
+
+        // Sectors resident in the window must match the disk after a flush
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            uint32_t slot = (s + i) % FAT_WINDOW_SECTORS;
+            if (!(g_fat_window_state[slot] & FAT_SLOT_VALID) || g_fat_window_sector[slot] != s + i)
+            {
+                continue;
+            }
+            for (uint32_t b = 0; b < g_fs.bytes_per_sector; ++b)
+            {
+                if (chunk[i * g_fs.bytes_per_sector + b] != g_fat_window[slot * 512 + b])
+                {
+                    stale_sectors++;
+                    break;
+                }
+            }
+        }
+
+        for (uint32_t e = 0; e < count * per_sector; ++e)
+        {
+            uint32_t cluster = s * per_sector + e;
+            if (cluster < 2 || cluster >= g_fs.max_cluster)
+            {
+                continue;
+            }
+            uint32_t value = g_fs.fat32 ? (le32(&chunk[e * 4]) & FAT32_MASK) : le16(&chunk[e * 2]);
+            if (value == 0x0000)
+            {
+                free_clusters++;
+                run++;
+                if (run > largest)
+                {
+                    largest = run;
+                }
+            }
+            else
+            {
+                run = 0;
+            }
+        }
+    }
+
+    char buf[32];
+    console_write("On-disk FAT: ");
+    uint32_to_str(free_clusters, buf, sizeof(buf));
+    console_write(buf);
+    console_write(" free, largest extent ");
+    uint32_to_str(largest, buf, sizeof(buf));
+    console_write(buf);
+    console_write(" clusters\n");
+
+    uint32_t cached_largest = fat_largest_free_extent();
+    if (free_clusters != g_fat_free_count || largest != cached_largest || stale_sectors != 0)
+    {
+        console_write("Counters: ");
+        uint32_to_str(g_fat_free_count, buf, sizeof(buf));
+        console_write(buf);
+        console_write(" free, largest extent ");
+        uint32_to_str(cached_largest, buf, sizeof(buf));
+        console_write(buf);
+        console_write(", ");
+        uint32_to_str(stale_sectors, buf, sizeof(buf));
+        console_write(buf);
+        console_write(" FAT sectors differ\n");
+        set_error("Usage counters do not match the disk");
+        return -1;
+    }
+    console_write("Counters match\n");
+    return 0;
+}
+
+// Counts the clusters and the contiguous extents of a chain.
+static int fat_chain_extents(uint32_t first, uint32_t* clusters, uint32_t* extents)
+{
+    uint32_t total = 0;
+    uint32_t count = 0;
+    uint32_t cluster = first;
+    while (!fat_is_eoc(cluster))
+    {
+        uint32_t run = 0;
+        uint32_t next = 0;
+        if (cluster < 2 || fat_chain_run(cluster, g_fs.max_cluster, &run, &next) != 0)
+        {
+            set_error("Corrupt cluster chain");
+            return -1;
+        }
+        total += run;
+        count++;
+        if (total > g_fs.max_cluster)
+        {
+            set_error("Corrupt cluster chain");
+            return -1;
+        }
+        cluster = next;
+    }
+    *clusters = total;
+    *extents = count;
+    return 0;
+}
+
+// Copies a chain into one free extent and links the new clusters. Returns 1
+// without touching anything if no extent is long enough. The old clusters
+// go through the deferred-free list, so they stay intact until the entry
+// pointing at the copy has been synced.
+static int fat_relocate_chain(uint32_t first, uint32_t clusters, uint32_t* moved_to)
+{
+    uint32_t start = 0;
+    uint32_t len = 0;
+    if (fat_find_free_extent(clusters, &start, &len) != 0 || len < clusters)
+    {
+        return 1;
+    }
+    for (uint32_t i = 0; i < clusters; ++i)
+    {
+        fat_write_entry(start + i, i + 1 < clusters ? start + i + 1 : fat_eoc());
+    }
+    g_fat_next_free = start + clusters;
+
+    uint32_t spc = g_fs.sectors_per_cluster;
+    uint32_t dst = start;
+    uint32_t cluster = first;
+    while (cluster >= 2 && !fat_is_eoc(cluster))
+    {
+        uint32_t run = 0;
+        uint32_t next = 0;
+        if (fat_chain_run(cluster, clusters, &run, &next) != 0)
+        {
+            fat_discard_chain(start);
+            return -1;
+        }
+        uint32_t src_lba = fat_cluster_to_lba(cluster);
+        uint32_t dst_lba = fat_cluster_to_lba(dst);
+        uint32_t sectors = run * spc;
+        while (sectors > 0)
+        {
+            uint32_t n = sectors > FAT_COPY_SECTORS ? FAT_COPY_SECTORS : sectors;
+            if (fat_read_sectors(src_lba, n, g_fat_copy_buffer) != 0 ||
+                fat_write_sectors(dst_lba, n, g_fat_copy_buffer) != 0)
+            {
+                fat_discard_chain(start);
+                return -1;
+            }
+            src_lba += n;
+            dst_lba += n;
+            sectors -= n;
+        }
+        dst += run;
+        cluster = next;
+    }
+
+    if (fat_free_chain(first) != 0)
+    {
+        return -1;
+    }
+    *moved_to = start;
+    return 0;
+}
+
+// Points the '.' and '..' entries of directory `dir` at itself and at
+// `parent`.
+static int fat_fix_dot_entries(uint32_t dir, uint32_t parent)
+{
+    uint8_t sector[512];
+    uint32_t lba = fat_cluster_to_lba(dir);
+    if (fat_read_sector(lba, sector) != 0)
+    {
+        return -1;
+    }
+    int dirty = 0;
+    if (sector[0] == '.' && sector[1] == ' ' && fat_entry_cluster(sector) != dir)
+    {
+        fat_set_entry_cluster(sector, dir);
+        dirty = 1;
+    }
+    if (sector[32] == '.' && sector[33] == '.' && fat_entry_cluster(&sector[32]) != parent)
+    {
+        fat_set_entry_cluster(&sector[32], parent);
+        dirty = 1;
+    }
+    return dirty ? fat_write_sector(lba, sector) : 0;
+}
+
+// Visits every file and directory chain below the root, depth first. Each
+// level of the tree holds one frame, so a subdirectory is entered as soon
+// as its entry is seen and the parent resumes after it. With `relocate`
+// set, fragmented chains are moved into contiguous extents on the way: the
+// entry pointing at a chain is rewritten in place, and each subdirectory
+// gets its '.' and '..' fixed before its own entries are visited.
+static int fat_defrag_walk(int relocate, struct fat_defrag_stats* stats)
+{
+    struct fat_defrag_frame stack[FAT_DEFRAG_DEPTH];
+    uint32_t depth = 1;
+    uint8_t sector[512];
+    stack[0].dir = 0;
+    stack[0].cluster = fat_dir_start(0);
+    stack[0].sector = 0;
+    stack[0].offset = 0;
+
+    while (depth > 0)
+    {
+        struct fat_defrag_frame* frame = &stack[depth - 1];
+        uint32_t dir = frame->dir;
+        uint32_t count = frame->cluster == 0 ? g_fs.root_dir_sectors : g_fs.sectors_per_cluster;
+        if (frame->sector == count)
+        {
+            uint32_t next = 0;
+            if (frame->cluster == 0)
+            {
+                depth--;
+                continue;
+            }
+            if (fat_read_entry(frame->cluster, &next) != 0)
+            {
+                return -1;
+            }
+            if (next < 2 || fat_is_eoc(next))
+            {
+                depth--;
+                continue;
+            }
+            frame->cluster = next;
+            frame->sector = 0;
+            continue;
+        }
+
+        uint32_t lba = (frame->cluster == 0 ? g_fs.root_dir_lba : fat_cluster_to_lba(frame->cluster)) + frame->sector;
+        if (fat_read_sector(lba, sector) != 0)
+        {
+            return -1;
+        }
+        int dirty = 0;
+        int end = 0;
+        uint32_t child = 0;
+        for (; frame->offset < g_fs.bytes_per_sector && child == 0; frame->offset += 32)
+        {
+            uint8_t* entry = &sector[frame->offset];
+            if (entry[0] == 0x00)
+            {
+                end = 1;
+                break;
+            }
+            if (entry[0] == 0xE5 || entry[0] == '.' || entry[11] == FAT_ATTR_LFN || (entry[11] & FAT_ATTR_VOLUME_ID))
+            {
+                continue;
+            }
+            uint32_t first = fat_entry_cluster(entry);
+            if (first < 2)
+            {
+                continue;
+            }
+
+            uint32_t clusters = 0;
+            uint32_t extents = 0;
+            if (fat_chain_extents(first, &clusters, &extents) != 0)
+            {
+                return -1;
+            }
+            stats->chains++;
+            stats->extents += extents;
+            if (extents > 1)
+            {
+                stats->fragmented++;
+            }
+            if (relocate && extents > 1)
+            {
+                uint32_t moved_to = 0;
+                int rc = fat_relocate_chain(first, clusters, &moved_to);
+                if (rc < 0)
+                {
+                    return -1;
+                }
+                if (rc > 0)
+                {
+                    stats->skipped++;
+                }
+                else
+                {
+                    // The entry goes out before another chain is freed,
+                    // which may commit this one
+                    fat_set_entry_cluster(entry, moved_to);
+                    if (fat_write_sector(lba, sector) != 0)
+                    {
+                        return -1;
+                    }
+                    dirty = 1;
+                    stats->moved++;
+                    stats->moved_clusters += clusters;
+                    if (g_fs.current_dir_cluster == first)
+                    {
+                        g_fs.current_dir_cluster = moved_to;
+                    }
+                    first = moved_to;
+                }
+            }
+
+            if (entry[11] & FAT_ATTR_DIRECTORY)
+            {
+                if (relocate && fat_fix_dot_entries(first, dir) != 0)
+                {
+                    return -1;
+                }
+                child = first;
+            }
+        }
+        // Syncing after each rewritten sector commits the frees, so the
+        // clusters just vacated can take the next chain.
+        if (dirty && fat_sync() != 0)
+        {
+            return -1;
+        }
+        if (end)
+        {
+            depth--;
+            continue;
+        }
+        if (child != 0)
+        {
+            if (depth == FAT_DEFRAG_DEPTH)
+            {
+                set_error("Directory tree too deep");
+                return -1;
+            }
+            stack[depth].dir = child;
+            stack[depth].cluster = child;
+            stack[depth].sector = 0;
+            stack[depth].offset = 0;
+            depth++;
+            continue;
+        }
+        frame->sector++;
+        frame->offset = 0;
+    }
+    return 0;
+}
+
+static void fat_defrag_line(const char* label, const struct fat_defrag_stats* stats)
+{
+    char buf[16];
+    console_write(label);
+    uint32_to_str(stats->chains != 0 ? stats->fragmented * 100 / stats->chains : 0, buf, sizeof(buf));
+    console_write(buf);
+    console_write("% (");
+    uint32_to_str(stats->fragmented, buf, sizeof(buf));
+    console_write(buf);
+    console_write(" of ");
+    uint32_to_str(stats->chains, buf, sizeof(buf));
+    console_write(buf);
+    console_write(" chains fragmented, ");
+    uint32_to_str(stats->extents, buf, sizeof(buf));
+    console_write(buf);
+    console_write(" extents)\n");
+}
+
+// Moves every fragmented file and directory chain into one contiguous
+// extent, filling free space from the start of the volume. The fragmentation
+// score is the share of chains made of more than one extent.
+int fat_defrag(void)
+{
+    for (uint32_t i = 0; i < FAT_MAX_HANDLES; ++i)
+    {
+        if (g_fat_handles[i].used)
+        {
+            set_error("Files are open");
+            return -1;
+        }
+    }
+    if (fat_sync() != 0)
+    {
+        return -1;
+    }
+
+    struct fat_defrag_stats before;
+    struct fat_defrag_stats after;
+    mem_set((uint8_t*)&before, 0, sizeof(before));
+    if (fat_defrag_walk(0, &before) != 0)
+    {
+        return -1;
+    }
+
+    struct fat_defrag_stats moved;
+    mem_set((uint8_t*)&moved, 0, sizeof(moved));
+    g_fat_next_free = 2;
+    int rc = fat_defrag_walk(1, &moved);
+    // Entries of moved directories now live at other sectors and clusters
+    dcache_invalidate();
+    fat_path_invalidate();
+    if (fat_sync() != 0 || rc != 0)
+    {
+        return -1;
+    }
+
+    mem_set((uint8_t*)&after, 0, sizeof(after));
+    if (fat_defrag_walk(0, &after) != 0)
+    {
+        return -1;
+    }
+
+    char buf[16];
+    fat_defrag_line("Before: ", &before);
+    fat_defrag_line("After:  ", &after);
+    console_write("Moved ");
+    uint32_to_str(moved.moved, buf, sizeof(buf));
+    console_write(buf);
+    console_write(" chains, ");
+    uint32_to_str(moved.moved_clusters, buf, sizeof(buf));
+    console_write(buf);
+    console_write(" clusters\n");
+    if (moved.skipped > 0)
+    {
+        uint32_to_str(moved.skipped, buf, sizeof(buf));
+        console_write(buf);
+        console_write(" chains left in place: no free extent long enough\n");
+    }
+    return 0;
+}
+
+// Replaces the contents of a file. The existing chain is overwritten in
+// place, grown only when the new data is longer and cut back when it is
+// shorter, so rewriting a file does not churn the FAT.
+// Small writes only land in a delayed-allocation slot; the file entry is
+// created up front, but clusters are allocated when the slot is flushed.
+int fat_write_data(const char* path, const char* data, size_t data_len)
+{
+    char abs[FAT_PATH_MAX];
+    const char* rel = 0;
+    int where = fat_tmpfs_path(path, abs, &rel);
+    if (where != 0)
+    {
+        return where < 0 ? -1 : fat_tmpfs_write(rel, FAT_O_TRUNC, 0, data, data_len);
+    }
+
+    uint32_t dir = 0;
+    char name[13];
+    if (fat_resolve_parent(path, &dir, name) != 0)
+    {
+        return -1;
+    }
+    if (fat_name_open(dir, name))
+    {
+        set_error("File is open");
+        return -1;
+    }
+
+    if (data_len <= FAT_DELALLOC_BYTES)
+    {
+        char fat_name[11];
+        struct fat_delalloc* d = fat_make_name(name, fat_name) == 0 ? fat_delalloc_find(dir, fat_name) : 0;
+        if (d == 0)
+        {
+            int fd = fat_open(path, FAT_O_WRITE | FAT_O_CREATE);
+            if (fd < 0 || fat_close(fd) != 0)
+            {
+                return -1;
+            }
+            d = fat_delalloc_take(dir, name);
+            if (d == 0)
+            {
+                return -1;
+            }
+        }
+        d->keep = 0;
+        d->len = (uint32_t)data_len;
+        mem_copy(d->data, (const uint8_t*)data, data_len);
+        return 0;
+    }
+
+    int fd = fat_open(path, FAT_O_WRITE | FAT_O_CREATE);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int rc = fat_write_at(fd, 0, data, data_len);
+    if (rc == 0 && fat_size(fd) > data_len)
+    {
+        rc = fat_truncate(fd, (uint32_t)data_len);
+    }
+    if (fat_close(fd) != 0)
+    {
+        rc = -1;
+    }
+    return rc;
+}
+
+int fat_write_range(const char* path, uint32_t offset, const char* data, size_t data_len)
+{
+    char abs[FAT_PATH_MAX];
+    const char* rel = 0;
+    int where = fat_tmpfs_path(path, abs, &rel);
+    if (where != 0)
+    {
+        return where < 0 ? -1 : fat_tmpfs_write(rel, 0, offset, data, data_len);
+    }
+
+    int fd = fat_open(path, FAT_O_WRITE | FAT_O_CREATE);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int rc = fat_write_at(fd, offset, data, data_len);
+    if (fat_close(fd) != 0)
+    {
+        rc = -1;
+    }
+    return rc;
+}
+
+// Appends collect in the file's delayed-allocation slot while they fit;
+// opening the file flushes whatever was there before a new slot starts.
+int fat_append(const char* path, const char* data, size_t data_len)
+{
+    char abs[FAT_PATH_MAX];
+    const char* rel = 0;
+    int where = fat_tmpfs_path(path, abs, &rel);
+    if (where != 0)
+    {
+        return where < 0 ? -1 : fat_tmpfs_write(rel, 0, FAT_TMPFS_END, data, data_len);
+    }
+
+    uint32_t dir = 0;
+    char name[13];
+    if (fat_resolve_parent(path, &dir, name) != 0)
+    {
+        return -1;
+    }
+
+    char fat_name[11];
+    struct fat_delalloc* d = fat_make_name(name, fat_name) == 0 ? fat_delalloc_find(dir, fat_name) : 0;
+    if (d != 0 && data_len <= FAT_DELALLOC_BYTES - d->len)
+    {
+        mem_copy(&d->data[d->len], (const uint8_t*)data, data_len);
+        d->len += (uint32_t)data_len;
+        return 0;
+    }
+
+    int fd = fat_open(path, FAT_O_WRITE | FAT_O_CREATE);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    uint32_t size = fat_size(fd);
+    int rc = 0;
+    if (data_len > FAT_DELALLOC_BYTES)
+    {
+        rc = fat_write_at(fd, size, data, data_len);
+    }
+    if (fat_close(fd) != 0)
+    {
+        rc = -1;
+    }
+    if (rc != 0 || data_len > FAT_DELALLOC_BYTES)
+    {
+        return rc;
+    }
+
+    d = fat_delalloc_take(dir, name);
+    if (d == 0)
+    {
+        return -1;
+    }
+    d->keep = size;
+    d->len = (uint32_t)data_len;
+    mem_copy(d->data, (const uint8_t*)data, data_len);
+    return 0;
+}
+
+int fat_write(const char* path, const char* data)
+{
+    return fat_write_data(path, data, str_len(data));
+}
+
+int fat_rm(const char* path)
+{
+    char abs[FAT_PATH_MAX];
+    const char* rel = 0;
+    int where = fat_tmpfs_path(path, abs, &rel);
+    if (where != 0)
+    {
+        return where < 0 ? -1 : fat_tmpfs_result(tmpfs_rm(rel));
+    }
+
+    uint32_t dir = 0;
+    char name[13];
+    if (fat_resolve_parent(path, &dir, name) != 0)
+    {
+        return -1;
+    }
+
+    if (name[0] == '\0')
+    {
+        set_error("Invalid name");
+        return -1;
+    }
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+    {
+        set_error("Cannot remove . or ..");
+        return -1;
+    }
+
+    uint8_t entry[32];
+    uint32_t lba = 0;
+    uint32_t offset = 0;
+    if (fat_find_entry_in_dir(dir, name, entry, &lba, &offset) != 0)
+    {
+        set_error("Not found");
+        return -1;
+    }
+
+    if (entry[11] & FAT_ATTR_DIRECTORY)
+    {
+        set_error("Is a directory");
+        return -1;
+    }
+    if (fat_entry_open(lba, offset, 0))
+    {
+        set_error("File is open");
+        return -1;
+    }
+    fat_delalloc_settle(dir, name, 1);
+
+    uint32_t cluster = fat_entry_cluster(entry);
+
+    if (cluster != 0)
+    {
+        if (fat_free_chain(cluster) != 0)
+        {
+            return -1;
+        }
+    }
+
+    uint8_t sector[512];
+    if (fat_read_sector(lba, sector) != 0)
+    {
+        return -1;
+    }
+
+    sector[offset] = 0xE5;
+    if (fat_write_sector(lba, sector) != 0)
+    {
+        return -1;
+    }
+    dcache_insert_negative(dir, (const char*)entry);
+
+    return 0;
+}
+
+int fat_rmdir(const char* path)
+{
+    char abs[FAT_PATH_MAX];
+    const char* rel = 0;
+    int where = fat_tmpfs_path(path, abs, &rel);
+    if (where != 0)
+    {
+        if (where < 0)
+        {
+            return -1;
+        }
+        size_t i = 0;
+        while (abs[i] != '\0' && abs[i] == g_cwd[i])
+        {
+            i++;
+        }
+        if (abs[i] == g_cwd[i])
+        {
+            set_error("Directory in use");
+            return -1;
+        }
+        return fat_tmpfs_result(tmpfs_rmdir(rel));
+    }
+
+    uint32_t dir = 0;
+    char name[13];
+    if (fat_resolve_parent(path, &dir, name) != 0)
+    {
+        return -1;
+    }
+
+    if (name[0] == '\0')
+    {
+        set_error("Invalid name");
+        return -1;
+    }
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+    {
+        set_error("Cannot remove . or ..");
+        return -1;
+    }
+
+    uint8_t entry[32];
+    uint32_t lba = 0;
+    uint32_t offset = 0;
+    if (fat_find_entry_in_dir(dir, name, entry, &lba, &offset) != 0)
+    {
+        set_error("Not found");
+        return -1;
+    }
+
+    if ((entry[11] & FAT_ATTR_DIRECTORY) == 0)
+    {
+        set_error("Not a directory");
+        return -1;
+    }
+
+    uint32_t cluster = fat_entry_cluster(entry);
+
+    if (cluster < 2)
+    {
+        set_error("Invalid directory");
+        return -1;
+    }
+    if (cluster == g_fs.current_dir_cluster)
+    {
+        set_error("Directory in use");
+        return -1;
+    }
+
+    uint8_t sector[512];
+    uint32_t base = fat_cluster_to_lba(cluster);
+
+    if (fat_read_sector(base, sector) != 0)
+    {
+        return -1;
+    }
+
+    int empty = 1;
+    for (uint32_t i = 64; i < g_fs.bytes_per_sector; i += 32)
+    {
+        uint8_t first = sector[i];
+        if (first == 0x00)
+        {
+            break;
+        }
+        if (first == 0xE5)
+        {
+            continue;
+        }
+        uint8_t attr = sector[i + 11];
+        if (attr == FAT_ATTR_LFN || attr == FAT_ATTR_VOLUME_ID)
+        {
+            continue;
+        }
+        empty = 0;
+        break;
+    }
+
+    if (!empty)
+    {
+        set_error("Directory not empty");
+        return -1;
+    }
+
+    if (fat_free_chain(cluster) != 0)
+    {
+        return -1;
+    }
+    dcache_invalidate_dir(cluster);
+    fat_path_invalidate();
+
+    if (fat_read_sector(lba, sector) != 0)
+    {
+        return -1;
+    }
+
+    sector[offset] = 0xE5;
+    if (fat_write_sector(lba, sector) != 0)
+    {
+        return -1;
+    }
+    dcache_insert_negative(dir, (const char*)entry);
+
     return 0;
 }
 
-int fat_cd(const char* name)
+static struct fat_handle* fat_get_handle(int fd)
 {
-    if (name == 0 || name[0] == '\0')
+    if (fd < 0 || fd >= FAT_MAX_HANDLES || !g_fat_handles[fd].used)
     {
+        set_error("Bad handle");
         return 0;
     }
+    return &g_fat_handles[fd];
+}
 
-    if (name[0] == '/' && name[1] == '\0')
+// Returns the cluster holding byte `index * cluster_size` of the file and,
+// in `*run`, how many physically contiguous clusters start there. Clusters
+// covered by the file's extent map are found by binary search; only a chain
+// too fragmented for the map is walked past its last extent, continuing from
+// the handle's cursor where possible.
+static int fat_handle_cluster(struct fat_handle* h, uint32_t index, uint32_t* out, uint32_t* run)
+{
+    struct fat_extent_map* map = h->first_cluster >= 2 ? fat_map_get(h->first_cluster) : 0;
+    if (map == 0)
     {
-        g_fs.current_dir_cluster = 0;
-        g_cwd[0] = '/';
-        g_cwd[1] = '\0';
-        return 0;
+        set_error("Corrupt cluster chain");
+        return -1;
     }
-
-    if (name[0] == '.' && name[1] == '\0')
+    if (index < map->clusters)
     {
+        *out = fat_map_lookup(map, index, run);
         return 0;
     }
-
-    if (name[0] == '.' && name[1] == '.' && name[2] == '\0' && g_fs.current_dir_cluster == 0)
+    if (map->complete)
     {
-        return 0;
+        set_error("Corrupt cluster chain");
+        return -1;
     }
 
-    uint8_t entry[32];
-    uint32_t lba = 0;
-    uint32_t offset = 0;
-    if (fat_find_entry_in_dir(g_fs.current_dir_cluster, name, entry, &lba, &offset) != 0)
+    const struct fat_extent* tail = &map->extents[map->count - 1];
+    uint32_t at = map->clusters - 1;
+    uint32_t cluster = tail->cluster + tail->length - 1;
+    if (h->cur_cluster != 0 && h->cur_index > at && h->cur_index <= index)
     {
-        set_error("Not found");
-        return -1;
+        at = h->cur_index;
+        cluster = h->cur_cluster;
     }
 
-    if ((entry[11] & FAT_ATTR_DIRECTORY) == 0)
+    while (at < index)
     {
-        set_error("Not a directory");
+        uint32_t next = 0;
+        if (cluster < 2 || fat_is_eoc(cluster) || fat_read_entry(cluster, &next) != 0)
+        {
+            set_error("Corrupt cluster chain");
+            return -1;
+        }
+        cluster = next;
+        at++;
+    }
+    uint32_t next = 0;
+    if (cluster < 2 || fat_is_eoc(cluster) || fat_chain_run(cluster, g_fs.max_cluster, run, &next) != 0)
+    {
+        set_error("Corrupt cluster chain");
         return -1;
     }
 
-    uint16_t cluster = (uint16_t)entry[26] | ((uint16_t)entry[27] << 8);
-    if (name[0] == '.' && name[1] == '.' && name[2] == '\0')
+    h->cur_index = index;
+    h->cur_cluster = cluster;
+    *out = cluster;
+    return 0;
+}
+
+// Makes sure the chain holds at least `clusters` clusters, appending a
+// freshly allocated extent to the last one if it does not.
+static int fat_handle_reserve(struct fat_handle* h, uint32_t clusters)
+{
+    uint32_t have = 0;
+    uint32_t last = 0;
+    struct fat_extent_map* map = 0;
+    if (h->first_cluster != 0)
     {
-        g_fs.current_dir_cluster = cluster;
-        size_t len = str_len(g_cwd);
-        if (len > 1)
+        map = fat_map_get(h->first_cluster);
+        if (map == 0)
         {
-            size_t i = len - 1;
-            while (i > 0 && g_cwd[i] != '/')
-            {
-                i--;
-            }
-            if (i == 0)
-            {
-                g_cwd[0] = '/';
-                g_cwd[1] = '\0';
-            }
-            else
+            return -1;
+        }
+        uint32_t index = map->clusters - 1;
+        if (!map->complete && h->cur_cluster != 0 && h->cur_index > index)
+        {
+            index = h->cur_index;
+        }
+        uint32_t run = 0;
+        if (fat_handle_cluster(h, index, &last, &run) != 0)
+        {
+            return -1;
+        }
+        have = index + 1;
+        if (!map->complete)
+        {
+            uint32_t next = 0;
+            while (fat_read_entry(last, &next) == 0 && next >= 2 && !fat_is_eoc(next))
             {
-                g_cwd[i] = '\0';
+                last = next;
+                have++;
             }
+            h->cur_index = have - 1;
+            h->cur_cluster = last;
         }
+    }
+    if (have >= clusters)
+    {
         return 0;
     }
 
-    g_fs.current_dir_cluster = cluster;
-    size_t len = str_len(g_cwd);
-    if (len == 1 && g_cwd[0] == '/')
+    uint32_t first = 0;
+    if (fat_alloc_chain(clusters - have, &first) != 0)
+    {
+        return -1;
+    }
+    if (last != 0)
     {
-        int i = 0;
-        while (name[i] != '\0' && i + 2 < (int)sizeof(g_cwd))
+        fat_write_entry(last, first);
+        // A complete map just grows by the new extent; a partial one never
+        // covered the old tail, so it stays as it is.
+        if (map->first_cluster == h->first_cluster && map->complete)
         {
-            g_cwd[1 + i] = name[i];
-            g_cwd[2 + i] = '\0';
-            i++;
+            map->complete = 0;
+            if (fat_map_walk(map, first) != 0)
+            {
+                fat_map_forget(h->first_cluster);
+            }
         }
     }
     else
     {
-        if (len + 1 < sizeof(g_cwd))
-        {
-            g_cwd[len++] = '/';
-            g_cwd[len] = '\0';
-        }
-        int i = 0;
-        while (name[i] != '\0' && len + i + 1 < sizeof(g_cwd))
-        {
-            g_cwd[len + i] = name[i];
-            g_cwd[len + i + 1] = '\0';
-            i++;
-        }
+        h->first_cluster = first;
+        h->cur_index = 0;
+        h->cur_cluster = first;
+        h->entry_dirty = 1;
     }
-
     return 0;
 }
 
-const char* fat_pwd(void)
-{
-    return g_cwd;
-}
-
-int fat_mkdir(const char* name)
+static int fat_handle_store_entry(struct fat_handle* h)
 {
-    static uint8_t temp_sector[512];
-    
-    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+    if (!h->entry_dirty)
     {
-        set_error("Invalid name");
-        return -1;
+        return 0;
     }
-    uint8_t entry[32];
-    uint32_t lba = 0;
-    uint32_t offset = 0;
-    if (fat_find_entry_in_dir(g_fs.current_dir_cluster, name, entry, &lba, &offset) == 0)
+
+    uint8_t sector[512];
+    if (fat_read_sector(h->entry_lba, sector) != 0)
     {
-        set_error("Already exists");
         return -1;
     }
-
-    uint8_t sector[512];
-    if (fat_find_free_dir_entry(g_fs.current_dir_cluster, &lba, &offset, sector) != 0)
+    uint8_t* entry = &sector[h->entry_offset];
+    fat_set_entry_cluster(entry, h->first_cluster);
+    entry[28] = (uint8_t)(h->size & 0xFF);
+    entry[29] = (uint8_t)((h->size >> 8) & 0xFF);
+    entry[30] = (uint8_t)((h->size >> 16) & 0xFF);
+    entry[31] = (uint8_t)((h->size >> 24) & 0xFF);
+    if (fat_write_sector(h->entry_lba, sector) != 0)
     {
         return -1;
     }
+    h->entry_dirty = 0;
+    return 0;
+}
 
-    uint16_t new_cluster = 0;
-    uint8_t fat_sector[512];
-    if (fat_find_free_cluster(&new_cluster, fat_sector) != 0)
+// Opens an existing file in `dir` without looking at delayed data; the
+// flush path uses it to write that data out.
+static int fat_open_in(uint32_t dir, const char* name, int flags)
+{
+    int fd = 0;
+    while (fd < FAT_MAX_HANDLES && g_fat_handles[fd].used)
     {
-        return -1;
+        fd++;
     }
-    if (fat_write_entry(new_cluster, 0xFFFF, fat_sector) != 0)
+    if (fd == FAT_MAX_HANDLES)
     {
+        set_error("Too many open files");
         return -1;
     }
 
-    char fat_name[11];
-    if (fat_make_name(name, fat_name) != 0)
+    uint8_t entry[32];
+    uint32_t lba = 0;
+    uint32_t offset = 0;
+    if (fat_find_entry_in_dir(dir, name, entry, &lba, &offset) != 0)
     {
-        set_error("Invalid name");
+        set_error("Not found");
         return -1;
     }
-
-    fat_write_dir_entry(&sector[offset], fat_name, FAT_ATTR_DIRECTORY, new_cluster, 0);
-    if (fat_write_sector(lba, sector) != 0)
+    if (entry[11] & FAT_ATTR_DIRECTORY)
     {
+        set_error("Is a directory");
         return -1;
     }
 
-    uint32_t base = fat_cluster_to_lba(new_cluster);
-    
-    mem_set((uint8_t*)fat_name, ' ', 11);
-    fat_name[0] = '.';
-    fat_write_dir_entry(temp_sector, fat_name, FAT_ATTR_DIRECTORY, new_cluster, 0);
-
-    mem_set((uint8_t*)entry, ' ', 11);
-    entry[0] = '.';
-    entry[1] = '.';
-    fat_write_dir_entry(&temp_sector[32], (const char*)entry, FAT_ATTR_DIRECTORY, g_fs.current_dir_cluster, 0);
-
-    if (fat_write_sector(base, temp_sector) != 0)
+    if ((flags & FAT_O_TRUNC) && (flags & FAT_O_WRITE) && fat_entry_open(lba, offset, 0))
     {
+        set_error("File is open");
         return -1;
     }
 
-    return 0;
+    struct fat_handle* h = &g_fat_handles[fd];
+    h->used = 1;
+    h->flags = (uint8_t)flags;
+    h->first_cluster = fat_entry_cluster(entry);
+    h->size = le32(&entry[28]);
+    h->entry_lba = lba;
+    h->entry_offset = offset;
+    h->pos = 0;
+    h->cur_index = 0;
+    h->cur_cluster = 0;
+    h->entry_dirty = 0;
+
+    if ((flags & FAT_O_TRUNC) && (flags & FAT_O_WRITE))
+    {
+        if (h->first_cluster != 0 && fat_free_chain(h->first_cluster) != 0)
+        {
+            h->used = 0;
+            return -1;
+        }
+        h->first_cluster = 0;
+        h->size = 0;
+        h->entry_dirty = 1;
+        if (fat_handle_store_entry(h) != 0)
+        {
+            h->used = 0;
+            return -1;
+        }
+    }
+    return fd;
 }
 
-int fat_touch(const char* name)
+int fat_open(const char* path, int flags)
 {
-    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+    char abs[FAT_PATH_MAX];
+    const char* rel = 0;
+    int where = fat_tmpfs_path(path, abs, &rel);
+    if (where != 0)
+    {
+        if (where < 0)
+        {
+            return -1;
+        }
+        int fd = tmpfs_open(rel, flags);
+        return fd < 0 ? fat_tmpfs_result(-1) : fd + FAT_MAX_HANDLES;
+    }
+
+    uint32_t dir = 0;
+    char name[13];
+    if (fat_resolve_parent(path, &dir, name) != 0)
     {
-        set_error("Invalid name");
         return -1;
     }
-    uint8_t entry[32];
-    uint32_t lba = 0;
-    uint32_t offset = 0;
-    if (fat_find_entry_in_dir(g_fs.current_dir_cluster, name, entry, &lba, &offset) == 0)
+    int truncate = (flags & FAT_O_WRITE) && (flags & FAT_O_TRUNC);
+    if (truncate && fat_name_open(dir, name))
     {
-        set_error("Already exists");
+        set_error("File is open");
         return -1;
     }
-
-    uint8_t sector[512];
-    if (fat_find_free_dir_entry(g_fs.current_dir_cluster, &lba, &offset, sector) != 0)
+    if (fat_delalloc_settle(dir, name, truncate) != 0)
     {
         return -1;
     }
 
-    char fat_name[11];
-    if (fat_make_name(name, fat_name) != 0)
+    if (flags & FAT_O_CREATE)
     {
-        set_error("Invalid name");
-        return -1;
+        uint8_t entry[32];
+        uint32_t lba = 0;
+        uint32_t offset = 0;
+        if (fat_find_entry_in_dir(dir, name, entry, &lba, &offset) != 0 && fat_touch(path) != 0)
+        {
+            return -1;
+        }
     }
+    return fat_open_in(dir, name, flags);
+}
 
-    fat_write_dir_entry(&sector[offset], fat_name, 0x20, 0, 0);
-    if (fat_write_sector(lba, sector) != 0)
+int fat_close(int fd)
+{
+    if (fd >= FAT_MAX_HANDLES)
+    {
+        return fat_tmpfs_result(tmpfs_close(fd - FAT_MAX_HANDLES));
+    }
+    struct fat_handle* h = fat_get_handle(fd);
+    if (h == 0)
     {
         return -1;
     }
-
-    return 0;
+    int rc = fat_handle_store_entry(h);
+    h->used = 0;
+    return rc;
 }
 
-int fat_cat(const char* name)
+uint32_t fat_size(int fd)
 {
-    uint8_t entry[32];
-    uint32_t lba = 0;
-    uint32_t offset = 0;
-    if (fat_find_entry_in_dir(g_fs.current_dir_cluster, name, entry, &lba, &offset) != 0)
+    if (fd >= FAT_MAX_HANDLES)
     {
-        set_error("Not found");
-        return -1;
+        return tmpfs_size(fd - FAT_MAX_HANDLES);
     }
+    struct fat_handle* h = fat_get_handle(fd);
+    return h != 0 ? h->size : 0;
+}
 
-    if (entry[11] & FAT_ATTR_DIRECTORY)
+int fat_seek(int fd, int32_t offset, int whence, uint32_t* pos)
+{
+    if (fd >= FAT_MAX_HANDLES)
+    {
+        return fat_tmpfs_result(tmpfs_seek(fd - FAT_MAX_HANDLES, offset, whence, pos));
+    }
+    struct fat_handle* h = fat_get_handle(fd);
+    if (h == 0)
     {
-        set_error("Is a directory");
         return -1;
     }
 
-    uint32_t size = le32(&entry[28]);
-    uint16_t cluster = (uint16_t)entry[26] | ((uint16_t)entry[27] << 8);
-
-    if (size == 0 || cluster == 0)
+    int64_t base = 0;
+    if (whence == FAT_SEEK_CUR)
     {
-        console_putc('\n');
-        return 0;
+        base = h->pos;
     }
-
-    uint8_t sector[512];
-    uint32_t remaining = size;
-
-    while (cluster >= 2 && !fat_is_eoc(cluster) && remaining > 0)
+    else if (whence == FAT_SEEK_END)
     {
-        uint32_t base = fat_cluster_to_lba(cluster);
-        for (int s = 0; s < (int)g_fs.sectors_per_cluster && remaining > 0; ++s)
-        {
-            if (fat_read_sector(base + s, sector) != 0)
-            {
-                return -1;
-            }
-            for (int i = 0; i < (int)g_fs.bytes_per_sector && remaining > 0; ++i)
-            {
-                console_putc((char)sector[i]);
-                remaining--;
-            }
-        }
-
-        uint8_t fat_sector[512];
-        uint16_t next = 0;
-        if (fat_read_entry(cluster, &next, fat_sector) != 0)
-        {
-            return -1;
-        }
-        cluster = next;
+        base = h->size;
+    }
+    int64_t target = base + offset;
+    if (target < 0 || target > 0xFFFFFFFFll)
+    {
+        set_error("Invalid seek");
+        return -1;
+    }
+    h->pos = (uint32_t)target;
+    if (pos)
+    {
+        *pos = h->pos;
     }
-
-    console_putc('\n');
     return 0;
 }
 
-int fat_read(const char* name, char* out, size_t max, size_t* out_size)
+// Reads up to `len` bytes at `offset`. Whole sectors inside a contiguous
+// cluster run go straight into `buffer` with one transfer; only unaligned
+// head and tail bytes pass through a sector buffer.
+int fat_read_at(int fd, uint32_t offset, void* buffer, size_t len, size_t* out_len)
 {
-    if (out_size)
+    if (fd >= FAT_MAX_HANDLES)
     {
-        *out_size = 0;
+        return fat_tmpfs_result(tmpfs_read_at(fd - FAT_MAX_HANDLES, offset, buffer, len, out_len));
     }
-
-    uint8_t entry[32];
-    uint32_t lba = 0;
-    uint32_t offset = 0;
-    if (fat_find_entry_in_dir(g_fs.current_dir_cluster, name, entry, &lba, &offset) != 0)
+    struct fat_handle* h = fat_get_handle(fd);
+    if (out_len)
     {
-        set_error("Not found");
-        return -1;
+        *out_len = 0;
     }
-
-    if (entry[11] & FAT_ATTR_DIRECTORY)
+    if (h == 0)
     {
-        set_error("Is a directory");
         return -1;
     }
-
-    uint32_t size = le32(&entry[28]);
-    uint16_t cluster = (uint16_t)entry[26] | ((uint16_t)entry[27] << 8);
-
-    if (size == 0 || cluster == 0)
+    if (offset >= h->size)
     {
-        if (out && max > 0)
-        {
-            out[0] = '\0';
-        }
-        if (out_size)
-        {
-            *out_size = 0;
-        }
+        h->pos = offset;
         return 0;
     }
-
-    if (size + 1 > max)
+    if (len > h->size - offset)
     {
-        set_error("Buffer too small");
-        return -1;
+        len = h->size - offset;
     }
 
-    uint8_t sector[512];
-    uint32_t remaining = size;
-    size_t written = 0;
-
-    while (cluster >= 2 && !fat_is_eoc(cluster) && remaining > 0)
+    uint8_t* out = (uint8_t*)buffer;
+    uint32_t cluster_size = (uint32_t)g_fs.bytes_per_sector * g_fs.sectors_per_cluster;
+    size_t done = 0;
+    while (done < len)
     {
-        uint32_t base = fat_cluster_to_lba(cluster);
-        for (int s = 0; s < (int)g_fs.sectors_per_cluster && remaining > 0; ++s)
+        uint32_t pos = offset + (uint32_t)done;
+        uint32_t index = pos / cluster_size;
+        uint32_t in_cluster = pos % cluster_size;
+        uint32_t cluster = 0;
+        uint32_t run = 0;
+        if (fat_handle_cluster(h, index, &cluster, &run) != 0)
+        {
+            return -1;
+        }
+        fat_readahead(cluster);
+
+        uint32_t want = (uint32_t)(len - done);
+        uint32_t need = want / cluster_size + 2;
+        if (run > need)
+        {
+            run = need;
+        }
+        uint32_t chunk = run * cluster_size - in_cluster;
+        if (chunk > want)
+        {
+            chunk = want;
+        }
+
+        uint32_t lba = fat_cluster_to_lba(cluster) + in_cluster / g_fs.bytes_per_sector;
+        uint32_t in_sector = in_cluster % g_fs.bytes_per_sector;
+        uint32_t copied = 0;
+        while (copied < chunk)
         {
-            if (fat_read_sector(base + s, sector) != 0)
+            uint32_t left = chunk - copied;
+            if (in_sector == 0 && left >= g_fs.bytes_per_sector)
+            {
+                uint32_t sectors = left / g_fs.bytes_per_sector;
+                if (fat_read_sectors(lba, sectors, &out[done + copied]) != 0)
+                {
+                    return -1;
+                }
+                copied += sectors * g_fs.bytes_per_sector;
+                lba += sectors;
+                continue;
+            }
+
+            uint8_t sector[512];
+            if (fat_read_sector(lba, sector) != 0)
             {
                 return -1;
             }
-            for (int i = 0; i < (int)g_fs.bytes_per_sector && remaining > 0; ++i)
+            uint32_t n = g_fs.bytes_per_sector - in_sector;
+            if (n > left)
             {
-                out[written++] = (char)sector[i];
-                remaining--;
+                n = left;
             }
+            mem_copy(&out[done + copied], &sector[in_sector], n);
+            copied += n;
+            in_sector = 0;
+            lba++;
         }
 
-        uint8_t fat_sector[512];
-        uint16_t next = 0;
-        if (fat_read_entry(cluster, &next, fat_sector) != 0)
-        {
-            return -1;
-        }
-        cluster = next;
-    }
-
-    out[written] = '\0';
-    if (out_size)
-    {
-        *out_size = written;
+        uint32_t last_index = (pos + chunk - 1) / cluster_size;
+        h->cur_index = last_index;
+        h->cur_cluster = (uint32_t)(cluster + (last_index - index));
+        done += chunk;
     }
-    return 0;
-}
-
-int fat_df(void)
-{
-    uint32_t entries_per_sector = g_fs.bytes_per_sector / 2;
-    uint32_t total_entries = (uint32_t)g_fs.sectors_per_fat * entries_per_sector;
-    uint32_t free_clusters = 0;
-    uint32_t used_clusters = 0;
-
-    for (int entry = 2; (uint32_t)entry < total_entries; ++entry)
-    {
-        uint32_t fat_offset = entry * 2;
-        uint32_t fat_sector = g_fs.reserved_sectors + (fat_offset / g_fs.bytes_per_sector);
-        uint32_t fat_index = fat_offset % g_fs.bytes_per_sector;
 
-        uint8_t sector[512];
-        if (fat_read_sector(fat_sector, sector) != 0)
-        {
-            return -1;
-        }
+    h->pos = offset + (uint32_t)done;
+    if (out_len)
+    {
+        *out_len = done;
+    }
+    return 0;
+}
 
-        uint16_t value = (uint16_t)sector[fat_index] | ((uint16_t)sector[fat_index + 1] << 8);
-        if (value == 0x0000)
+// Extends the file with zeros up to `end`.
+static int fat_handle_fill_zero(int fd, struct fat_handle* h, uint32_t end)
+{
+    while (h->size < end)
+    {
+        uint32_t gap = end - h->size;
+        if (gap > sizeof(g_fat_zero_sector))
         {
-            free_clusters++;
+            gap = sizeof(g_fat_zero_sector);
         }
-        else
+        if (fat_write_at(fd, h->size, g_fat_zero_sector, gap) != 0)
         {
-            used_clusters++;
+            return -1;
         }
     }
-
-    uint32_t cluster_size_kb = (uint32_t)g_fs.bytes_per_sector * g_fs.sectors_per_cluster / 1024;
-    uint32_t total_size_kb = (free_clusters + used_clusters) * cluster_size_kb;
-    uint32_t used_size_kb = used_clusters * cluster_size_kb;
-    uint32_t free_size_kb = free_clusters * cluster_size_kb;
-
-    char buf[32];
-    console_write("Disk usage:\n");
-    console_write("Total: ");
-    uint32_to_str(total_size_kb, buf, sizeof(buf));
-    console_write(buf);
-    console_write(" KB\n");
-    console_write("Used:  ");
-    uint32_to_str(used_size_kb, buf, sizeof(buf));
-    console_write(buf);
-    console_write(" KB\n");
-    console_write("Free:  ");
-    uint32_to_str(free_size_kb, buf, sizeof(buf));
-    console_write(buf);
-    console_write(" KB\n");
-
     return 0;
 }
 
-int fat_write_data(const char* name, const char* data, size_t data_len)
+// Writes `len` bytes at `offset`, growing the chain as needed. A gap
+// between the old end of file and `offset` is filled with zeros. Whole
+// sectors are written directly; partial sectors are read, patched and
+// written back.
+int fat_write_at(int fd, uint32_t offset, const void* buffer, size_t len)
 {
-    if (name == 0 || name[0] == '\0')
+    if (fd >= FAT_MAX_HANDLES)
+    {
+        return fat_tmpfs_result(tmpfs_write_at(fd - FAT_MAX_HANDLES, offset, buffer, len));
+    }
+    struct fat_handle* h = fat_get_handle(fd);
+    if (h == 0)
     {
-        set_error("Invalid name");
         return -1;
     }
-    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+    if (!(h->flags & FAT_O_WRITE))
     {
-        set_error("Invalid name");
+        set_error("Not open for writing");
         return -1;
     }
-
-    uint8_t entry[32];
-    uint32_t lba = 0;
-    uint32_t offset = 0;
-    int exists = (fat_find_entry_in_dir(g_fs.current_dir_cluster, name, entry, &lba, &offset) == 0);
-
-    uint16_t cluster = 0;
-    if (exists)
+    if (len == 0)
     {
-        if (entry[11] & FAT_ATTR_DIRECTORY)
-        {
-            set_error("Is a directory");
-            return -1;
-        }
-        cluster = (uint16_t)entry[26] | ((uint16_t)entry[27] << 8);
+        return 0;
+    }
+    if ((uint64_t)offset + len > 0xFFFFFFFFull)
+    {
+        set_error("File too large");
+        return -1;
     }
 
-    if (cluster != 0)
+    if (fat_handle_fill_zero(fd, h, offset) != 0)
     {
-        if (fat_free_chain(cluster) != 0)
-        {
-            return -1;
-        }
-        cluster = 0;
+        return -1;
     }
 
     uint32_t cluster_size = (uint32_t)g_fs.bytes_per_sector * g_fs.sectors_per_cluster;
-    uint32_t clusters_needed = 0;
-    if (data_len > 0)
+    uint32_t end = offset + (uint32_t)len;
+    if (fat_handle_reserve(h, (end + cluster_size - 1) / cluster_size) != 0)
     {
-        clusters_needed = (data_len + cluster_size - 1) / cluster_size;
+        return -1;
     }
 
-    uint16_t first_cluster = 0;
-    uint16_t prev_cluster = 0;
-    for (int i = 0; i < (int)clusters_needed; ++i)
+    const uint8_t* in = (const uint8_t*)buffer;
+    size_t done = 0;
+    while (done < len)
     {
-        uint8_t fat_sector[512];
-        uint16_t new_cluster = 0;
-        if (fat_find_free_cluster(&new_cluster, fat_sector) != 0)
+        uint32_t pos = offset + (uint32_t)done;
+        uint32_t index = pos / cluster_size;
+        uint32_t in_cluster = pos % cluster_size;
+        uint32_t cluster = 0;
+        uint32_t run = 0;
+        if (fat_handle_cluster(h, index, &cluster, &run) != 0)
         {
-            if (first_cluster != 0)
-            {
-                fat_free_chain(first_cluster);
-            }
             return -1;
         }
-        if (prev_cluster != 0)
+
+        uint32_t want = (uint32_t)(len - done);
+        uint32_t need = want / cluster_size + 2;
+        if (run > need)
         {
-            if (fat_write_entry(prev_cluster, new_cluster, fat_sector) != 0)
-            {
-                fat_free_chain(first_cluster);
-                return -1;
-            }
+            run = need;
         }
-        prev_cluster = new_cluster;
-        if (first_cluster == 0)
+        uint32_t chunk = run * cluster_size - in_cluster;
+        if (chunk > want)
         {
-            first_cluster = new_cluster;
+            chunk = want;
         }
-    }
 
-    if (prev_cluster != 0)
-    {
-        uint8_t fat_sector[512];
-        if (fat_write_entry(prev_cluster, 0xFFFF, fat_sector) != 0)
+        uint32_t lba = fat_cluster_to_lba(cluster) + in_cluster / g_fs.bytes_per_sector;
+        uint32_t in_sector = in_cluster % g_fs.bytes_per_sector;
+        uint32_t copied = 0;
+        while (copied < chunk)
         {
-            fat_free_chain(first_cluster);
-            return -1;
+            uint32_t left = chunk - copied;
+            if (in_sector == 0 && left >= g_fs.bytes_per_sector)
+            {
+                uint32_t sectors = left / g_fs.bytes_per_sector;
+                if (fat_write_sectors(lba, sectors, &in[done + copied]) != 0)
+                {
+                    return -1;
+                }
+                copied += sectors * g_fs.bytes_per_sector;
+                lba += sectors;
+                continue;
+            }
+
+            // Bytes past the old end of file are undefined on disk, so a
+            // sector that starts there is built from zeros instead of read.
+            uint8_t sector[512];
+            uint32_t sector_pos = pos + copied - in_sector;
+            if (sector_pos < h->size)
+            {
+                if (fat_read_sector(lba, sector) != 0)
+                {
+                    return -1;
+                }
+            }
+            else
+            {
+                mem_set(sector, 0, sizeof(sector));
+            }
+            uint32_t n = g_fs.bytes_per_sector - in_sector;
+            if (n > left)
+            {
+                n = left;
+            }
+            mem_copy(&sector[in_sector], &in[done + copied], n);
+            if (fat_write_sector(lba, sector) != 0)
+            {
+                return -1;
+            }
+            copied += n;
+            in_sector = 0;
+            lba++;
         }
+
+        uint32_t last_index = (pos + chunk - 1) / cluster_size;
+        h->cur_index = last_index;
+        h->cur_cluster = (uint32_t)(cluster + (last_index - index));
+        done += chunk;
     }
 
-    cluster = first_cluster;
+    h->pos = end;
+    if (end > h->size)
+    {
+        h->size = end;
+        h->entry_dirty = 1;
+    }
+    return fat_handle_store_entry(h);
+}
 
-    if (!exists)
+// Sets the file length. Growing fills with zeros; shrinking cuts the chain
+// after the last cluster still needed and frees the remainder.
+int fat_truncate(int fd, uint32_t size)
+{
+    if (fd >= FAT_MAX_HANDLES)
     {
-        uint8_t sector[512];
-        if (fat_find_free_dir_entry(g_fs.current_dir_cluster, &lba, &offset, sector) != 0)
-        {
-            return -1;
-        }
+        return fat_tmpfs_result(tmpfs_truncate(fd - FAT_MAX_HANDLES, size));
+    }
+    struct fat_handle* h = fat_get_handle(fd);
+    if (h == 0)
+    {
+        return -1;
+    }
+    if (!(h->flags & FAT_O_WRITE))
+    {
+        set_error("Not open for writing");
+        return -1;
+    }
+    if (size > h->size && fat_handle_fill_zero(fd, h, size) != 0)
+    {
+        return -1;
+    }
 
-        char fat_name[11];
-        if (fat_make_name(name, fat_name) != 0)
+    // Everything past the cluster holding the new end goes, including
+    // clusters reserved by fat_fallocate.
+    uint32_t cluster_size = (uint32_t)g_fs.bytes_per_sector * g_fs.sectors_per_cluster;
+    uint32_t keep = (size + cluster_size - 1) / cluster_size;
+    uint32_t cut = 0;
+    uint32_t last = 0;
+    if (keep == 0)
+    {
+        cut = h->first_cluster;
+    }
+    else if (h->first_cluster != 0)
+    {
+        uint32_t run = 0;
+        if (fat_handle_cluster(h, keep - 1, &last, &run) != 0 || fat_read_entry(last, &cut) != 0)
         {
-            set_error("Invalid name");
             return -1;
         }
-
-        fat_write_dir_entry(&sector[offset], fat_name, 0x20, cluster, (uint32_t)data_len);
-        if (fat_write_sector(lba, sector) != 0)
+        if (fat_is_eoc(cut))
         {
-            return -1;
+            cut = 0;
         }
     }
-    else
+    if (cut != 0)
     {
-        uint8_t sector[512];
-        if (fat_read_sector(lba, sector) != 0)
+        if (fat_entry_open(h->entry_lba, h->entry_offset, h))
         {
+            set_error("File is open");
             return -1;
         }
-        sector[offset + 26] = (uint8_t)(cluster & 0xFF);
-        sector[offset + 27] = (uint8_t)(cluster >> 8);
-        sector[offset + 28] = (uint8_t)(data_len & 0xFF);
-        sector[offset + 29] = (uint8_t)((data_len >> 8) & 0xFF);
-        sector[offset + 30] = (uint8_t)((data_len >> 16) & 0xFF);
-        sector[offset + 31] = (uint8_t)((data_len >> 24) & 0xFF);
-        if (fat_write_sector(lba, sector) != 0)
+        if (keep == 0)
         {
-            return -1;
+            h->first_cluster = 0;
         }
-    }
-
-    if (data_len == 0)
-    {
-        return 0;
-    }
-
-    size_t written = 0;
-    while (cluster >= 2 && !fat_is_eoc(cluster) && written < data_len)
-    {
-        uint32_t base = fat_cluster_to_lba(cluster);
-        for (int s = 0; s < (int)g_fs.sectors_per_cluster; ++s)
+        else
         {
-            uint8_t sector[512];
-            for (int j = 0; j < 512; j++) { sector[j] = 0; }
-            for (int i = 0; i < (int)g_fs.bytes_per_sector && written < data_len; ++i)
-            {
-                sector[i] = (uint8_t)data[written++];
-            }
-            if (fat_write_sector(base + s, sector) != 0)
+            fat_map_forget(h->first_cluster);
+            if (fat_write_entry(last, fat_eoc()) != 0)
             {
                 return -1;
             }
         }
-
-        if (written >= data_len)
+        if (h->cur_index >= keep)
         {
-            break;
+            h->cur_index = 0;
+            h->cur_cluster = 0;
         }
-
-        uint8_t fat_sector[512];
-        uint16_t next = 0;
-        if (fat_read_entry(cluster, &next, fat_sector) != 0)
+        if (fat_free_chain(cut) != 0)
         {
             return -1;
         }
-        cluster = next;
+        h->entry_dirty = 1;
+    }
+    if (size == h->size)
+    {
+        return fat_handle_store_entry(h);
     }
 
-    return 0;
-}
-
-int fat_write(const char* name, const char* data)
-{
-    return fat_write_data(name, data, str_len(data));
+    h->size = size;
+    if (h->pos > size)
+    {
+        h->pos = size;
+    }
+    h->entry_dirty = 1;
+    return fat_handle_store_entry(h);
 }
 
-int fat_rm(const char* name)
+// Reserves clusters for the first `bytes` bytes of the file without
+// writing anything or changing its size. The reserved clusters hang off the
+// chain past end of file, so later writes up to `bytes` land in them without
+// calling the allocator; any truncate releases those past the new size.
+int fat_fallocate(const char* path, uint32_t bytes)
 {
-    if (name == 0 || name[0] == '\0')
+    int fd = fat_open(path, FAT_O_WRITE | FAT_O_CREATE);
+    if (fd < 0)
     {
-        set_error("Invalid name");
         return -1;
     }
-    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+    if (fd >= FAT_MAX_HANDLES)
     {
-        set_error("Cannot remove . or ..");
-        return -1;
+        int rc = fat_tmpfs_result(tmpfs_reserve(fd - FAT_MAX_HANDLES, bytes));
+        fat_close(fd);
+        return rc;
     }
 
-    uint8_t entry[32];
-    uint32_t lba = 0;
-    uint32_t offset = 0;
-    if (fat_find_entry_in_dir(g_fs.current_dir_cluster, name, entry, &lba, &offset) != 0)
+    uint32_t cluster_size = (uint32_t)g_fs.bytes_per_sector * g_fs.sectors_per_cluster;
+    uint32_t clusters = bytes / cluster_size + (bytes % cluster_size != 0 ? 1 : 0);
+    int rc = fat_handle_reserve(&g_fat_handles[fd], clusters);
+    if (fat_close(fd) != 0)
     {
-        set_error("Not found");
-        return -1;
+        rc = -1;
     }
+    return rc;
+}
 
-    if (entry[11] & FAT_ATTR_DIRECTORY)
+// Copies through open handles when either side is on tmpfs, a buffer at a
+// time; memory-backed handles make this a plain memory copy.
+static int fat_cp_stream(const char* src, const char* dst)
+{
+    int in = fat_open(src, FAT_O_READ);
+    if (in < 0)
     {
-        set_error("Is a directory");
+        return -1;
+    }
+    int out = fat_open(dst, FAT_O_WRITE | FAT_O_CREATE | FAT_O_TRUNC);
+    if (out < 0)
+    {
+        fat_close(in);
         return -1;
     }
 
-    uint16_t cluster = (uint16_t)entry[26] | ((uint16_t)entry[27] << 8);
-
-    if (cluster != 0)
+    g_fat_copy_stats.bytes = 0;
+    g_fat_copy_stats.sectors = 0;
+    g_fat_copy_stats.transfers = 0;
+    uint32_t offset = 0;
+    size_t got = 0;
+    int rc = 0;
+    do
     {
-        if (fat_free_chain(cluster) != 0)
+        rc = fat_read_at(in, offset, g_fat_copy_buffer, sizeof(g_fat_copy_buffer), &got);
+        if (rc == 0 && got > 0)
         {
-            return -1;
+            rc = fat_write_at(out, offset, g_fat_copy_buffer, got);
+            g_fat_copy_stats.transfers++;
         }
-    }
+        offset += (uint32_t)got;
+    } while (rc == 0 && got > 0);
 
-    uint8_t sector[512];
-    if (fat_read_sector(lba, sector) != 0)
+    if (rc == 0)
     {
-        return -1;
+        g_fat_copy_stats.bytes = offset;
+        g_fat_copy_stats.sectors = (offset + 511) / 512;
     }
-
-    sector[offset] = 0xE5;
-    if (fat_write_sector(lba, sector) != 0)
+    fat_close(in);
+    if (fat_close(out) != 0)
     {
-        return -1;
+        rc = -1;
     }
-
-    return 0;
+    return rc;
 }
 
-int fat_rmdir(const char* name)
+int fat_cp(const char* src, const char* dst)
 {
-    if (name == 0 || name[0] == '\0')
+    if (src == 0 || src[0] == '\0' || dst == 0 || dst[0] == '\0')
     {
         set_error("Invalid name");
         return -1;
     }
-    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+
+    if (src[0] == '.' && (src[1] == '\0' || (src[1] == '.' && src[2] == '\0')))
     {
-        set_error("Cannot remove . or ..");
+        set_error("Cannot copy . or ..");
         return -1;
     }
 
-    uint8_t entry[32];
-    uint32_t lba = 0;
-    uint32_t offset = 0;
-    if (fat_find_entry_in_dir(g_fs.current_dir_cluster, name, entry, &lba, &offset) != 0)
+    if (dst[0] == '.' && (dst[1] == '\0' || (dst[1] == '.' && dst[2] == '\0')))
     {
-        set_error("Not found");
+        set_error("Invalid destination");
         return -1;
     }
 
-    if ((entry[11] & FAT_ATTR_DIRECTORY) == 0)
+    char src_abs[FAT_PATH_MAX];
+    char dst_abs[FAT_PATH_MAX];
+    const char* src_rel = 0;
+    const char* dst_rel = 0;
+    int src_where = fat_tmpfs_path(src, src_abs, &src_rel);
+    int dst_where = fat_tmpfs_path(dst, dst_abs, &dst_rel);
+    if (src_where < 0 || dst_where < 0)
     {
-        set_error("Not a directory");
         return -1;
     }
+    if (src_where > 0 || dst_where > 0)
+    {
+        if (src_where > 0 && dst_where > 0)
+        {
+            size_t i = 0;
+            while (src_abs[i] != '\0' && src_abs[i] == dst_abs[i])
+            {
+                i++;
+            }
+            if (src_abs[i] == dst_abs[i])
+            {
+                set_error("Source and destination are the same");
+                return -1;
+            }
+        }
+        return fat_cp_stream(src, dst);
+    }
 
-    uint16_t cluster = (uint16_t)entry[26] | ((uint16_t)entry[27] << 8);
-
-    if (cluster < 2)
+    uint32_t src_dir = 0;
+    uint32_t dst_dir = 0;
+    char src_leaf[13];
+    char dst_leaf[13];
+    char src_name[11];
+    char dst_name[11];
+    if (fat_resolve_parent(src, &src_dir, src_leaf) != 0 || fat_resolve_parent(dst, &dst_dir, dst_leaf) != 0)
     {
-        set_error("Invalid directory");
         return -1;
     }
-
-    uint8_t sector[512];
-    uint32_t base = fat_cluster_to_lba(cluster);
-
-    if (fat_read_sector(base, sector) != 0)
+    if (fat_make_name(src_leaf, src_name) != 0 || fat_make_name(dst_leaf, dst_name) != 0)
     {
+        set_error("Invalid name");
         return -1;
     }
-
-    int empty = 1;
-    for (uint32_t i = 64; i < g_fs.bytes_per_sector; i += 32)
+    int same = src_dir == dst_dir;
+    for (int i = 0; i < 11; i++)
     {
-        uint8_t first = sector[i];
-        if (first == 0x00)
-        {
-            break;
-        }
-        if (first == 0xE5)
-        {
-            continue;
-        }
-        uint8_t attr = sector[i + 11];
-        if (attr == FAT_ATTR_LFN || attr == FAT_ATTR_VOLUME_ID)
+        if (src_name[i] != dst_name[i])
         {
-            continue;
+            same = 0;
         }
-        empty = 0;
-        break;
     }
-
-    if (!empty)
+    if (same)
     {
-        set_error("Directory not empty");
+        set_error("Source and destination are the same");
         return -1;
     }
 
-    if (fat_free_chain(cluster) != 0)
+    int in = fat_open(src, FAT_O_READ);
+    if (in < 0)
     {
         return -1;
     }
-
-    if (fat_read_sector(lba, sector) != 0)
+    int out = fat_open(dst, FAT_O_WRITE | FAT_O_CREATE | FAT_O_TRUNC);
+    if (out < 0)
     {
+        fat_close(in);
         return -1;
     }
 
-    sector[offset] = 0xE5;
-    if (fat_write_sector(lba, sector) != 0)
+    struct fat_handle* src_h = &g_fat_handles[in];
+    struct fat_handle* dst_h = &g_fat_handles[out];
+    uint32_t spc = g_fs.sectors_per_cluster;
+    uint32_t cluster_size = (uint32_t)g_fs.bytes_per_sector * spc;
+    uint32_t remaining = (src_h->size + g_fs.bytes_per_sector - 1) / g_fs.bytes_per_sector;
+
+    g_fat_copy_stats.bytes = 0;
+    g_fat_copy_stats.sectors = 0;
+    g_fat_copy_stats.transfers = 0;
+
+    // The whole destination chain is allocated before any data moves, so
+    // the allocator can hand out one contiguous extent and the copy below
+    // becomes a walk over two sets of cluster runs.
+    int rc = fat_handle_reserve(dst_h, (src_h->size + cluster_size - 1) / cluster_size);
+    uint32_t src_cluster = src_h->first_cluster;
+    uint32_t dst_cluster = dst_h->first_cluster;
+    uint32_t sector = 0;
+    while (rc == 0 && remaining > 0)
     {
-        return -1;
-    }
-
-    return 0;
-}
+        uint32_t want = (sector + remaining + spc - 1) / spc;
+        uint32_t src_run = 0;
+        uint32_t dst_run = 0;
+        uint32_t src_next = 0;
+        uint32_t dst_next = 0;
+        if (fat_chain_run(src_cluster, want, &src_run, &src_next) != 0 ||
+            fat_chain_run(dst_cluster, want, &dst_run, &dst_next) != 0)
+        {
+            rc = -1;
+            break;
+        }
 
-int fat_cp(const char* src, const char* dst)
-{
-    if (src == 0 || src[0] == '\0' || dst == 0 || dst[0] == '\0')
-    {
-        set_error("Invalid name");
-        return -1;
-    }
+        uint32_t count = (src_run < dst_run ? src_run : dst_run) * spc - sector;
+        if (count > remaining)
+        {
+            count = remaining;
+        }
+        if (count > FAT_COPY_SECTORS)
+        {
+            count = FAT_COPY_SECTORS;
+        }
 
-    if (src[0] == '.' && (src[1] == '\0' || (src[1] == '.' && src[2] == '\0')))
-    {
-        set_error("Cannot copy . or ..");
-        return -1;
+        if (fat_read_sectors(fat_cluster_to_lba(src_cluster) + sector, count, g_fat_copy_buffer) != 0 ||
+            fat_write_sectors(fat_cluster_to_lba(dst_cluster) + sector, count, g_fat_copy_buffer) != 0)
+        {
+            rc = -1;
+            break;
+        }
+        g_fat_copy_stats.sectors += count;
+        g_fat_copy_stats.transfers++;
+        remaining -= count;
+
+        sector += count;
+        uint32_t advance = sector / spc;
+        sector %= spc;
+        src_cluster = advance < src_run ? (uint32_t)(src_cluster + advance) : src_next;
+        dst_cluster = advance < dst_run ? (uint32_t)(dst_cluster + advance) : dst_next;
     }
 
-    if (dst[0] == '.' && (dst[1] == '\0' || (dst[1] == '.' && dst[2] == '\0')))
+    if (rc == 0)
     {
-        set_error("Invalid destination");
-        return -1;
+        dst_h->size = src_h->size;
+        dst_h->entry_dirty = 1;
+        g_fat_copy_stats.bytes = src_h->size;
     }
-
-    char buffer[4096];
-    size_t file_size = 0;
-    if (fat_read(src, buffer, sizeof(buffer) - 1, &file_size) != 0)
+    fat_close(in);
+    if (fat_close(out) != 0)
     {
-        return -1;
+        rc = -1;
     }
+    return rc;
+}
 
-    if (fat_write_data(dst, buffer, file_size) != 0)
+void fat_get_copy_stats(struct fat_copy_stats* stats)
+{
+    if (stats)
     {
-        return -1;
+        *stats = g_fat_copy_stats;
     }
-
-    return 0;
 }
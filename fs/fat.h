@@ -3,18 +3,60 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define FAT_PATH_MAX 128
+
+enum
+{
+    FAT_O_READ = 1,
+    FAT_O_WRITE = 2,
+    FAT_O_CREATE = 4,
+    FAT_O_TRUNC = 8
+};
+
+enum
+{
+    FAT_SEEK_SET = 0,
+    FAT_SEEK_CUR = 1,
+    FAT_SEEK_END = 2
+};
+
+struct fat_copy_stats
+{
+    uint32_t bytes;
+    uint32_t sectors;
+    uint32_t transfers;
+};
+
 int fat_init(void);
+int fat_mount_tmpfs(const char* path);
+int fat_sync(void);
+void fat_set_readahead(uint32_t clusters);
+uint32_t fat_get_readahead(void);
 int fat_ls(void);
-int fat_cd(const char* name);
+int fat_cd(const char* path);
 const char* fat_pwd(void);
-int fat_mkdir(const char* name);
-int fat_touch(const char* name);
-int fat_cat(const char* name);
-int fat_write(const char* name, const char* data);
-int fat_write_data(const char* name, const char* data, size_t data_len);
-int fat_read(const char* name, char* out, size_t max, size_t* out_size);
+int fat_mkdir(const char* path);
+int fat_touch(const char* path);
+int fat_cat(const char* path);
+int fat_write(const char* path, const char* data);
+int fat_write_data(const char* path, const char* data, size_t data_len);
+int fat_write_range(const char* path, uint32_t offset, const char* data, size_t data_len);
+int fat_append(const char* path, const char* data, size_t data_len);
+int fat_fallocate(const char* path, uint32_t bytes);
+int fat_read(const char* path, char* out, size_t max, size_t* out_size);
 const char* fat_last_error(void);
 int fat_df(void);
-int fat_rm(const char* name);
-int fat_rmdir(const char* name);
+int fat_df_verify(void);
+int fat_defrag(void);
+int fat_rm(const char* path);
+int fat_rmdir(const char* path);
 int fat_cp(const char* src, const char* dst);
+void fat_get_copy_stats(struct fat_copy_stats* stats);
+
+int fat_open(const char* path, int flags);
+int fat_close(int fd);
+int fat_read_at(int fd, uint32_t offset, void* buffer, size_t len, size_t* out_len);
+int fat_write_at(int fd, uint32_t offset, const void* buffer, size_t len);
+int fat_seek(int fd, int32_t offset, int whence, uint32_t* pos);
+int fat_truncate(int fd, uint32_t size);
+uint32_t fat_size(int fd);
@@ -0,0 +1,645 @@
+#include "tmpfs.h"
+#include "console.h"
+#include "fat.h"
+
+#define TMPFS_NONE 0xFFFF
+#define TMPFS_ROOT 0
+
+// A file or directory. Directories hold no data; their children point back
+// at them through `parent`. A file's data lives in whole pages listed in
+// order in `pages`, so byte N is found without walking anything. Bytes past
+// `size` in the allocated pages are always zero.
+struct tmpfs_node
+{
+    uint8_t used;
+    uint8_t is_dir;
+    uint16_t parent;
+    char name[TMPFS_NAME_MAX];
+    uint32_t size;
+    uint16_t page_count;
+    uint16_t pages[TMPFS_PAGES];
+};
+
+struct tmpfs_handle
+{
+    uint8_t used;
+    uint8_t flags;
+    uint16_t node;
+    uint32_t pos;
+};
+
+static struct tmpfs_node g_tmpfs_nodes[TMPFS_NODES];
+static struct tmpfs_handle g_tmpfs_handles[TMPFS_MAX_HANDLES];
+static uint8_t g_tmpfs_data[TMPFS_PAGES][TMPFS_PAGE_SIZE];
+static uint16_t g_tmpfs_free_next[TMPFS_PAGES];
+static uint16_t g_tmpfs_free_head = TMPFS_NONE;
+static uint32_t g_tmpfs_free_count = 0;
+static const char* g_tmpfs_error = "";
+
+static void set_error(const char* msg)
+{
+    g_tmpfs_error = msg;
+}
+
+static void mem_set(uint8_t* dst, uint8_t value, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        dst[i] = value;
+    }
+}
+
+static void mem_copy(uint8_t* dst, const uint8_t* src, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        dst[i] = src[i];
+    }
+}
+
+void tmpfs_init(void)
+{
+    mem_set((uint8_t*)g_tmpfs_nodes, 0, sizeof(g_tmpfs_nodes));
+    mem_set((uint8_t*)g_tmpfs_handles, 0, sizeof(g_tmpfs_handles));
+    g_tmpfs_free_head = TMPFS_NONE;
+    for (uint32_t i = TMPFS_PAGES; i > 0; --i)
+    {
+        g_tmpfs_free_next[i - 1] = g_tmpfs_free_head;
+        g_tmpfs_free_head = (uint16_t)(i - 1);
+    }
+    g_tmpfs_free_count = TMPFS_PAGES;
+
+    struct tmpfs_node* root = &g_tmpfs_nodes[TMPFS_ROOT];
+    root->used = 1;
+    root->is_dir = 1;
+    root->parent = TMPFS_ROOT;
+    set_error("");
+}
+
+const char* tmpfs_last_error(void)
+{
+    return g_tmpfs_error;
+}
+
+static int tmpfs_find_child(uint16_t dir, const char* name, uint32_t len)
+{
+    if (len >= TMPFS_NAME_MAX)
+    {
+        return -1;
+    }
+    for (uint32_t i = 1; i < TMPFS_NODES; ++i)
+    {
+        const struct tmpfs_node* n = &g_tmpfs_nodes[i];
+        if (!n->used || n->parent != dir || n->name[len] != '\0')
+        {
+            continue;
+        }
+        uint32_t j = 0;
+        while (j < len && n->name[j] == name[j])
+        {
+            j++;
+        }
+        if (j == len)
+        {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Resolves the first `len` characters of `path` to a node.
+static int tmpfs_walk(const char* path, uint32_t len, uint16_t* out)
+{
+    uint16_t node = TMPFS_ROOT;
+    uint32_t i = 0;
+    while (i < len)
+    {
+        while (i < len && path[i] == '/')
+        {
+            i++;
+        }
+        uint32_t start = i;
+        while (i < len && path[i] != '/')
+        {
+            i++;
+        }
+        if (i == start)
+        {
+            break;
+        }
+        if (!g_tmpfs_nodes[node].is_dir)
+        {
+            set_error("Not a directory");
+            return -1;
+        }
+        int child = tmpfs_find_child(node, &path[start], i - start);
+        if (child < 0)
+        {
+            set_error("Not found");
+            return -1;
+        }
+        node = (uint16_t)child;
+    }
+    *out = node;
+    return 0;
+}
+
+static int tmpfs_lookup(const char* path, uint16_t* out)
+{
+    uint32_t len = 0;
+    while (path[len] != '\0')
+    {
+        len++;
+    }
+    return tmpfs_walk(path, len, out);
+}
+
+// Splits `path` into the directory holding it and its last component.
+static int tmpfs_parent(const char* path, uint16_t* dir, char leaf[TMPFS_NAME_MAX])
+{
+    uint32_t len = 0;
+    while (path[len] != '\0')
+    {
+        len++;
+    }
+    while (len > 1 && path[len - 1] == '/')
+    {
+        len--;
+    }
+    uint32_t slash = len;
+    while (slash > 0 && path[slash - 1] != '/')
+    {
+        slash--;
+    }
+    if (len == slash || len - slash >= TMPFS_NAME_MAX)
+    {
+        set_error("Invalid name");
+        return -1;
+    }
+    for (uint32_t i = slash; i < len; ++i)
+    {
+        leaf[i - slash] = path[i];
+    }
+    leaf[len - slash] = '\0';
+
+    if (tmpfs_walk(path, slash, dir) != 0)
+    {
+        return -1;
+    }
+    if (!g_tmpfs_nodes[*dir].is_dir)
+    {
+        set_error("Not a directory");
+        return -1;
+    }
+    return 0;
+}
+
+static int tmpfs_create(const char* path, uint8_t is_dir)
+{
+    uint16_t dir = 0;
+    char leaf[TMPFS_NAME_MAX];
+    if (tmpfs_parent(path, &dir, leaf) != 0)
+    {
+        return -1;
+    }
+    uint32_t len = 0;
+    while (leaf[len] != '\0')
+    {
+        len++;
+    }
+    if (tmpfs_find_child(dir, leaf, len) >= 0)
+    {
+        set_error("Already exists");
+        return -1;
+    }
+
+    for (uint32_t i = 1; i < TMPFS_NODES; ++i)
+    {
+        struct tmpfs_node* n = &g_tmpfs_nodes[i];
+        if (n->used)
+        {
+            continue;
+        }
+        mem_set((uint8_t*)n, 0, sizeof(*n));
+        n->used = 1;
+        n->is_dir = is_dir;
+        n->parent = dir;
+        mem_copy((uint8_t*)n->name, (const uint8_t*)leaf, len + 1);
+        return 0;
+    }
+    set_error("Too many files");
+    return -1;
+}
+
+// Grows or shrinks the page list of a file to exactly `count` pages. The
+// space check happens first, so a failed grow leaves the file untouched.
+static int tmpfs_set_pages(struct tmpfs_node* n, uint32_t count)
+{
+    if (count > TMPFS_PAGES)
+    {
+        set_error("File too large");
+        return -1;
+    }
+    if (count > n->page_count && count - n->page_count > g_tmpfs_free_count)
+    {
+        set_error("No space left");
+        return -1;
+    }
+
+    while (n->page_count < count)
+    {
+        uint16_t page = g_tmpfs_free_head;
+        g_tmpfs_free_head = g_tmpfs_free_next[page];
+        g_tmpfs_free_count--;
+        mem_set(g_tmpfs_data[page], 0, TMPFS_PAGE_SIZE);
+        n->pages[n->page_count++] = page;
+    }
+    while (n->page_count > count)
+    {
+        uint16_t page = n->pages[--n->page_count];
+        g_tmpfs_free_next[page] = g_tmpfs_free_head;
+        g_tmpfs_free_head = page;
+        g_tmpfs_free_count++;
+    }
+    return 0;
+}
+
+static uint32_t tmpfs_pages_for(uint32_t bytes)
+{
+    return bytes / TMPFS_PAGE_SIZE + (bytes % TMPFS_PAGE_SIZE != 0 ? 1 : 0);
+}
+
+static int tmpfs_node_open(uint16_t node)
+{
+    for (uint32_t i = 0; i < TMPFS_MAX_HANDLES; ++i)
+    {
+        if (g_tmpfs_handles[i].used && g_tmpfs_handles[i].node == node)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int tmpfs_ls(const char* path)
+{
+    uint16_t dir = 0;
+    if (tmpfs_lookup(path, &dir) != 0)
+    {
+        return -1;
+    }
+    if (!g_tmpfs_nodes[dir].is_dir)
+    {
+        set_error("Not a directory");
+        return -1;
+    }
+
+    console_write("<DIR> .\n");
+    console_write("<DIR> ..\n");
+    for (uint32_t i = 1; i < TMPFS_NODES; ++i)
+    {
+        const struct tmpfs_node* n = &g_tmpfs_nodes[i];
+        if (!n->used || n->parent != dir)
+        {
+            continue;
+        }
+        console_write(n->is_dir ? "<DIR> " : "      ");
+        console_write(n->name);
+        console_putc('\n');
+    }
+    return 0;
+}
+
+int tmpfs_is_dir(const char* path)
+{
+    uint16_t node = 0;
+    if (tmpfs_lookup(path, &node) != 0)
+    {
+        return 0;
+    }
+    if (!g_tmpfs_nodes[node].is_dir)
+    {
+        set_error("Not a directory");
+        return 0;
+    }
+    return 1;
+}
+
+int tmpfs_mkdir(const char* path)
+{
+    return tmpfs_create(path, 1);
+}
+
+int tmpfs_touch(const char* path)
+{
+    return tmpfs_create(path, 0);
+}
+
+int tmpfs_rm(const char* path)
+{
+    uint16_t node = 0;
+    if (tmpfs_lookup(path, &node) != 0)
+    {
+        return -1;
+    }
+    struct tmpfs_node* n = &g_tmpfs_nodes[node];
+    if (n->is_dir)
+    {
+        set_error("Is a directory");
+        return -1;
+    }
+    if (tmpfs_node_open(node))
+    {
+        set_error("File is open");
+        return -1;
+    }
+    tmpfs_set_pages(n, 0);
+    n->used = 0;
+    return 0;
+}
+
+int tmpfs_rmdir(const char* path)
+{
+    uint16_t node = 0;
+    if (tmpfs_lookup(path, &node) != 0)
+    {
+        return -1;
+    }
+    if (node == TMPFS_ROOT)
+    {
+        set_error("Cannot remove mount point");
+        return -1;
+    }
+    if (!g_tmpfs_nodes[node].is_dir)
+    {
+        set_error("Not a directory");
+        return -1;
+    }
+    for (uint32_t i = 1; i < TMPFS_NODES; ++i)
+    {
+        if (g_tmpfs_nodes[i].used && g_tmpfs_nodes[i].parent == node)
+        {
+            set_error("Directory not empty");
+            return -1;
+        }
+    }
+    g_tmpfs_nodes[node].used = 0;
+    return 0;
+}
+
+static struct tmpfs_handle* tmpfs_get_handle(int fd)
+{
+    if (fd < 0 || fd >= TMPFS_MAX_HANDLES || !g_tmpfs_handles[fd].used)
+    {
+        set_error("Bad handle");
+        return 0;
+    }
+    return &g_tmpfs_handles[fd];
+}
+
+int tmpfs_open(const char* path, int flags)
+{
+    int fd = 0;
+    while (fd < TMPFS_MAX_HANDLES && g_tmpfs_handles[fd].used)
+    {
+        fd++;
+    }
+    if (fd == TMPFS_MAX_HANDLES)
+    {
+        set_error("Too many open files");
+        return -1;
+    }
+
+    uint16_t node = 0;
+    if (tmpfs_lookup(path, &node) != 0)
+    {
+        if (!(flags & FAT_O_CREATE) || tmpfs_touch(path) != 0 || tmpfs_lookup(path, &node) != 0)
+        {
+            return -1;
+        }
+    }
+    struct tmpfs_node* n = &g_tmpfs_nodes[node];
+    if (n->is_dir)
+    {
+        set_error("Is a directory");
+        return -1;
+    }
+    if ((flags & FAT_O_TRUNC) && (flags & FAT_O_WRITE))
+    {
+        tmpfs_set_pages(n, 0);
+        n->size = 0;
+    }
+
+    struct tmpfs_handle* h = &g_tmpfs_handles[fd];
+    h->used = 1;
+    h->flags = (uint8_t)flags;
+    h->node = node;
+    h->pos = 0;
+    return fd;
+}
+
+int tmpfs_close(int fd)
+{
+    struct tmpfs_handle* h = tmpfs_get_handle(fd);
+    if (h == 0)
+    {
+        return -1;
+    }
+    h->used = 0;
+    return 0;
+}
+
+int tmpfs_read_at(int fd, uint32_t offset, void* buffer, size_t len, size_t* out_len)
+{
+    struct tmpfs_handle* h = tmpfs_get_handle(fd);
+    if (out_len)
+    {
+        *out_len = 0;
+    }
+    if (h == 0)
+    {
+        return -1;
+    }
+    const struct tmpfs_node* n = &g_tmpfs_nodes[h->node];
+    if (offset >= n->size)
+    {
+        h->pos = offset;
+        return 0;
+    }
+    if (len > n->size - offset)
+    {
+        len = n->size - offset;
+    }
+
+    uint8_t* out = (uint8_t*)buffer;
+    size_t done = 0;
+    while (done < len)
+    {
+        uint32_t pos = offset + (uint32_t)done;
+        uint32_t in_page = pos % TMPFS_PAGE_SIZE;
+        size_t chunk = TMPFS_PAGE_SIZE - in_page;
+        if (chunk > len - done)
+        {
+            chunk = len - done;
+        }
+        mem_copy(&out[done], &g_tmpfs_data[n->pages[pos / TMPFS_PAGE_SIZE]][in_page], chunk);
+        done += chunk;
+    }
+
+    h->pos = offset + (uint32_t)done;
+    if (out_len)
+    {
+        *out_len = done;
+    }
+    return 0;
+}
+
+int tmpfs_write_at(int fd, uint32_t offset, const void* buffer, size_t len)
+{
+    struct tmpfs_handle* h = tmpfs_get_handle(fd);
+    if (h == 0)
+    {
+        return -1;
+    }
+    if (!(h->flags & FAT_O_WRITE))
+    {
+        set_error("Not open for writing");
+        return -1;
+    }
+    if (len == 0)
+    {
+        return 0;
+    }
+    if ((uint64_t)offset + len > 0xFFFFFFFFull)
+    {
+        set_error("File too large");
+        return -1;
+    }
+
+    struct tmpfs_node* n = &g_tmpfs_nodes[h->node];
+    uint32_t end = offset + (uint32_t)len;
+    uint32_t need = tmpfs_pages_for(end);
+    if (need > n->page_count && tmpfs_set_pages(n, need) != 0)
+    {
+        return -1;
+    }
+
+    const uint8_t* in = (const uint8_t*)buffer;
+    size_t done = 0;
+    while (done < len)
+    {
+        uint32_t pos = offset + (uint32_t)done;
+        uint32_t in_page = pos % TMPFS_PAGE_SIZE;
+        size_t chunk = TMPFS_PAGE_SIZE - in_page;
+        if (chunk > len - done)
+        {
+            chunk = len - done;
+        }
+        mem_copy(&g_tmpfs_data[n->pages[pos / TMPFS_PAGE_SIZE]][in_page], &in[done], chunk);
+        done += chunk;
+    }
+
+    h->pos = end;
+    if (end > n->size)
+    {
+        n->size = end;
+    }
+    return 0;
+}
+
+int tmpfs_seek(int fd, int32_t offset, int whence, uint32_t* pos)
+{
+    struct tmpfs_handle* h = tmpfs_get_handle(fd);
+    if (h == 0)
+    {
+        return -1;
+    }
+
+    int64_t base = 0;
+    if (whence == FAT_SEEK_CUR)
+    {
+        base = h->pos;
+    }
+    else if (whence == FAT_SEEK_END)
+    {
+        base = g_tmpfs_nodes[h->node].size;
+    }
+    int64_t target = base + offset;
+    if (target < 0 || target > 0xFFFFFFFFll)
+    {
+        set_error("Invalid seek");
+        return -1;
+    }
+    h->pos = (uint32_t)target;
+    if (pos)
+    {
+        *pos = h->pos;
+    }
+    return 0;
+}
+
+// Shrinking releases every page past the new end, including reserved ones,
+// and clears the rest of the last page so a later grow reads zeros.
+int tmpfs_truncate(int fd, uint32_t size)
+{
+    struct tmpfs_handle* h = tmpfs_get_handle(fd);
+    if (h == 0)
+    {
+        return -1;
+    }
+    if (!(h->flags & FAT_O_WRITE))
+    {
+        set_error("Not open for writing");
+        return -1;
+    }
+
+    struct tmpfs_node* n = &g_tmpfs_nodes[h->node];
+    // Pages past the new end go too, including any from tmpfs_reserve
+    uint32_t need = tmpfs_pages_for(size);
+    if (tmpfs_set_pages(n, need) != 0)
+    {
+        return -1;
+    }
+    if (size < n->size)
+    {
+        if (size % TMPFS_PAGE_SIZE != 0)
+        {
+            uint32_t in_page = size % TMPFS_PAGE_SIZE;
+            mem_set(&g_tmpfs_data[n->pages[need - 1]][in_page], 0, TMPFS_PAGE_SIZE - in_page);
+        }
+        if (h->pos > size)
+        {
+            h->pos = size;
+        }
+    }
+    n->size = size;
+    return 0;
+}
+
+int tmpfs_reserve(int fd, uint32_t bytes)
+{
+    struct tmpfs_handle* h = tmpfs_get_handle(fd);
+    if (h == 0)
+    {
+        return -1;
+    }
+    struct tmpfs_node* n = &g_tmpfs_nodes[h->node];
+    uint32_t need = tmpfs_pages_for(bytes);
+    if (need > n->page_count)
+    {
+        return tmpfs_set_pages(n, need);
+    }
+    return 0;
+}
+
+uint32_t tmpfs_size(int fd)
+{
+    struct tmpfs_handle* h = tmpfs_get_handle(fd);
+    return h != 0 ? g_tmpfs_nodes[h->node].size : 0;
+}
+
+void tmpfs_usage(uint32_t* used_pages, uint32_t* total_pages)
+{
+    *used_pages = TMPFS_PAGES - g_tmpfs_free_count;
+    *total_pages = TMPFS_PAGES;
+}
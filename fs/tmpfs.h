@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TMPFS_PAGE_SIZE 4096
+#define TMPFS_PAGES 128
+#define TMPFS_NODES 64
+#define TMPFS_MAX_HANDLES 8
+#define TMPFS_NAME_MAX 13
+
+// Paths are relative to the mount point and already canonical: "/" is the
+// tmpfs root and components are 8.3 names as produced by the FAT layer.
+// Open flags and seek origins are the FAT_O_* and FAT_SEEK_* values.
+void tmpfs_init(void);
+const char* tmpfs_last_error(void);
+int tmpfs_ls(const char* path);
+int tmpfs_is_dir(const char* path);
+int tmpfs_mkdir(const char* path);
+int tmpfs_touch(const char* path);
+int tmpfs_rm(const char* path);
+int tmpfs_rmdir(const char* path);
+
+int tmpfs_open(const char* path, int flags);
+int tmpfs_close(int fd);
+int tmpfs_read_at(int fd, uint32_t offset, void* buffer, size_t len, size_t* out_len);
+int tmpfs_write_at(int fd, uint32_t offset, const void* buffer, size_t len);
+int tmpfs_seek(int fd, int32_t offset, int whence, uint32_t* pos);
+int tmpfs_truncate(int fd, uint32_t size);
+int tmpfs_reserve(int fd, uint32_t bytes);
+uint32_t tmpfs_size(int fd);
+void tmpfs_usage(uint32_t* used_pages, uint32_t* total_pages);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #if defined(__GNUC__) || defined(__clang__)
@@ -32,6 +33,33 @@ static inline uint16_t inw(uint16_t port)
     return value;
 }
 
+static inline void outl(uint16_t port, uint32_t value)
+{
+    ASM_VOLATILE("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port)
+{
+    uint32_t value;
+    ASM_VOLATILE("inl %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+static inline void insw(uint16_t port, void* buffer, size_t count)
+{
+    ASM_VOLATILE("rep insw" : "+D"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void* buffer, size_t count)
+{
+    ASM_VOLATILE("rep outsw" : "+S"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void insl(uint16_t port, void* buffer, size_t count)
+{
+    ASM_VOLATILE("rep insl" : "+D"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
 static inline void io_wait(void)
 {
     ASM_VOLATILE("outb %%al, $0x80" : : "a"(0));
@@ -0,0 +1,173 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bench.h"
+#include "console.h"
+#include "drivers/ata.h"
+#include "drivers/block.h"
+#include "drivers/virtio_blk.h"
+#include "timer.h"
+
+#define BENCH_SECTORS 2048
+#define BENCH_CHUNK_SECTORS 64
+
+static uint8_t g_bench_buffer[BENCH_CHUNK_SECTORS * ATA_SECTOR_SIZE];
+
+static void u32_to_str(uint32_t value, char* out, size_t out_len)
+{
+    if (out_len == 0)
+    {
+        return;
+    }
+
+    char temp[16];
+    size_t idx = 0;
+    if (value == 0)
+    {
+        temp[idx++] = '0';
+    }
+    else
+    {
+        while (value > 0 && idx < sizeof(temp))
+        {
+            temp[idx++] = (char)('0' + (value % 10));
+            value /= 10;
+        }
+    }
+
+    size_t out_idx = 0;
+    while (idx > 0 && out_idx + 1 < out_len)
+    {
+        out[out_idx++] = temp[--idx];
+    }
+    out[out_idx] = '\0';
+}
+
+static void bench_write_u32(uint32_t value)
+{
+    char buf[16];
+    u32_to_str(value, buf, sizeof(buf));
+    console_write(buf);
+}
+
+static void bench_report(const char* label, uint32_t sectors, uint32_t elapsed_us)
+{
+    console_write(label);
+    bench_write_u32(timer_per_second(sectors, elapsed_us));
+    console_write(" sectors/s, ");
+    bench_write_u32(timer_per_second(sectors / 2, elapsed_us));
+    console_write(" KB/s (");
+    bench_write_u32(elapsed_us / 1000);
+    console_write(" ms)\n");
+}
+
+static int bench_ata_read(const char* label, int path, int dma, uint32_t sectors)
+{
+    ata_set_pio_path(path);
+    ata_set_dma(dma);
+
+    uint64_t start = timer_now();
+    for (uint32_t lba = 0; lba < sectors; lba += BENCH_CHUNK_SECTORS)
+    {
+        uint32_t n = sectors - lba;
+        if (n > BENCH_CHUNK_SECTORS)
+        {
+            n = BENCH_CHUNK_SECTORS;
+        }
+        if (ata_read_sectors(lba, n, g_bench_buffer) != 0)
+        {
+            console_write(label);
+            console_write("read failed\n");
+            return -1;
+        }
+    }
+    uint64_t end = timer_now();
+
+    bench_report(label, sectors, timer_elapsed_us(start, end));
+    return 0;
+}
+
+// Same sequential read through the block layer, so every registered backend
+// (ATA, AHCI, virtio-blk) is measured with identical request sizes.
+static int bench_block_read(struct block_device* dev, uint32_t sectors)
+{
+    if (dev->sector_count != 0 && dev->sector_count < sectors)
+    {
+        sectors = dev->sector_count;
+    }
+
+    uint64_t start = timer_now();
+    for (uint32_t lba = 0; lba < sectors; lba += BENCH_CHUNK_SECTORS)
+    {
+        uint32_t n = sectors - lba;
+        if (n > BENCH_CHUNK_SECTORS)
+        {
+            n = BENCH_CHUNK_SECTORS;
+        }
+        if (block_read(dev, lba, n, g_bench_buffer) != 0)
+        {
+            console_write("  ");
+            console_write(dev->name);
+            console_write(": read failed\n");
+            return -1;
+        }
+    }
+    uint64_t end = timer_now();
+
+    console_write("  ");
+    console_write(dev->name);
+    console_write(": ");
+    bench_report("", sectors, timer_elapsed_us(start, end));
+    return 0;
+}
+
+void bench_disk(void)
+{
+    uint32_t sectors = BENCH_SECTORS;
+    if (ata_sector_count() != 0 && ata_sector_count() < sectors)
+    {
+        sectors = ata_sector_count();
+    }
+
+    console_write("ATA read, ");
+    bench_write_u32(sectors / 2);
+    console_write(" KB in ");
+    bench_write_u32(BENCH_CHUNK_SECTORS);
+    console_write("-sector commands\n");
+
+    int saved_path = ata_pio_path();
+    int saved_dma = ata_dma_enabled();
+    if (bench_ata_read("  inw loop: ", ATA_PIO_WORDS, 0, sectors) == 0 &&
+        bench_ata_read("  rep insw: ", ATA_PIO_STRING, 0, sectors) == 0 &&
+        ata_dma_available())
+    {
+        bench_ata_read("  DMA:      ", ATA_PIO_STRING, 1, sectors);
+    }
+    ata_set_pio_path(saved_path);
+    ata_set_dma(saved_dma);
+
+    if (block_device_count() == 0)
+    {
+        return;
+    }
+
+    console_write("Block devices, ");
+    bench_write_u32(BENCH_SECTORS / 2);
+    console_write(" KB each\n");
+    for (int i = 0; i < block_device_count(); ++i)
+    {
+        bench_block_read(block_device_at(i), BENCH_SECTORS);
+    }
+
+    uint32_t requests = 0;
+    uint32_t kicks = 0;
+    virtio_blk_stats(&requests, &kicks);
+    if (kicks != 0)
+    {
+        console_write("  virtio: ");
+        bench_write_u32(requests);
+        console_write(" requests in ");
+        bench_write_u32(kicks);
+        console_write(" kicks\n");
+    }
+}
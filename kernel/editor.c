@@ -7,15 +7,18 @@
 #include "keyboard.h"
 #include "clipboard.h"
 
-#define EDITOR_MAX_SIZE 16384
+#define EDITOR_MAX_SIZE 131072
 #define STATUS_MSG_MAX 64
-#define FILENAME_MAX 32
+#define FILENAME_MAX FAT_PATH_MAX
 
 static char g_buffer[EDITOR_MAX_SIZE];
 static size_t g_len = 0;
 static size_t g_cursor = 0;
 static uint32_t g_scroll_row = 0;
 static uint8_t g_dirty = 0;
+// Everything before this offset still matches the file on disk, so a save
+// only has to write from here on.
+static size_t g_save_from = 0;
 static uint8_t g_quit_confirm = 0;
 static char g_status[STATUS_MSG_MAX];
 static char g_filename[FILENAME_MAX];
@@ -469,6 +472,14 @@ static void editor_render(void)
     g_status_updated = 0;
 }
 
+static void editor_mark_changed(size_t offset)
+{
+    if (offset < g_save_from)
+    {
+        g_save_from = offset;
+    }
+}
+
 static void editor_insert_char(char c)
 {
     if (g_len + 1 >= EDITOR_MAX_SIZE)
@@ -477,6 +488,7 @@ static void editor_insert_char(char c)
         return;
     }
 
+    editor_mark_changed(g_cursor);
     mem_move(&g_buffer[g_cursor + 1], &g_buffer[g_cursor], g_len - g_cursor);
     g_buffer[g_cursor] = c;
     g_cursor++;
@@ -494,6 +506,7 @@ static void editor_backspace(void)
         return;
     }
 
+    editor_mark_changed(g_cursor - 1);
     mem_move(&g_buffer[g_cursor - 1], &g_buffer[g_cursor], g_len - g_cursor);
     g_cursor--;
     g_len--;
@@ -547,11 +560,27 @@ static void editor_move_down(void)
 
 static int editor_save(void)
 {
-    if (fat_write_data(g_filename, g_buffer, g_len) != 0)
+    int fd = fat_open(g_filename, FAT_O_WRITE | FAT_O_CREATE);
+    int rc = fd < 0 ? -1 : 0;
+    if (rc == 0)
+    {
+        size_t from = g_save_from < g_len ? g_save_from : g_len;
+        rc = fat_write_at(fd, (uint32_t)from, &g_buffer[from], g_len - from);
+        if (rc == 0)
+        {
+            rc = fat_truncate(fd, (uint32_t)g_len);
+        }
+        if (fat_close(fd) != 0)
+        {
+            rc = -1;
+        }
+    }
+    if (rc != 0 || fat_sync() != 0)
     {
         editor_set_status(fat_last_error());
         return -1;
     }
+    g_save_from = g_len;
     g_dirty = 0;
     editor_set_status("Saved");
     return 0;
@@ -559,14 +588,15 @@ static int editor_save(void)
 
 static int editor_load(const char* filename)
 {
-    size_t out_size = 0;
-    if (fat_read(filename, g_buffer, sizeof(g_buffer), &out_size) != 0)
+    int fd = fat_open(filename, FAT_O_READ);
+    if (fd < 0)
     {
         if (str_eq(fat_last_error(), "Not found"))
         {
             g_len = 0;
             g_buffer[0] = '\0';
             g_cursor = 0;
+            g_save_from = 0;
             g_dirty = 0;
             editor_set_status("New file");
             return 0;
@@ -574,9 +604,25 @@ static int editor_load(const char* filename)
         return -1;
     }
 
+    if (fat_size(fd) >= EDITOR_MAX_SIZE)
+    {
+        fat_close(fd);
+        editor_set_status("File too large");
+        return -1;
+    }
+
+    size_t out_size = 0;
+    if (fat_read_at(fd, 0, g_buffer, EDITOR_MAX_SIZE - 1, &out_size) != 0)
+    {
+        fat_close(fd);
+        return -1;
+    }
+    fat_close(fd);
+
     g_len = out_size;
     g_buffer[g_len] = '\0';
     g_cursor = 0;
+    g_save_from = g_len;
     g_dirty = 0;
     editor_set_status("");
     return 0;
@@ -605,6 +651,7 @@ static void editor_paste(void)
         return;
     }
 
+    editor_mark_changed(g_cursor);
     size_t i = 0;
     while (clipboard_data[i] != '\0')
     {
@@ -643,7 +690,7 @@ int editor_run(const char* filename)
     if (editor_load(g_filename) != 0)
     {
         console_write("Editor error: ");
-        console_write(fat_last_error());
+        console_write(g_status[0] != '\0' ? g_status : fat_last_error());
         console_putc('\n');
         return -1;
     }
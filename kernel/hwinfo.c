@@ -2,6 +2,7 @@
 #include <stddef.h>
 
 #include "console.h"
+#include "drivers/block.h"
 #include "hwinfo.h"
 #include "io.h"
 
@@ -155,3 +156,44 @@ void hwinfo_display(void)
 
     console_write("VGA memory: 0xB8000 (80x25 text mode)\n");
 }
+
+static void write_u32(uint32_t value)
+{
+    char buf[16];
+    u32_to_str(value, buf, sizeof(buf));
+    console_write(buf);
+}
+
+void hwinfo_block_devices(void)
+{
+    if (block_device_count() == 0)
+    {
+        console_write("No block devices\n");
+        return;
+    }
+
+    for (int i = 0; i < block_device_count(); ++i)
+    {
+        struct block_device* dev = block_device_at(i);
+        console_write(dev->name);
+        console_write(": ");
+        write_u32(dev->sector_count / 2048);
+        console_write(" MB, ");
+        write_u32(dev->sector_size);
+        console_write(" B sectors, max ");
+        write_u32(dev->max_sectors);
+        console_write(" per transfer\n");
+
+        console_write("  queue depth ");
+        write_u32(dev->queue.count);
+        console_write(" (max ");
+        write_u32(dev->stats.max_depth);
+        console_write("), ");
+        write_u32(dev->stats.submitted);
+        console_write(" requests, ");
+        write_u32(dev->stats.merged);
+        console_write(" merged, ");
+        write_u32(dev->stats.dispatched);
+        console_write(" dispatched\n");
+    }
+}
@@ -3,4 +3,5 @@
 #include <stdint.h>
 
 void hwinfo_display(void);
+void hwinfo_block_devices(void);
 uint32_t hwinfo_get_memory_kb(void);
@@ -0,0 +1,202 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "io.h"
+#include "irq.h"
+
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA    0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA    0xA1
+
+#define PIC_EOI      0x20
+#define PIC_READ_ISR 0x0B
+
+#define IRQ_VECTOR_BASE 0x20
+#define IRQ_COUNT 16
+
+#if defined(__x86_64__) || defined(__amd64__)
+struct idt_entry
+{
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t ist;
+    uint8_t type_attr;
+    uint16_t offset_mid;
+    uint32_t offset_high;
+    uint32_t zero;
+} __attribute__((packed));
+
+struct idt_pointer
+{
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed));
+#else
+struct idt_entry
+{
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t zero;
+    uint8_t type_attr;
+    uint16_t offset_high;
+} __attribute__((packed));
+
+struct idt_pointer
+{
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed));
+#endif
+
+// Entry points live in arch/x86/boot/irq.asm (irq64.asm for the 64-bit build)
+extern const uintptr_t irq_stub_table[IRQ_COUNT];
+
+void irq_dispatch(uint32_t irq);
+
+static struct idt_entry g_idt[256] __attribute__((aligned(16)));
+static irq_handler_t g_irq_handlers[IRQ_COUNT];
+static uint16_t g_irq_mask = 0xFFFF;
+
+static void idt_set_gate(uint8_t vector, uintptr_t handler, uint16_t selector)
+{
+    struct idt_entry* e = &g_idt[vector];
+    e->offset_low = (uint16_t)(handler & 0xFFFF);
+    e->selector = selector;
+    e->type_attr = 0x8E;
+#if defined(__x86_64__) || defined(__amd64__)
+    e->ist = 0;
+    e->offset_mid = (uint16_t)((handler >> 16) & 0xFFFF);
+    e->offset_high = (uint32_t)(handler >> 32);
+    e->zero = 0;
+#else
+    e->zero = 0;
+    e->offset_high = (uint16_t)(handler >> 16);
+#endif
+}
+
+static void pic_write_mask(void)
+{
+    outb(PIC1_DATA, (uint8_t)(g_irq_mask & 0xFF));
+    outb(PIC2_DATA, (uint8_t)(g_irq_mask >> 8));
+}
+
+static void pic_remap(void)
+{
+    outb(PIC1_COMMAND, 0x11);
+    io_wait();
+    outb(PIC2_COMMAND, 0x11);
+    io_wait();
+    outb(PIC1_DATA, IRQ_VECTOR_BASE);
+    io_wait();
+    outb(PIC2_DATA, IRQ_VECTOR_BASE + 8);
+    io_wait();
+    outb(PIC1_DATA, 0x04);
+    io_wait();
+    outb(PIC2_DATA, 0x02);
+    io_wait();
+    outb(PIC1_DATA, 0x01);
+    io_wait();
+    outb(PIC2_DATA, 0x01);
+    io_wait();
+
+    // Everything masked except the cascade line; drivers unmask what they use
+    g_irq_mask = 0xFFFF & ~(1 << 2);
+    pic_write_mask();
+}
+
+void irq_init(void)
+{
+    uint8_t* dst = (uint8_t*)g_idt;
+    for (size_t i = 0; i < sizeof(g_idt); ++i)
+    {
+        dst[i] = 0;
+    }
+
+#if defined(__x86_64__) || defined(__amd64__)
+    // Keep the exception gates installed by entry64.asm
+    struct idt_pointer old;
+    asm volatile("sidt %0" : "=m"(old));
+    const uint8_t* src = (const uint8_t*)(uintptr_t)old.base;
+    size_t old_size = (size_t)old.limit + 1;
+    if (src != 0 && old_size <= sizeof(g_idt))
+    {
+        for (size_t i = 0; i < old_size; ++i)
+        {
+            dst[i] = src[i];
+        }
+    }
+#endif
+
+    uint16_t cs;
+    asm volatile("mov %%cs, %0" : "=r"(cs));
+    for (uint8_t irq = 0; irq < IRQ_COUNT; ++irq)
+    {
+        idt_set_gate((uint8_t)(IRQ_VECTOR_BASE + irq), irq_stub_table[irq], cs);
+    }
+
+    struct idt_pointer ptr;
+    ptr.limit = (uint16_t)(sizeof(g_idt) - 1);
+    ptr.base = (uintptr_t)g_idt;
+    asm volatile("lidt %0" : : "m"(ptr));
+
+    pic_remap();
+}
+
+void irq_register(uint8_t irq, irq_handler_t handler)
+{
+    if (irq >= IRQ_COUNT)
+    {
+        return;
+    }
+    g_irq_handlers[irq] = handler;
+    g_irq_mask &= (uint16_t)~(1 << irq);
+    pic_write_mask();
+}
+
+void irq_enable(void)
+{
+    asm volatile("sti" : : : "memory");
+}
+
+void irq_disable(void)
+{
+    asm volatile("cli" : : : "memory");
+}
+
+void irq_wait(void)
+{
+    // sti only takes effect after the next instruction, so no IRQ can slip in
+    // between the caller's check and the hlt
+    asm volatile("sti; hlt" : : : "memory");
+}
+
+static int pic_in_service(uint16_t command_port, uint8_t bit)
+{
+    outb(command_port, PIC_READ_ISR);
+    return (inb(command_port) & bit) != 0;
+}
+
+void irq_dispatch(uint32_t irq)
+{
+    if (irq == 7 && !pic_in_service(PIC1_COMMAND, 0x80))
+    {
+        return;
+    }
+    if (irq == 15 && !pic_in_service(PIC2_COMMAND, 0x80))
+    {
+        outb(PIC1_COMMAND, PIC_EOI);
+        return;
+    }
+
+    if (irq < IRQ_COUNT && g_irq_handlers[irq] != 0)
+    {
+        g_irq_handlers[irq]();
+    }
+
+    if (irq >= 8)
+    {
+        outb(PIC2_COMMAND, PIC_EOI);
+    }
+    outb(PIC1_COMMAND, PIC_EOI);
+}
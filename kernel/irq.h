@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef void (*irq_handler_t)(void);
+
+void irq_init(void);
+void irq_register(uint8_t irq, irq_handler_t handler);
+void irq_enable(void);
+void irq_disable(void);
+void irq_wait(void);
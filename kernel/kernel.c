@@ -2,7 +2,13 @@
 #include <stddef.h>
 
 #include "console.h"
+#include "drivers/ahci.h"
+#include "drivers/ata.h"
+#include "drivers/nvme.h"
+#include "drivers/virtio_blk.h"
 #include "framebuffer.h"
+#include "fs/bcache.h"
+#include "fs/dcache.h"
 #include "fs/fat.h"
 #include "io.h"
 #include "keyboard.h"
@@ -11,6 +17,15 @@
 #include "exec.h"
 #include "snake.h"
 #include "clipboard.h"
+#include "bench.h"
+#include "irq.h"
+#include "timer.h"
+
+// Dirty file data and FAT updates reach the disk at most this long after
+// the command that produced them; `sync` forces them out at once.
+#define SYNC_INTERVAL_SECONDS 5
+
+static uint32_t g_last_sync_tick = 0;
 
 static const char *skip_spaces(const char *s)
 {
@@ -21,6 +36,41 @@ static const char *skip_spaces(const char *s)
     return s;
 }
 
+static int parse_u32(const char *s, uint32_t *out)
+{
+    uint32_t value = 0;
+    if (*s < '0' || *s > '9')
+    {
+        return -1;
+    }
+    while (*s >= '0' && *s <= '9')
+    {
+        value = value * 10 + (uint32_t)(*s - '0');
+        s++;
+    }
+    if (*s != '\0' && *s != ' ')
+    {
+        return -1;
+    }
+    *out = value;
+    return 0;
+}
+
+static void write_u32(uint32_t value)
+{
+    char temp[16];
+    int len = 0;
+    do
+    {
+        temp[len++] = (char)('0' + (value % 10));
+        value /= 10;
+    } while (value > 0);
+    while (len > 0)
+    {
+        console_putc(temp[--len]);
+    }
+}
+
 #define HISTORY_MAX 20
 #define HISTORY_SIZE 128
 static char g_history[HISTORY_MAX][HISTORY_SIZE];
@@ -114,14 +164,35 @@ static void debug_show_status(uint8_t st)
     console_write_at(24, 68, buf);
 }
 
+static void sync_now(void)
+{
+    g_last_sync_tick = timer_ticks();
+    if (fat_sync() != 0)
+    {
+        console_write("sync: ");
+        console_write(fat_last_error());
+        console_putc('\n');
+    }
+}
+
+static void sync_if_due(void)
+{
+    if (timer_ticks() - g_last_sync_tick >= timer_tick_hz() * SYNC_INTERVAL_SECONDS)
+    {
+        sync_now();
+    }
+}
+
 static void shutdown(void)
 {
+    fat_sync();
     outw(0x604, 0x2000);
     outw(0xB004, 0x2000);
 }
 
 static void restart(void)
 {
+    fat_sync();
     while (inb(0x64) & 0x02)
     {
     }
@@ -159,10 +230,10 @@ static void execute_command(const char *line)
 
     if (cmd_is(cmd, cmd_len, "help"))
     {
-        console_write("System: help, clear, info, hw, df, shutdown, restart\n");
+        console_write("System: help, clear, info, hw, lsblk, cache, ra, df, defrag, sync, shutdown, restart\n");
         console_write("Navigation: ls, cd, pwd, mkdir, rmdir\n");
-        console_write("Files: touch, cat, write, rm, cp\n");
-        console_write("Tools: v, paste, exec, ss, snake, echo\n");
+        console_write("Files: touch, cat, write, append, fallocate, rm, cp\n");
+        console_write("Tools: v, paste, exec, ss, snake, echo, bench\n");
         console_write("\nUse UP/DOWN arrow keys to navigate command history.\n");
         console_write("Use Ctrl+V to paste clipboard content.\n");
         return;
@@ -311,7 +382,7 @@ static void execute_command(const char *line)
             console_write("Usage: cp <src> <dst>\n");
             return;
         }
-        char src[13];
+        char src[FAT_PATH_MAX];
         size_t i = 0;
         while (arg[i] != '\0' && arg[i] != ' ' && i + 1 < sizeof(src))
         {
@@ -325,11 +396,28 @@ static void execute_command(const char *line)
             console_write("Usage: cp <src> <dst>\n");
             return;
         }
+        uint64_t start = timer_now();
         if (fat_cp(src, dst) != 0)
         {
             console_write(fat_last_error());
             console_putc('\n');
+            return;
         }
+        uint32_t elapsed_us = timer_elapsed_us(start, timer_now());
+        struct fat_copy_stats stats;
+        fat_get_copy_stats(&stats);
+        uint32_t tenths = timer_per_second(stats.bytes, elapsed_us) / 104858;
+        console_write("Copied ");
+        write_u32(stats.bytes);
+        console_write(" bytes in ");
+        write_u32(stats.transfers);
+        console_write(" transfers, ");
+        write_u32(tenths / 10);
+        console_putc('.');
+        write_u32(tenths % 10);
+        console_write(" MB/s (");
+        write_u32(elapsed_us / 1000);
+        console_write(" ms)\n");
         return;
     }
 
@@ -340,7 +428,7 @@ static void execute_command(const char *line)
             console_write("Usage: write <name> <text>\n");
             return;
         }
-        char name[13];
+        char name[FAT_PATH_MAX];
         size_t i = 0;
         while (arg[i] != '\0' && arg[i] != ' ' && i + 1 < sizeof(name))
         {
@@ -362,6 +450,64 @@ static void execute_command(const char *line)
         return;
     }
 
+    if (cmd_is(cmd, cmd_len, "append"))
+    {
+        if (*arg == '\0')
+        {
+            console_write("Usage: append <name> <text>\n");
+            return;
+        }
+        char name[FAT_PATH_MAX];
+        size_t i = 0;
+        while (arg[i] != '\0' && arg[i] != ' ' && i + 1 < sizeof(name))
+        {
+            name[i] = arg[i];
+            i++;
+        }
+        name[i] = '\0';
+        const char *text = skip_spaces(arg + i);
+        if (name[0] == '\0')
+        {
+            console_write("Usage: append <name> <text>\n");
+            return;
+        }
+        size_t text_len = 0;
+        while (text[text_len] != '\0')
+        {
+            text_len++;
+        }
+        if (fat_append(name, text, text_len) != 0)
+        {
+            console_write(fat_last_error());
+            console_putc('\n');
+        }
+        return;
+    }
+
+    if (cmd_is(cmd, cmd_len, "fallocate"))
+    {
+        char name[FAT_PATH_MAX];
+        size_t i = 0;
+        while (arg[i] != '\0' && arg[i] != ' ' && i + 1 < sizeof(name))
+        {
+            name[i] = arg[i];
+            i++;
+        }
+        name[i] = '\0';
+        uint32_t bytes = 0;
+        if (name[0] == '\0' || parse_u32(skip_spaces(arg + i), &bytes) != 0)
+        {
+            console_write("Usage: fallocate <name> <bytes>\n");
+            return;
+        }
+        if (fat_fallocate(name, bytes) != 0)
+        {
+            console_write(fat_last_error());
+            console_putc('\n');
+        }
+        return;
+    }
+
     if (cmd_is(cmd, cmd_len, "paste"))
     {
         const char *content = clipboard_paste();
@@ -384,7 +530,7 @@ static void execute_command(const char *line)
             console_write("Usage: v <name>\n");
             return;
         }
-        char name[13];
+        char name[FAT_PATH_MAX];
         size_t i = 0;
         while (arg[i] != '\0' && arg[i] != ' ' && i + 1 < sizeof(name))
         {
@@ -422,7 +568,7 @@ static void execute_command(const char *line)
             console_write("Usage: ss <file>\n");
             return;
         }
-        char filename[13];
+        char filename[FAT_PATH_MAX];
         size_t i = 0;
         while (arg[i] != '\0' && arg[i] != ' ' && i + 1 < sizeof(filename))
         {
@@ -431,44 +577,56 @@ static void execute_command(const char *line)
         }
         filename[i] = '\0';
         
-        char script_buffer[4096];
-        size_t script_size = 0;
-        
-        if (fat_read(filename, script_buffer, sizeof(script_buffer) - 1, &script_size) != 0)
-        {
-            console_write("ss: ");
-            console_write(fat_last_error());
-            console_putc('\n');
-            return;
-        }
-        
-        script_buffer[script_size] = '\0';
+        // Stream the script a chunk at a time so its size is not bounded
+        // by a buffer; lines are assembled across chunk boundaries. The
+        // file is only open while a chunk is read, so script lines may
+        // defrag the volume or rewrite the script itself.
+        char chunk[512];
+        char line_buffer[128];
+        size_t line_len = 0;
+        uint32_t offset = 0;
+        int done = 0;
         
-        size_t line_start = 0;
-        size_t pos = 0;
-        
-        while (pos <= script_size)
+        while (!done)
         {
-            if (pos == script_size || script_buffer[pos] == '\n')
+            size_t got = 0;
+            int fd = fat_open(filename, FAT_O_READ);
+            int rc = fd < 0 ? -1 : fat_read_at(fd, offset, chunk, sizeof(chunk), &got);
+            if (fd >= 0 && fat_close(fd) != 0)
             {
-                char line_buffer[128];
-                size_t line_len = pos - line_start;
-                
-                if (line_len > 0 && script_buffer[line_start + line_len - 1] == '\r')
+                rc = -1;
+            }
+            if (rc != 0)
+            {
+                console_write("ss: ");
+                console_write(fat_last_error());
+                console_putc('\n');
+                if (offset == 0)
                 {
-                    line_len--;
+                    return;
                 }
-                
-                if (line_len >= sizeof(line_buffer))
+                break;
+            }
+            offset += (uint32_t)got;
+            done = got == 0;
+            
+            for (size_t pos = 0; pos < got || (done && pos == got); pos++)
+            {
+                if (!done && chunk[pos] != '\n')
                 {
-                    line_len = sizeof(line_buffer) - 1;
+                    if (line_len + 1 < sizeof(line_buffer))
+                    {
+                        line_buffer[line_len++] = chunk[pos];
+                    }
+                    continue;
                 }
                 
-                for (size_t j = 0; j < line_len; j++)
+                if (line_len > 0 && line_buffer[line_len - 1] == '\r')
                 {
-                    line_buffer[j] = script_buffer[line_start + j];
+                    line_len--;
                 }
                 line_buffer[line_len] = '\0';
+                line_len = 0;
                 
                 const char *trimmed = skip_spaces(line_buffer);
                 if (trimmed[0] != '\0' && trimmed[0] != '#')
@@ -477,20 +635,32 @@ static void execute_command(const char *line)
                     console_write(trimmed);
                     console_putc('\n');
                     execute_command(trimmed);
+                    // Long scripts still commit periodically so freed
+                    // clusters become reusable before the script ends.
+                    sync_if_due();
                 }
-                
-                line_start = pos + 1;
             }
-            pos++;
         }
         
+        sync_now();
         console_write("ss: script finished\n");
         return;
     }
 
     if (cmd_is(cmd, cmd_len, "df"))
     {
-        if (fat_df() != 0)
+        int rc = (arg[0] == '-' && arg[1] == 'v') ? fat_df_verify() : fat_df();
+        if (rc != 0)
+        {
+            console_write(fat_last_error());
+            console_putc('\n');
+        }
+        return;
+    }
+
+    if (cmd_is(cmd, cmd_len, "defrag"))
+    {
+        if (fat_defrag() != 0)
         {
             console_write(fat_last_error());
             console_putc('\n');
@@ -498,6 +668,49 @@ static void execute_command(const char *line)
         return;
     }
 
+    if (cmd_is(cmd, cmd_len, "sync"))
+    {
+        sync_now();
+        return;
+    }
+
+    if (cmd_is(cmd, cmd_len, "lsblk"))
+    {
+        hwinfo_block_devices();
+        return;
+    }
+
+    if (cmd_is(cmd, cmd_len, "cache"))
+    {
+        bcache_report();
+        dcache_report();
+        return;
+    }
+
+    if (cmd_is(cmd, cmd_len, "ra"))
+    {
+        if (arg[0] != '\0')
+        {
+            uint32_t clusters = 0;
+            if (parse_u32(arg, &clusters) != 0)
+            {
+                console_write("Usage: ra [clusters]\n");
+                return;
+            }
+            fat_set_readahead(clusters);
+        }
+        console_write("Read-ahead window: ");
+        write_u32(fat_get_readahead());
+        console_write(" clusters\n");
+        return;
+    }
+
+    if (cmd_is(cmd, cmd_len, "bench"))
+    {
+        bench_disk();
+        return;
+    }
+
     if (cmd_is(cmd, cmd_len, "snake"))
     {
         snake_game_run();
@@ -537,12 +750,26 @@ void kernel_main(void)
 {
     console_clear();
     console_write("Kernel C loaded.\n");
+    irq_init();
+    timer_init();
+    timer_start_tick(100);
+    ata_init();
+    ahci_init();
+    virtio_blk_init();
+    nvme_init();
+    irq_enable();
     if (fat_init() != 0)
     {
         console_write("FAT init failed: ");
         console_write(fat_last_error());
         console_putc('\n');
     }
+    if (fat_mount_tmpfs("/tmp") != 0)
+    {
+        console_write("tmpfs mount failed: ");
+        console_write(fat_last_error());
+        console_putc('\n');
+    }
 
 #if defined(__x86_64__) || defined(__amd64__)
     if (fb_init(mb2_info) == 0)
@@ -571,6 +798,7 @@ void kernel_main(void)
         debug_show_status(keyboard_last_status());
         if (!has_data)
         {
+            sync_if_due();
             continue;
         }
 
@@ -672,6 +900,7 @@ void kernel_main(void)
                 history_add(line);
             }
             execute_command(line);
+            sync_if_due();
             len = 0;
             line[0] = '\0';
             print_prompt();
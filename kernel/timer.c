@@ -0,0 +1,113 @@
+#include <stdint.h>
+
+#include "io.h"
+#include "irq.h"
+#include "timer.h"
+
+#define PIT_FREQUENCY 1193182
+#define PIT_CALIBRATE_MS 10
+
+static uint32_t g_cycles_per_us = 0;
+static volatile uint32_t g_ticks = 0;
+static uint32_t g_tick_hz = 0;
+
+static uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// 64/32 division without pulling in libgcc's __udivdi3 on 32-bit builds
+static uint64_t u64_div_u32(uint64_t n, uint32_t d)
+{
+    uint64_t q = 0;
+    uint64_t r = 0;
+    for (int i = 63; i >= 0; --i)
+    {
+        r = (r << 1) | ((n >> i) & 1);
+        if (r >= d)
+        {
+            r -= d;
+            q |= (uint64_t)1 << i;
+        }
+    }
+    return q;
+}
+
+void timer_init(void)
+{
+    uint32_t latch = PIT_FREQUENCY / (1000 / PIT_CALIBRATE_MS);
+
+    // PIT channel 2, gate enabled, speaker disconnected, one-shot countdown
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+    outb(0x43, 0xB0);
+    outb(0x42, (uint8_t)(latch & 0xFF));
+    outb(0x42, (uint8_t)(latch >> 8));
+
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < 100000000 && (inb(0x61) & 0x20) == 0; ++i)
+    {
+    }
+    uint64_t end = rdtsc();
+
+    uint64_t cycles = u64_div_u32(end - start, PIT_CALIBRATE_MS * 1000);
+    g_cycles_per_us = cycles > 0 ? (uint32_t)cycles : 1;
+}
+
+static void timer_irq(void)
+{
+    g_ticks++;
+}
+
+void timer_start_tick(uint32_t hz)
+{
+    uint32_t divisor = PIT_FREQUENCY / hz;
+    if (divisor > 0xFFFF)
+    {
+        divisor = 0xFFFF;
+    }
+
+    // PIT channel 0, lobyte/hibyte, square wave generator
+    outb(0x43, 0x36);
+    outb(0x40, (uint8_t)(divisor & 0xFF));
+    outb(0x40, (uint8_t)(divisor >> 8));
+
+    g_tick_hz = hz;
+    irq_register(0, timer_irq);
+}
+
+uint32_t timer_ticks(void)
+{
+    return g_ticks;
+}
+
+uint32_t timer_tick_hz(void)
+{
+    return g_tick_hz;
+}
+
+uint64_t timer_now(void)
+{
+    return rdtsc();
+}
+
+uint32_t timer_elapsed_us(uint64_t start, uint64_t end)
+{
+    if (g_cycles_per_us == 0)
+    {
+        timer_init();
+    }
+    uint64_t us = u64_div_u32(end - start, g_cycles_per_us);
+    return us > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)us;
+}
+
+uint32_t timer_per_second(uint32_t count, uint32_t elapsed_us)
+{
+    if (elapsed_us == 0)
+    {
+        elapsed_us = 1;
+    }
+    uint64_t rate = u64_div_u32((uint64_t)count * 1000000, elapsed_us);
+    return rate > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)rate;
+}
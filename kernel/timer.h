@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+
+void timer_init(void);
+void timer_start_tick(uint32_t hz);
+uint32_t timer_ticks(void);
+uint32_t timer_tick_hz(void);
+uint64_t timer_now(void);
+uint32_t timer_elapsed_us(uint64_t start, uint64_t end);
+uint32_t timer_per_second(uint32_t count, uint32_t elapsed_us);